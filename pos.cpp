@@ -1,635 +1,9835 @@
-#include <iostream>
-#include <fstream>
-#include <vector>
-#include <map>
-#include <string>
-#include <ctime>
-#include <cstdlib>
-#include <iomanip>
-#include <sstream>
-#include <array>
-
-using namespace std;
-
-// Payment Details Structure
-struct PaymentDetails {
-    int paymentId;
-    string paymentMethod;
-    double amount;
-    string transactionTime;
-    string status; // "Pending", "Completed", "Failed"
-    string authorizationCode;
-};
-
-// Payment Processor Class
-class PaymentProcessor {
-private:
-    static int nextPaymentId;
-    PaymentDetails* currentPayment;
-
-public:
-    // Constructor and Destructor
-    PaymentProcessor();
-    ~PaymentProcessor();
-
-    // Core payment methods
-    bool processCashPayment(double amount, double tendered);
-    bool processCardPayment(double amount, string cardNumber, string expiry, string cvv, string cardType);
-    bool processMobilePayment(double amount, string mobileProvider);
-
-    // Utility functions
-    void displayPaymentReceipt();
-    double calculateChange(double amount, double tendered);
-    string generateAuthorizationCode();
-    bool validateCard(string cardNumber, string expiry, string cvv);
-    string getCurrentTime();
-    PaymentDetails* getCurrentPayment() { return currentPayment; }
-};
-
-// Initialize static member
-int PaymentProcessor::nextPaymentId = 1001;
-
-// Transaction Manager Class
-class TransactionManager {
-private:
-    vector<PaymentDetails*> transactionHistory;
-    PaymentDetails** dailyTransactions;
-    int dailyCount;
-    int dailyCapacity;
-    map<string, double> paymentMethodStats;
-    array<string, 4> supportedMethods;
-
-public:
-    TransactionManager();
-    ~TransactionManager();
-
-    void addTransaction(PaymentDetails* transaction);
-    PaymentDetails* findTransactionById(int paymentId);
-    void generateDailyReport();
-    void saveTransactionsToFile();
-    void displayTransactionHistory();
-    void updatePaymentStats(string method, double amount);
-    void saveBinaryBackup();
-    void logError(string errorMessage);
-};
-
-// PaymentProcessor Implementation
-PaymentProcessor::PaymentProcessor() {
-    currentPayment = nullptr;
-    srand(time(0));
-}
-
-PaymentProcessor::~PaymentProcessor() {
-    if (currentPayment != nullptr) {
-        delete currentPayment;
-        currentPayment = nullptr;
-    }
-}
-
-string PaymentProcessor::getCurrentTime() {
-    time_t now = time(0);
-    char* dt = ctime(&now);
-    string timeStr(dt);
-    timeStr.pop_back(); // Remove newline
-    return timeStr;
-}
-
-string PaymentProcessor::generateAuthorizationCode() {
-    const char alphanum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-    string code = "AUTH-";
-    for (int i = 0; i < 6; i++) {
-        code += alphanum[rand() % 36];
-    }
-    return code;
-}
-
-double PaymentProcessor::calculateChange(double amount, double tendered) {
-    return tendered - amount;
-}
-
-bool PaymentProcessor::validateCard(string cardNumber, string expiry, string cvv) {
-    // Remove spaces from card number
-    string cleanCard = "";
-    for (char c : cardNumber) {
-        if (isdigit(c)) cleanCard += c;
-    }
-
-    // Check card number length (16 digits)
-    if (cleanCard.length() != 16) {
-        cout << "ERROR: Invalid card number length (must be 16 digits)" << endl;
-        return false;
-    }
-
-    // Validate expiry format (MM/YY)
-    if (expiry.length() != 5 || expiry[2] != '/') {
-        cout << "ERROR: Invalid expiry format (use MM/YY)" << endl;
-        return false;
-    }
-
-    // Check CVV length (3-4 digits)
-    if (cvv.length() < 3 || cvv.length() > 4) {
-        cout << "ERROR: Invalid CVV length (must be 3-4 digits)" << endl;
-        return false;
-    }
-
-    for (char c : cvv) {
-        if (!isdigit(c)) {
-            cout << "ERROR: CVV must contain only digits" << endl;
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool PaymentProcessor::processCashPayment(double amount, double tendered) {
-    try {
-        // Validate amount
-        if (amount <= 0) {
-            throw invalid_argument("Amount must be greater than zero");
-        }
-
-        if (tendered < amount) {
-            throw invalid_argument("Insufficient cash tendered");
-        }
-
-        // Clean up previous payment
-        if (currentPayment != nullptr) {
-            delete currentPayment;
-        }
-
-        // Create new payment object
-        currentPayment = new PaymentDetails();
-        currentPayment->paymentId = nextPaymentId++;
-        currentPayment->paymentMethod = "Cash";
-        currentPayment->amount = amount;
-        currentPayment->transactionTime = getCurrentTime();
-        currentPayment->status = "Completed";
-        currentPayment->authorizationCode = "CASH-" + to_string(currentPayment->paymentId);
-
-        return true;
-    }
-    catch (exception& e) {
-        cout << "ERROR: " << e.what() << endl;
-        return false;
-    }
-}
-
-bool PaymentProcessor::processCardPayment(double amount, string cardNumber, string expiry, string cvv, string cardType) {
-    try {
-        // Validate amount
-        if (amount <= 0) {
-            throw invalid_argument("Amount must be greater than zero");
-        }
-
-        // Validate card details
-        if (!validateCard(cardNumber, expiry, cvv)) {
-            throw invalid_argument("Card validation failed");
-        }
-
-        // Clean up previous payment
-        if (currentPayment != nullptr) {
-            delete currentPayment;
-        }
-
-        // Create new payment object
-        currentPayment = new PaymentDetails();
-        currentPayment->paymentId = nextPaymentId++;
-        currentPayment->paymentMethod = cardType;
-        currentPayment->amount = amount;
-        currentPayment->transactionTime = getCurrentTime();
-
-        // Simulate authorization (90% success rate)
-        int authResult = rand() % 100;
-        if (authResult < 90) {
-            currentPayment->status = "Completed";
-            currentPayment->authorizationCode = generateAuthorizationCode();
-            return true;
-        } else {
-            currentPayment->status = "Failed";
-            currentPayment->authorizationCode = "DECLINED";
-            throw runtime_error("Payment Declined - Insufficient Funds");
-        }
-    }
-    catch (exception& e) {
-        cout << "ERROR: " << e.what() << endl;
-        if (currentPayment != nullptr) {
-            currentPayment->status = "Failed";
-        }
-        return false;
-    }
-}
-
-bool PaymentProcessor::processMobilePayment(double amount, string mobileProvider) {
-    try {
-        // Validate amount
-        if (amount <= 0) {
-            throw invalid_argument("Amount must be greater than zero");
-        }
-
-        // Clean up previous payment
-        if (currentPayment != nullptr) {
-            delete currentPayment;
-        }
-
-        // Create new payment object
-        currentPayment = new PaymentDetails();
-        currentPayment->paymentId = nextPaymentId++;
-        currentPayment->paymentMethod = "Mobile (" + mobileProvider + ")";
-        currentPayment->amount = amount;
-        currentPayment->transactionTime = getCurrentTime();
-
-        // Simulate mobile payment processing (95% success rate)
-        cout << "Processing mobile payment via " << mobileProvider << "..." << endl;
-        int authResult = rand() % 100;
-        if (authResult < 95) {
-            currentPayment->status = "Completed";
-            currentPayment->authorizationCode = generateAuthorizationCode();
-            return true;
-        } else {
-            currentPayment->status = "Failed";
-            currentPayment->authorizationCode = "TIMEOUT";
-            throw runtime_error("Payment Timeout - Please try again");
-        }
-    }
-    catch (exception& e) {
-        cout << "ERROR: " << e.what() << endl;
-        if (currentPayment != nullptr) {
-            currentPayment->status = "Failed";
-        }
-        return false;
-    }
-}
-
-void PaymentProcessor::displayPaymentReceipt() {
-    if (currentPayment == nullptr) {
-        cout << "No payment to display" << endl;
-        return;
-    }
-
-    cout << "\n========================================" << endl;
-    if (currentPayment->paymentMethod == "Cash") {
-        cout << "===     CASH PAYMENT RECEIPT        ===" << endl;
-    } else if (currentPayment->paymentMethod.find("Mobile") != string::npos) {
-        cout << "===   MOBILE PAYMENT RECEIPT        ===" << endl;
-    } else {
-        cout << "===     CARD PAYMENT RECEIPT        ===" << endl;
-    }
-    cout << "Transaction ID: PAY-" << currentPayment->paymentId << endl;
-    cout << "Payment Method: " << currentPayment->paymentMethod << endl;
-    cout << "Amount: $" << fixed << setprecision(2) << currentPayment->amount << endl;
-    cout << "Time: " << currentPayment->transactionTime << endl;
-    cout << "Status: " << currentPayment->status << endl;
-    cout << "Authorization: " << currentPayment->authorizationCode << endl;
-
-    if (currentPayment->status == "Completed") {
-        cout << "     Thank you for your purchase!      " << endl;
-    } else {
-        cout << "   Please use alternative payment      " << endl;
-    }
-    cout << "========================================\n" << endl;
-}
-
-// TransactionManager Implementation
-TransactionManager::TransactionManager() {
-    dailyCapacity = 100;
-    dailyCount = 0;
-    dailyTransactions = new PaymentDetails*[dailyCapacity];
-
-    supportedMethods[0] = "Cash";
-    supportedMethods[1] = "Credit Card";
-    supportedMethods[2] = "Debit Card";
-    supportedMethods[3] = "Mobile Payment";
-}
-
-TransactionManager::~TransactionManager() {
-    // Clean up transaction history
-    for (PaymentDetails* payment : transactionHistory) {
-        delete payment;
-    }
-    transactionHistory.clear();
-
-    // Clean up daily transactions array
-    delete[] dailyTransactions;
-}
-
-void TransactionManager::addTransaction(PaymentDetails* transaction) {
-    if (transaction == nullptr) return;
-
-    // Create a copy for history
-    PaymentDetails* historyCopy = new PaymentDetails(*transaction);
-    transactionHistory.push_back(historyCopy);
-
-    // Add to daily transactions array
-    if (dailyCount < dailyCapacity) {
-        dailyTransactions[dailyCount] = historyCopy;
-        dailyCount++;
-    }
-
-    // Update payment statistics
-    updatePaymentStats(transaction->paymentMethod, transaction->amount);
-
-    // Save to file
-    saveTransactionsToFile();
-
-    // Log errors if payment failed
-    if (transaction->status == "Failed") {
-        logError("Payment ID: PAY-" + to_string(transaction->paymentId) +
-                " | Method: " + transaction->paymentMethod +
-                " | Amount: $" + to_string(transaction->amount) +
-                " | Reason: " + transaction->authorizationCode);
-    }
-}
-
-void TransactionManager::updatePaymentStats(string method, double amount) {
-    paymentMethodStats[method] += amount;
-}
-
-PaymentDetails* TransactionManager::findTransactionById(int paymentId) {
-    // Use pointer arithmetic to search daily transactions
-    for (int i = 0; i < dailyCount; i++) {
-        PaymentDetails* transaction = *(dailyTransactions + i);
-        if (transaction->paymentId == paymentId) {
-            return transaction;
-        }
-    }
-    return nullptr;
-}
-
-void TransactionManager::saveTransactionsToFile() {
-    ofstream outFile("transactions.txt", ios::app);
-    if (!outFile.is_open()) {
-        cout << "Error opening transactions file" << endl;
-        return;
-    }
-
-    if (!transactionHistory.empty()) {
-        PaymentDetails* lastTransaction = transactionHistory.back();
-        if (lastTransaction->status == "Completed") {
-            outFile << "PAY-" << lastTransaction->paymentId << " | "
-                   << lastTransaction->paymentMethod << " | $"
-                   << fixed << setprecision(2) << lastTransaction->amount << " | "
-                   << lastTransaction->status << " | "
-                   << lastTransaction->transactionTime << " | "
-                   << lastTransaction->authorizationCode << endl;
-        }
-    }
-
-    outFile.close();
-}
-
-void TransactionManager::logError(string errorMessage) {
-    ofstream logFile("payment_errors.log", ios::app);
-    if (!logFile.is_open()) {
-        cout << "Error opening log file" << endl;
-        return;
-    }
-
-    time_t now = time(0);
-    char* dt = ctime(&now);
-    string timeStr(dt);
-    timeStr.pop_back();
-
-    logFile << "[" << timeStr << "] " << errorMessage << endl;
-    logFile.close();
-}
-
-void TransactionManager::saveBinaryBackup() {
-    ofstream binFile("daily_summary.dat", ios::binary);
-    if (!binFile.is_open()) {
-        cout << "Error creating binary backup" << endl;
-        return;
-    }
-
-    // Write number of transactions
-    binFile.write(reinterpret_cast<char*>(&dailyCount), sizeof(int));
-
-    // Write each transaction
-    for (int i = 0; i < dailyCount; i++) {
-        PaymentDetails* trans = dailyTransactions[i];
-        binFile.write(reinterpret_cast<char*>(&trans->paymentId), sizeof(int));
-
-        size_t methodLen = trans->paymentMethod.length();
-        binFile.write(reinterpret_cast<char*>(&methodLen), sizeof(size_t));
-        binFile.write(trans->paymentMethod.c_str(), methodLen);
-
-        binFile.write(reinterpret_cast<char*>(&trans->amount), sizeof(double));
-    }
-
-    binFile.close();
-    cout << "Binary backup saved successfully!" << endl;
-}
-
-void TransactionManager::displayTransactionHistory() {
-    cout << "===   TRANSACTION HISTORY           ===" << endl;
-
-    if (transactionHistory.empty()) {
-        cout << "No transactions yet." << endl;
-        cout << "========================================\n" << endl;
-        return;
-    }
-
-    double totalCompleted = 0.0;
-    int completedCount = 0;
-
-    for (size_t i = 0; i < transactionHistory.size(); i++) {
-        PaymentDetails* trans = transactionHistory[i];
-        cout << (i + 1) << ". PAY-" << trans->paymentId << " | "
-             << trans->paymentMethod << " | $"
-             << fixed << setprecision(2) << trans->amount << " | "
-             << trans->status << endl;
-
-        if (trans->status == "Completed") {
-            totalCompleted += trans->amount;
-            completedCount++;
-        }
-    }
-
-    cout << "----------------------------------------" << endl;
-    cout << "Total Completed: $" << fixed << setprecision(2) << totalCompleted << endl;
-    cout << "Success Rate: " << (transactionHistory.size() > 0 ?
-           (completedCount * 100.0 / transactionHistory.size()) : 0) << "%" << endl;
-
-    // Display payment method statistics
-    cout << "\nPayment Method Statistics:" << endl;
-    for (const auto& stat : paymentMethodStats) {
-        cout << "  " << stat.first << ": $" << fixed << setprecision(2) << stat.second << endl;
-    }
-
-    cout << "========================================\n" << endl;
-}
-
-void TransactionManager::generateDailyReport() {
-    cout << "\n========================================" << endl;
-    cout << "===      DAILY REPORT               ===" << endl;
-    cout << "========================================" << endl;
-    cout << "Total Transactions: " << dailyCount << endl;
-
-    double totalRevenue = 0.0;
-    int successCount = 0;
-
-    for (int i = 0; i < dailyCount; i++) {
-        if (dailyTransactions[i]->status == "Completed") {
-            totalRevenue += dailyTransactions[i]->amount;
-            successCount++;
-        }
-    }
-
-    cout << "Successful Transactions: " << successCount << endl;
-    cout << "Total Revenue: $" << fixed << setprecision(2) << totalRevenue << endl;
-    cout << "Success Rate: " << (dailyCount > 0 ? (successCount * 100.0 / dailyCount) : 0) << "%" << endl;
-    cout << "========================================\n" << endl;
-}
-
-// Main POS System
-void runPOSSystem() {
-    PaymentProcessor processor;
-    TransactionManager manager;
-
-    int choice;
-    double amount, tendered;
-    string cardNumber, expiry, cvv, provider;
-
-    do {
-        cout << "\n=======================================" << endl;
-        cout << "=== PAYMENT PROCESSING SYSTEM      ===" << endl;
-        cout << "=======================================" << endl;
-        cout << "1. Cash Payment" << endl;
-        cout << "2. Credit Card Payment" << endl;
-        cout << "3. Debit Card Payment" << endl;
-        cout << "4. Mobile Payment" << endl;
-        cout << "5. View Transaction History" << endl;
-        cout << "6. Generate Daily Report" << endl;
-        cout << "7. Save Binary Backup" << endl;
-        cout << "8. Exit" << endl;
-        cout << "=======================================" << endl;
-        cout << "Enter your choice: ";
-        cin >> choice;
-
-        switch(choice) {
-            case 1: {
-                cout << "\n=== CASH PAYMENT ===" << endl;
-                cout << "Enter amount due: $";
-                cin >> amount;
-                cout << "Enter cash tendered: $";
-                cin >> tendered;
-
-                if (processor.processCashPayment(amount, tendered)) {
-                    double change = processor.calculateChange(amount, tendered);
-                    cout << "\nChange Due: $" << fixed << setprecision(2) << change << endl;
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                }
-                break;
-            }
-
-            case 2: {
-                cout << "\n=== CREDIT CARD PAYMENT ===" << endl;
-                cout << "Enter amount: $";
-                cin >> amount;
-                cin.ignore();
-                cout << "Enter card number (16 digits): ";
-                getline(cin, cardNumber);
-                cout << "Enter expiry (MM/YY): ";
-                getline(cin, expiry);
-                cout << "Enter CVV: ";
-                getline(cin, cvv);
-
-                if (processor.processCardPayment(amount, cardNumber, expiry, cvv, "Credit Card")) {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                } else {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                }
-                break;
-            }
-
-            case 3: {
-                cout << "\n=== DEBIT CARD PAYMENT ===" << endl;
-                cout << "Enter amount: $";
-                cin >> amount;
-                cin.ignore();
-                cout << "Enter card number (16 digits): ";
-                getline(cin, cardNumber);
-                cout << "Enter expiry (MM/YY): ";
-                getline(cin, expiry);
-                cout << "Enter CVV: ";
-                getline(cin, cvv);
-
-                if (processor.processCardPayment(amount, cardNumber, expiry, cvv, "Debit Card")) {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                } else {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                }
-                break;
-            }
-
-            case 4: {
-                cout << "\n=== MOBILE PAYMENT ===" << endl;
-                cout << "Enter amount: $";
-                cin >> amount;
-                cin.ignore();
-                cout << "Select Provider:" << endl;
-                cout << "1. PayPal" << endl;
-                cout << "2. Apple Pay" << endl;
-                cout << "3. Google Pay" << endl;
-                cout << "Choice: ";
-                int providerChoice;
-                cin >> providerChoice;
-
-                switch(providerChoice) {
-                    case 1: provider = "PayPal"; break;
-                    case 2: provider = "Apple Pay"; break;
-                    case 3: provider = "Google Pay"; break;
-                    default: provider = "Unknown"; break;
-                }
-
-                if (processor.processMobilePayment(amount, provider)) {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                } else {
-                    processor.displayPaymentReceipt();
-                    manager.addTransaction(processor.getCurrentPayment());
-                }
-                break;
-            }
-
-            case 5:
-                manager.displayTransactionHistory();
-                break;
-
-            case 6:
-                manager.generateDailyReport();
-                break;
-
-            case 7:
-                manager.saveBinaryBackup();
-                break;
-
-            case 8:
-                cout << "\nThank you for using the POS System!" << endl;
-                cout << "Saving final backup..." << endl;
-                manager.saveBinaryBackup();
-                break;
-
-            default:
-                cout << "Invalid choice. Please try again." << endl;
-        }
-
-    } while(choice != 8);
-}
-
-// Main function
-int main() {
-    cout << "========================================" << endl;
-    cout << "   POINT OF SALE PAYMENT SYSTEM        " << endl;
-    cout << "   Object-Oriented Programming in C++  " << endl;
-    cout << "========================================\n" << endl;
-
-    runPOSSystem();
-
-    return 0;
-}
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <string>
+#include <ctime>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <array>
+#include <random>
+#include <memory>
+#include <future>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <cstring>
+#include <cmath>
+#include <string_view>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <charconv>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(POS_METRICS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+using namespace std;
+
+// Fixed-point money: a whole number of cents
+struct Money {
+    int64_t cents = 0;
+
+    static Money fromCents(int64_t value) { return Money{value}; }
+    double toDouble() const { return cents / 100.0; }
+
+    Money operator+(Money other) const { return Money{cents + other.cents}; }
+    Money operator-(Money other) const { return Money{cents - other.cents}; }
+    Money& operator+=(Money other) { cents += other.cents; return *this; }
+    Money& operator-=(Money other) { cents -= other.cents; return *this; }
+    bool operator==(Money other) const { return cents == other.cents; }
+    bool operator!=(Money other) const { return cents != other.cents; }
+    bool operator<(Money other) const { return cents < other.cents; }
+    bool operator<=(Money other) const { return cents <= other.cents; }
+    bool operator>(Money other) const { return cents > other.cents; }
+    bool operator>=(Money other) const { return cents >= other.cents; }
+};
+
+// Write "123.45" (no currency sign) into text; returns the length
+size_t formatMoney(Money amount, char* text, size_t size) {
+    int64_t cents = amount.cents;
+    const char* sign = cents < 0 ? "-" : "";
+    uint64_t magnitude = cents < 0 ? uint64_t(-(cents + 1)) + 1 : uint64_t(cents);
+    int written = snprintf(text, size, "%s%llu.%02llu", sign, (unsigned long long)(magnitude / 100),
+                           (unsigned long long)(magnitude % 100));
+    return written < 0 ? 0 : size_t(written);
+}
+
+string formatMoney(Money amount) {
+    char text[32];
+    return string(text, formatMoney(amount, text, sizeof(text)));
+}
+
+ostream& operator<<(ostream& out, Money amount) {
+    char text[32];
+    return out.write(text, streamsize(formatMoney(amount, text, sizeof(text))));
+}
+
+// Parse "12", "12.5" or "12.50" (an optional leading '$' is allowed) without going through double.
+// Digits past the cents round half away from zero.
+bool parseMoney(string_view text, Money& amount) {
+    if (!text.empty() && text[0] == '$') text.remove_prefix(1);
+    bool negative = !text.empty() && text[0] == '-';
+    if (negative) text.remove_prefix(1);
+    if (text.empty()) return false;
+
+    int64_t cents = 0;
+    int fractionDigits = -1;
+    bool anyDigit = false;
+    bool roundUp = false;
+    for (char c : text) {
+        if (c == '.' && fractionDigits < 0) {
+            fractionDigits = 0;
+        } else if (c >= '0' && c <= '9') {
+            anyDigit = true;
+            if (fractionDigits < 2) {
+                if (cents > (INT64_MAX - (c - '0')) / 10) return false;
+                cents = cents * 10 + (c - '0');
+                if (fractionDigits >= 0) fractionDigits++;
+            } else if (fractionDigits == 2) {
+                roundUp = c >= '5';
+                fractionDigits++;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (!anyDigit) return false;
+    for (int i = fractionDigits < 0 ? 0 : fractionDigits; i < 2; i++) {
+        if (cents > INT64_MAX / 10) return false;
+        cents *= 10;
+    }
+    if (roundUp) {
+        if (cents == INT64_MAX) return false;
+        cents++;
+    }
+    amount.cents = negative ? -cents : cents;
+    return true;
+}
+
+// Split a line into whitespace separated words
+static vector<string_view> splitWords(string_view line) {
+    vector<string_view> words;
+    size_t i = 0;
+    while (i < line.size()) {
+        while (i < line.size() && isspace(static_cast<unsigned char>(line[i]))) i++;
+        size_t start = i;
+        while (i < line.size() && !isspace(static_cast<unsigned char>(line[i]))) i++;
+        if (i > start) words.push_back(line.substr(start, i - start));
+    }
+    return words;
+}
+
+// Payment methods, in the order reports list them
+enum class PaymentMethod : uint8_t {
+    Cash,
+    CreditCard,
+    DebitCard,
+    MobileApplePay,
+    MobileGooglePay,
+    MobilePayPal,
+    MobileUnknown,
+    Count
+};
+const size_t MethodCount = size_t(PaymentMethod::Count);
+
+enum class PaymentStatus : uint8_t {
+    Pending,
+    Completed,
+    Failed,
+    Refunded,   // completed, then refunded in full
+    Voided,     // completed or authorized, then cancelled before settlement
+    Authorized, // approved and held; settled by one capture
+    Count
+};
+const size_t StatusCount = size_t(PaymentStatus::Count);
+
+// Changes made to a completed payment after the sale
+enum class AdjustmentKind : uint8_t {
+    Refund,     // money returned; refunding all of it makes the payment Refunded
+    Void,       // the whole payment cancelled
+    Capture,    // an authorized card or mobile payment settled, for at most what was authorized
+    Count
+};
+const size_t AdjustmentKindCount = size_t(AdjustmentKind::Count);
+
+const string& methodName(PaymentMethod method) {
+    static const string names[MethodCount + 1] = {
+        "Cash", "Credit Card", "Debit Card", "Mobile (Apple Pay)", "Mobile (Google Pay)",
+        "Mobile (PayPal)", "Mobile (Unknown)", "Unknown"
+    };
+    return names[size_t(method) < MethodCount ? size_t(method) : MethodCount];
+}
+
+const string& statusName(PaymentStatus status) {
+    static const string names[StatusCount + 1] = {
+        "Pending", "Completed", "Failed", "Refunded", "Voided", "Authorized", "Unknown"
+    };
+    return names[size_t(status) < StatusCount ? size_t(status) : StatusCount];
+}
+
+const string& adjustmentName(AdjustmentKind kind) {
+    static const string names[AdjustmentKindCount + 1] = {"Refund", "Void", "Capture", "Unknown"};
+    return names[size_t(kind) < AdjustmentKindCount ? size_t(kind) : AdjustmentKindCount];
+}
+
+// The gateway approved it: settled now, or held for a later capture
+bool isApproved(PaymentStatus status) {
+    return status == PaymentStatus::Completed || status == PaymentStatus::Authorized;
+}
+
+bool isMobile(PaymentMethod method) {
+    return method >= PaymentMethod::MobileApplePay && method <= PaymentMethod::MobileUnknown;
+}
+
+// Method for a mobile provider name as the menu spells it
+PaymentMethod mobileMethod(string_view provider) {
+    if (provider == "PayPal") return PaymentMethod::MobilePayPal;
+    if (provider == "Apple Pay") return PaymentMethod::MobileApplePay;
+    if (provider == "Google Pay") return PaymentMethod::MobileGooglePay;
+    return PaymentMethod::MobileUnknown;
+}
+
+bool methodFromName(string_view name, PaymentMethod& method) {
+    for (size_t i = 0; i < MethodCount; i++) {
+        if (name == methodName(PaymentMethod(i))) {
+            method = PaymentMethod(i);
+            return true;
+        }
+    }
+    // Any other provider recorded by an older build
+    if (name.size() > 9 && name.compare(0, 8, "Mobile (") == 0 && name.back() == ')') {
+        method = PaymentMethod::MobileUnknown;
+        return true;
+    }
+    return false;
+}
+
+bool statusFromName(string_view name, PaymentStatus& status) {
+    for (size_t i = 0; i < StatusCount; i++) {
+        if (name == statusName(PaymentStatus(i))) {
+            status = PaymentStatus(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool adjustmentFromName(string_view name, AdjustmentKind& kind) {
+    for (size_t i = 0; i < AdjustmentKindCount; i++) {
+        if (name == adjustmentName(AdjustmentKind(i))) {
+            kind = AdjustmentKind(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Short text stored inside a record, so copying the record never allocates.
+// Longer text is cut to Capacity characters.
+template <size_t Capacity>
+class InlineText {
+    static_assert(Capacity < 256, "length is stored in one byte");
+
+private:
+    char chars[Capacity];
+    uint8_t length;
+
+public:
+    InlineText() : length(0) {}
+    explicit InlineText(string_view text) { assign(text); }
+
+    InlineText& operator=(string_view text) {
+        assign(text);
+        return *this;
+    }
+    void assign(string_view text) {
+        length = uint8_t(text.size() < Capacity ? text.size() : Capacity);
+        memcpy(chars, text.data(), length);
+    }
+
+    const char* data() const { return chars; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    string_view view() const { return string_view(chars, length); }
+    operator string_view() const { return view(); }
+};
+
+template <size_t Capacity>
+bool operator==(const InlineText<Capacity>& a, string_view b) { return a.view() == b; }
+template <size_t Capacity>
+bool operator!=(const InlineText<Capacity>& a, string_view b) { return a.view() != b; }
+template <size_t Capacity>
+bool operator==(string_view a, const InlineText<Capacity>& b) { return a == b.view(); }
+template <size_t Capacity>
+bool operator!=(string_view a, const InlineText<Capacity>& b) { return a != b.view(); }
+template <size_t Capacity>
+ostream& operator<<(ostream& out, const InlineText<Capacity>& text) {
+    return out.write(text.data(), streamsize(text.size()));
+}
+
+typedef InlineText<22> AuthorizationCode;   // "AUTH-XXXXXX", "CASH-<id>", "DECLINED", ...
+
+// Microseconds since the Unix epoch. Readings come from the monotonic clock
+// anchored to the wall clock once per process, so they never step backwards
+// when the system clock is adjusted.
+typedef int64_t EpochMicros;
+const int64_t MicrosPerSecond = 1000000;
+
+EpochMicros currentEpochMicros() {
+    struct Anchor {
+        chrono::steady_clock::time_point steady = chrono::steady_clock::now();
+        EpochMicros wall = chrono::duration_cast<chrono::microseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    };
+    static const Anchor anchor;
+    return anchor.wall +
+           chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - anchor.steady).count();
+}
+
+time_t epochSeconds(EpochMicros when) {
+    // Round towards minus infinity so pre-1970 instants land in the right second
+    return time_t(when >= 0 ? when / MicrosPerSecond : -((-when + MicrosPerSecond - 1) / MicrosPerSecond));
+}
+
+EpochMicros epochMicros(time_t seconds) {
+    return EpochMicros(seconds) * MicrosPerSecond;
+}
+
+// Start of the local-time hour holding when, the hour reports print. Callers
+// ask about the same hour over and over, so each thread keeps its last answer.
+time_t localHourStart(time_t when) {
+    thread_local time_t cachedStart = 0, cachedEnd = 0;
+    if (when >= cachedStart && when < cachedEnd) return cachedStart;
+    struct tm parts;
+    localtime_r(&when, &parts);
+    cachedStart = when - (parts.tm_min * 60 + parts.tm_sec);
+    cachedEnd = cachedStart + 3600;
+    return cachedStart;
+}
+
+// What the card/mobile gateway answered
+enum class GatewayOutcome : uint8_t {
+    Approved,
+    Declined,
+    TimedOut,       // no answer within the timeout
+    Unavailable,    // never sent: no connection, or the circuit breaker is open
+    Count
+};
+
+// Payment Details Structure
+struct PaymentDetails {
+    int paymentId;
+    PaymentMethod paymentMethod;
+    GatewayOutcome outcome;  // how this run's authorization ended; cash is Approved, a payment never sent Unavailable
+    Money amount;
+    EpochMicros timestamp;   // shown as ctime text by TimeFormatter
+    PaymentStatus status;
+    AuthorizationCode authorizationCode;
+    Money adjusted;          // refunded so far, or released by a capture; all of it once refunded or voided
+
+    // What totals and queries count: a completed payment net of refunds and
+    // captures, any other its full amount
+    Money net() const { return status == PaymentStatus::Completed ? amount - adjusted : amount; }
+};
+
+// A refund, void or capture of an earlier payment. The journal keeps it
+// as "ADJ-<id> | kind | $amount | time | status | $balance" after the payment's
+// own line. It carries the payment's state afterwards, so replaying it over a
+// snapshot that already reflects it changes nothing.
+struct PaymentAdjustment {
+    int paymentId;
+    AdjustmentKind kind;
+    Money amount;            // refunded, voided or captured
+    EpochMicros timestamp;   // when the adjustment was made
+    PaymentStatus status;    // the payment's status afterwards
+    Money balance;           // and its net amount (what a full refund or void returned)
+
+    // Bring the payment to its state afterwards; a refunded or voided one gave all of it back
+    void applyTo(PaymentDetails& payment) const {
+        payment.status = status;
+        payment.adjusted = status == PaymentStatus::Completed ? payment.amount - balance : payment.amount;
+    }
+};
+
+// Renders timestamps the way transaction records show them: ctime without the
+// newline ("Mon Oct 13 16:18:18 2025"). Records arrive in time order, so the
+// text up to the minute is kept and only the seconds are rewritten; ctime_r
+// runs once a minute. Not shared between threads; use local().
+class TimeFormatter {
+public:
+    static const size_t TextLength = 24;
+
+private:
+    time_t minuteStart = -1;
+    char text[32];
+
+public:
+    string_view format(time_t when);
+    static TimeFormatter& local();
+};
+
+string_view TimeFormatter::format(time_t when) {
+    time_t second = when % 60;
+    if (second < 0) second += 60;
+    if (when - second != minuteStart) {
+        time_t start = when - second;
+        ctime_r(&start, text);   // ctime() shares a static buffer between threads
+        minuteStart = start;
+    }
+    text[17] = char('0' + second / 10);
+    text[18] = char('0' + second % 10);
+    return string_view(text, TextLength);
+}
+
+TimeFormatter& TimeFormatter::local() {
+    thread_local TimeFormatter formatter;
+    return formatter;
+}
+
+// Text form of a record time; valid until this thread formats another
+string_view transactionTimeText(EpochMicros when) {
+    return TimeFormatter::local().format(epochSeconds(when));
+}
+
+string formatTransactionTime(time_t when) {
+    return string(TimeFormatter::local().format(when));
+}
+
+// Parse the text form of a transaction time ("Mon Oct 13 16:18:18 2025")
+bool parseTransactionTime(string_view text, time_t& when) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (text.size() != 24 || text[3] != ' ' || text[7] != ' ' || text[13] != ':' || text[16] != ':' || text[19] != ' ') {
+        return false;
+    }
+    int month = -1;
+    for (int m = 0; m < 12; m++) {
+        if (text.compare(4, 3, months + m * 3, 3) == 0) {
+            month = m;
+            break;
+        }
+    }
+    auto digits = [&](size_t pos, size_t len, int& value) {
+        value = 0;
+        for (size_t i = pos; i < pos + len; i++) {
+            char c = text[i];
+            if (c == ' ' && i == pos) continue;  // ctime pads the day with a space
+            if (c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    };
+    int day, hour, minute, second, year;
+    if (month < 0 || !digits(8, 2, day) || !digits(11, 2, hour) || !digits(14, 2, minute) ||
+        !digits(17, 2, second) || !digits(20, 4, year)) {
+        return false;
+    }
+
+    // mktime is slow, so remember the start of the last hour seen; DST only moves whole hours
+    thread_local int cachedKey = -1;
+    thread_local time_t cachedHour = 0;
+    int key = ((year * 12 + month) * 31 + day) * 24 + hour;
+    if (key != cachedKey) {
+        struct tm parts;
+        memset(&parts, 0, sizeof(parts));
+        parts.tm_year = year - 1900;
+        parts.tm_mon = month;
+        parts.tm_mday = day;
+        parts.tm_hour = hour;
+        parts.tm_isdst = -1;
+        time_t hourStart = mktime(&parts);
+        if (hourStart == time_t(-1)) return false;
+        cachedKey = key;
+        cachedHour = hourStart;
+    }
+    when = cachedHour + minute * 60 + second;
+    return true;
+}
+
+// Parse a wall-clock time of day ("HH:MM") into minutes after midnight
+bool parseClockTime(string_view text, int& minuteOfDay) {
+    size_t colon = text.find(':');
+    if (colon == string_view::npos || colon == 0 || colon > 2 || text.size() != colon + 3) return false;
+    int hour = 0;
+    int minute = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        if (i == colon) continue;
+        if (text[i] < '0' || text[i] > '9') return false;
+        int& part = i < colon ? hour : minute;
+        part = part * 10 + (text[i] - '0');
+    }
+    if (hour > 23 || minute > 59) return false;
+    minuteOfDay = hour * 60 + minute;
+    return true;
+}
+
+// Local time minuteOfDay minutes after midnight on now's day
+time_t clockTimeToday(int minuteOfDay, time_t now) {
+    struct tm parts;
+    localtime_r(&now, &parts);
+    parts.tm_hour = minuteOfDay / 60;
+    parts.tm_min = minuteOfDay % 60;
+    parts.tm_sec = 0;
+    parts.tm_isdst = -1;
+    return mktime(&parts);
+}
+
+// The first local midnight after when
+EpochMicros nextLocalMidnight(EpochMicros when) {
+    time_t seconds = epochSeconds(when);
+    struct tm parts;
+    localtime_r(&seconds, &parts);
+    parts.tm_mday += 1;
+    parts.tm_hour = 0;
+    parts.tm_min = 0;
+    parts.tm_sec = 0;
+    parts.tm_isdst = -1;
+    return epochMicros(mktime(&parts));
+}
+
+// Parse a local date, optionally with a time ("YYYY-MM-DD" or "YYYY-MM-DDTHH:MM")
+bool parseCalendarTime(string_view text, time_t& when) {
+    if (text.size() != 10 && !(text.size() == 16 && text[10] == 'T')) return false;
+    if (text[4] != '-' || text[7] != '-') return false;
+    auto number = [&](size_t at, size_t length, int& value) {
+        return from_chars(text.data() + at, text.data() + at + length, value).ptr == text.data() + at + length;
+    };
+    int year, month, day;
+    int minuteOfDay = 0;
+    if (!number(0, 4, year) || !number(5, 2, month) || !number(8, 2, day)) return false;
+    if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+    if (text.size() == 16 && !parseClockTime(text.substr(11), minuteOfDay)) return false;
+    struct tm parts = {};
+    parts.tm_year = year - 1900;
+    parts.tm_mon = month - 1;
+    parts.tm_mday = day;
+    parts.tm_hour = minuteOfDay / 60;
+    parts.tm_min = minuteOfDay % 60;
+    parts.tm_isdst = -1;
+    when = mktime(&parts);
+    return when != time_t(-1);
+}
+
+// The most recent shift that ends at endMinute today; a shift may span midnight
+void shiftWindow(int startMinute, int endMinute, time_t now, time_t& from, time_t& to) {
+    to = clockTimeToday(endMinute, now);
+    int length = ((endMinute - startMinute) % (24 * 60) + 24 * 60) % (24 * 60);
+    from = to - time_t(length == 0 ? 24 * 60 : length) * 60;
+}
+
+// Split a journal line into its six " | " separated fields
+static inline bool journalFields(string_view line, string_view (&fields)[6]) {
+    size_t start = 0;
+    for (int f = 0; f < 6; f++) {
+        size_t sep = (f < 5) ? line.find(" | ", start) : line.size();
+        if (sep == string_view::npos) return false;
+        fields[f] = line.substr(start, sep - start);
+        start = sep + 3;
+    }
+    return true;
+}
+
+// The payment ID after a record's four-character tag ("PAY-1001", "ADJ-1001");
+// one past INT_MAX is a damaged line, not a wrapped ID
+static inline bool journalRecordId(string_view field, int& id) {
+    id = 0;
+    if (field.size() < 5 || field.size() > 14) return false;
+    for (size_t i = 4; i < field.size(); i++) {
+        char c = field[i];
+        if (c < '0' || c > '9' || id > (INT_MAX - (c - '0')) / 10) return false;
+        id = id * 10 + (c - '0');
+    }
+    return true;
+}
+
+// Parse a payment ID as typed by an operator: "1042" or "PAY-1042"
+bool parsePaymentReference(string_view text, int& id) {
+    if (text.compare(0, 4, "PAY-") == 0) text.remove_prefix(4);
+    if (text.empty() || text.size() > 9) return false;
+    id = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        id = id * 10 + (c - '0');
+    }
+    return id > 0;
+}
+
+// Parse one journal line ("PAY-<id> | method | $amount | status | time | auth")
+bool parseJournalLine(string_view line, PaymentDetails& payment) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.compare(0, 4, "PAY-") != 0) return false;
+
+    string_view fields[6];
+    int id;
+    if (!journalFields(line, fields) || !journalRecordId(fields[0], id)) return false;
+
+    // $<dollars>.<cents>
+    Money amount;
+    if (fields[2].empty() || fields[2][0] != '$' || !parseMoney(fields[2], amount)) return false;
+
+    PaymentMethod method;
+    PaymentStatus status;
+    time_t when;
+    if (!methodFromName(fields[1], method) || !statusFromName(fields[3], status) ||
+        !parseTransactionTime(fields[4], when)) {
+        return false;
+    }
+
+    payment.paymentId = id;
+    payment.paymentMethod = method;
+    payment.amount = amount;
+    payment.status = status;
+    payment.timestamp = epochMicros(when);
+    payment.authorizationCode = fields[5];
+    payment.adjusted = Money();   // adjustments follow as ADJ lines
+    return true;
+}
+
+// Parse one adjustment line ("ADJ-<id> | kind | $amount | time | status | $balance")
+bool parseAdjustmentLine(string_view line, PaymentAdjustment& adjustment) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.compare(0, 4, "ADJ-") != 0) return false;
+
+    string_view fields[6];
+    int id;
+    AdjustmentKind kind;
+    Money amount, balance;
+    time_t when;
+    PaymentStatus status;
+    if (!journalFields(line, fields) || !journalRecordId(fields[0], id) || !adjustmentFromName(fields[1], kind) ||
+        fields[2].empty() || fields[2][0] != '$' || !parseMoney(fields[2], amount) ||
+        !parseTransactionTime(fields[3], when) || !statusFromName(fields[4], status) ||
+        fields[5].empty() || fields[5][0] != '$' || !parseMoney(fields[5], balance)) {
+        return false;
+    }
+
+    adjustment.paymentId = id;
+    adjustment.kind = kind;
+    adjustment.amount = amount;
+    adjustment.timestamp = epochMicros(when);
+    adjustment.status = status;
+    adjustment.balance = balance;
+    return true;
+}
+
+// Whether a journal line that lost its newline is a whole record and not the
+// prefix of one. Every field but the last has its separator after it, so only
+// the last needs checking: a known authorization code, or a balance with its cents.
+bool completeJournalLine(string_view line) {
+    PaymentDetails payment;
+    if (parseJournalLine(line, payment)) {
+        string_view code = payment.authorizationCode;
+        if (code.size() == 11 && code.compare(0, 5, "AUTH-") == 0) {
+            return all_of(code.begin() + 5, code.end(), [](char c) {
+                return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z');
+            });
+        }
+        if (code.compare(0, 5, "CASH-") == 0) {
+            return code.substr(5) == to_string(payment.paymentId);
+        }
+        return code == "DECLINED" || code == "TIMEOUT" || code == "OFFLINE" || code == "INVALID" ||
+               code == "REJECTED";
+    }
+    PaymentAdjustment adjustment;
+    if (parseAdjustmentLine(line, adjustment)) {
+        size_t dot = line.rfind('.');
+        return dot != string_view::npos && dot + 3 == line.size() && isdigit((unsigned char)line[dot + 1]) &&
+               isdigit((unsigned char)line[dot + 2]);
+    }
+    return false;
+}
+
+// Check an adjustment against the payment it changes and work out the
+// payment's state afterwards. Refunds apply to completed payments, a capture
+// settles an authorized one once, and a void cancels either. A refund of zero
+// refunds everything left; a void ignores amount.
+bool planAdjustment(const PaymentDetails& payment, AdjustmentKind kind, Money amount, EpochMicros when,
+                    PaymentAdjustment& adjustment, string& error) {
+    string name = "PAY-" + to_string(payment.paymentId);
+    if (payment.status != PaymentStatus::Completed && payment.status != PaymentStatus::Authorized) {
+        error = name + " is " + statusName(payment.status) + "; only completed or authorized payments can be adjusted";
+        return false;
+    }
+    adjustment.paymentId = payment.paymentId;
+    adjustment.kind = kind;
+    adjustment.timestamp = when;
+    adjustment.status = PaymentStatus::Completed;
+    Money left = payment.net();
+    switch (kind) {
+        case AdjustmentKind::Refund:
+            if (payment.status != PaymentStatus::Completed) {
+                error = name + " is only authorized; capture or void it";
+                return false;
+            }
+            if (amount.cents == 0) amount = left;
+            if (amount.cents < 0 || amount > left) {
+                error = "refund must be at most the $" + formatMoney(left) + " left on " + name;
+                return false;
+            }
+            // A full refund keeps the amount it returned as its balance
+            if (amount == left) {
+                adjustment.status = PaymentStatus::Refunded;
+                adjustment.balance = left;
+            } else {
+                adjustment.balance = left - amount;
+            }
+            break;
+        case AdjustmentKind::Void:
+            amount = left;
+            adjustment.status = PaymentStatus::Voided;
+            adjustment.balance = left;
+            break;
+        case AdjustmentKind::Capture:
+            if (payment.status != PaymentStatus::Authorized) {
+                error = name + " is already settled; only an authorized payment can be captured, once";
+                return false;
+            }
+            if (amount.cents <= 0 || amount > payment.amount) {
+                error = "capture must be at most the $" + formatMoney(payment.amount) + " authorized on " + name;
+                return false;
+            }
+            adjustment.balance = amount;
+            break;
+        default:
+            error = "unknown adjustment";
+            return false;
+    }
+    adjustment.amount = amount;
+    return true;
+}
+
+// xoshiro256** generator: fast, small state, and a UniformRandomBitGenerator
+// so the <random> distributions accept it. Seeded through splitmix64, so
+// nearby seeds give unrelated streams.
+class FastRandom {
+private:
+    uint64_t state[4];
+
+    static uint64_t rotate(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    typedef uint64_t result_type;
+
+    explicit FastRandom(uint64_t seed = 0) { this->seed(seed); }
+
+    void seed(uint64_t value) {
+        for (uint64_t& word : state) {
+            value += 0x9E3779B97F4A7C15ull;
+            uint64_t z = value;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()() {
+        uint64_t result = rotate(state[1] * 5, 7) * 9;
+        uint64_t t = state[1] << 17;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotate(state[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, bound), by multiply-shift rather than a division
+    uint32_t below(uint32_t bound) { return uint32_t((((*this)() >> 32) * bound) >> 32); }
+};
+
+// Every simulated gateway draw for a payment (approval, latency) comes from a
+// stream keyed by the simulation seed and the payment ID, so no generator is
+// shared between threads and the draws do not depend on which lane or thread
+// makes them. The seed is drawn at startup unless --seed fixes it.
+void setSimulationSeed(uint64_t seed);
+bool parseSimulationSeed(const char* text, uint64_t& seed);    // decimal or 0x hex, nothing else
+uint64_t simulationSeed();
+bool simulationSeeded();
+FastRandom paymentRandom(int paymentId);
+
+// Make the "AUTH-XXXXXX" authorization code of a payment: its ID under a
+// permutation of the 36^6 codes keyed by the terminal's identity, so no two
+// payment IDs below 36^6 share a code, across restarts too.
+AuthorizationCode makeAuthorizationCode(int paymentId);
+
+// Stand-in for the card/mobile gateway: how long it takes and what it answers
+class AuthorizationSimulator {
+public:
+    virtual ~AuthorizationSimulator() {}
+    virtual chrono::microseconds latency(const PaymentDetails& payment, FastRandom& random) = 0;
+    virtual bool approve(const PaymentDetails& payment, FastRandom& random) = 0;
+};
+
+// The built-in behaviour: 90% of card and 95% of mobile payments approved,
+// gateway latency uniform between minLatency and maxLatency
+class DefaultAuthorizationSimulator : public AuthorizationSimulator {
+private:
+    chrono::microseconds minLatency;
+    chrono::microseconds maxLatency;
+
+public:
+    DefaultAuthorizationSimulator(chrono::microseconds minimum = chrono::microseconds(2000),
+                                  chrono::microseconds maximum = chrono::microseconds(20000))
+        : minLatency(minimum), maxLatency(maximum) {}
+
+    chrono::microseconds latency(const PaymentDetails& payment, FastRandom& random) override;
+    bool approve(const PaymentDetails& payment, FastRandom& random) override;
+};
+
+struct GatewayReply {
+    GatewayOutcome outcome = GatewayOutcome::Unavailable;
+    AuthorizationCode code;     // the gateway's code when approved
+};
+
+// Set a pending payment's outcome, status and authorization code from the gateway's answer
+void applyGatewayReply(PaymentDetails& payment, const GatewayReply& reply);
+
+// A card/mobile gateway outside the process. reply runs exactly once per
+// request: on a client thread, or before authorize returns when the request
+// cannot be sent.
+class GatewayClient {
+public:
+    typedef function<void(const GatewayReply&)> Reply;
+
+    virtual ~GatewayClient() {}
+    virtual void authorize(const PaymentDetails& payment, Reply reply) = 0;
+    virtual void printStats() {}
+
+    // Blocking form for the synchronous payment path
+    GatewayReply authorizeAndWait(const PaymentDetails& payment);
+};
+
+// Gateway wire format: fixed-size frames on a stream socket, in host byte order
+// since both ends run on one machine. Replies carry the request's ID and may
+// come back in any order.
+struct GatewayRequestFrame {
+    uint64_t requestId;
+    int64_t amountCents;
+    int32_t paymentId;
+    uint8_t method;         // PaymentMethod
+    uint8_t reserved[3];
+};
+
+struct GatewayReplyFrame {
+    uint64_t requestId;
+    uint8_t outcome;        // GatewayOutcome: Approved or Declined
+    char code[15];          // NUL-padded authorization code
+};
+
+static_assert(sizeof(GatewayRequestFrame) == 24, "gateway request frame layout changed");
+static_assert(sizeof(GatewayReplyFrame) == 24, "gateway reply frame layout changed");
+
+// Gateway client configuration. Addresses are "unix:/path" or a path with a
+// '/' for a Unix domain socket, otherwise "[host:]port" for TCP (default
+// 127.0.0.1).
+struct GatewayClientConfig {
+    string address;
+    size_t connections = 4;
+    size_t maxBatch = 64;                   // requests per socket write
+    chrono::microseconds timeout = chrono::microseconds(30000);
+    size_t breakerFailures = 20;            // consecutive timeouts or lost connections that open the breaker
+    chrono::milliseconds breakerCooldown = chrono::milliseconds(500);
+};
+
+// Pooled persistent connections to a gateway. Every connection pipelines any
+// number of requests: its sender thread writes whatever was queued since the
+// last write in one batch, and its receiver thread matches replies to requests
+// by ID. A reaper thread times requests out and reconnects lost connections.
+// After breakerFailures consecutive failures the circuit breaker opens and
+// requests fail at once as Unavailable; after each cooldown one probe request
+// goes through, and the breaker closes when the gateway answers it.
+class SocketGatewayClient : public GatewayClient {
+public:
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t replies = 0;
+        uint64_t writes = 0;          // socket writes; requests / writes is the batch size
+        uint64_t timeouts = 0;
+        uint64_t rejected = 0;        // failed fast while the breaker was open or nothing was connected
+        uint64_t breakerOpens = 0;
+        uint64_t reconnects = 0;
+        size_t maxInFlight = 0;
+    };
+
+private:
+    typedef chrono::steady_clock::time_point TimePoint;
+
+    struct Waiting {
+        TimePoint deadline;
+        Reply reply;
+    };
+    struct Connection {
+        int fd = -1;
+        bool broken = true;
+        mutex connectionMutex;
+        condition_variable sendSignal;
+        string outbox;                                  // request frames not yet written
+        unordered_map<uint64_t, Waiting> waiting;
+        deque<pair<TimePoint, uint64_t>> deadlines;     // in send order, so also deadline order
+        thread sender;
+        thread receiver;
+    };
+    enum class BreakerState : uint8_t { Closed, Open, HalfOpen };
+
+    GatewayClientConfig config;
+    vector<unique_ptr<Connection>> pool;
+    atomic<uint64_t> nextRequestId;
+    atomic<size_t> nextConnection;
+    atomic<bool> stopping;
+
+    mutex breakerMutex;
+    BreakerState breaker;
+    size_t consecutiveFailures;
+    TimePoint openedAt;
+
+    mutable mutex statsMutex;
+    Stats counters;
+    size_t inFlight;
+
+    thread reaper;
+    mutex reaperMutex;
+    condition_variable reaperSignal;
+
+    bool connect(Connection& connection, string& error);
+    void disconnect(Connection& connection);
+    void senderLoop(Connection& connection);
+    void receiverLoop(Connection& connection);
+    void reaperLoop();
+    bool allowRequest();
+    void recordAnswer();
+    void recordFailures(size_t failures);
+    void settled(size_t requests, uint64_t* counter);
+
+public:
+    SocketGatewayClient(const GatewayClientConfig& clientConfig);
+    ~SocketGatewayClient();
+    SocketGatewayClient(const SocketGatewayClient&) = delete;
+    SocketGatewayClient& operator=(const SocketGatewayClient&) = delete;
+
+    // Open the pool; false when no connection could be made
+    bool start(string& error);
+    void authorize(const PaymentDetails& payment, Reply reply) override;
+    void printStats() override;
+    Stats stats() const;
+};
+
+// How long the stand-in gateway takes to answer
+struct LatencyDistribution {
+    enum Shape : uint8_t { Fixed, Uniform, Exponential };
+    Shape shape = Uniform;
+    chrono::microseconds low = chrono::microseconds(2000);    // the fixed delay, or the exponential mean
+    chrono::microseconds high = chrono::microseconds(20000);
+
+    chrono::microseconds sample(FastRandom& random) const;
+};
+
+// Parse "fixed:US", "uniform:MIN:MAX" or "exp:MEAN" (microseconds)
+bool parseLatencyDistribution(string_view text, LatencyDistribution& latency);
+
+struct GatewayServerConfig {
+    string address;
+    LatencyDistribution latency;
+    unsigned cardDeclinePercent = 10;
+    unsigned mobileDeclinePercent = 5;
+    chrono::milliseconds outageEvery = chrono::milliseconds(0);   // 0: no outages
+    chrono::milliseconds outageFor = chrono::milliseconds(0);     // requests meanwhile are never answered
+};
+
+// Local stand-in for the card/mobile gateway, speaking the client's wire
+// format. A reader thread per connection schedules each request on a timer
+// heap; the timer thread sends the replies that fall due together on one
+// connection in one write.
+class GatewayServer {
+public:
+    struct Stats {
+        uint64_t connections = 0;
+        uint64_t requests = 0;
+        uint64_t approved = 0;
+        uint64_t declined = 0;
+        uint64_t dropped = 0;       // arrived during an outage
+        uint64_t writes = 0;
+    };
+
+private:
+    struct Connection {
+        int fd;
+        mutex writeMutex;
+    };
+    struct Due {
+        chrono::steady_clock::time_point due;
+        uint64_t sequence;
+        shared_ptr<Connection> connection;
+        GatewayReplyFrame frame;
+    };
+    struct LaterFirst {
+        bool operator()(const Due& a, const Due& b) const {
+            return a.due != b.due ? a.due > b.due : a.sequence > b.sequence;
+        }
+    };
+
+    GatewayServerConfig config;
+    int listenFd;
+    atomic<bool> stopping;
+    chrono::steady_clock::time_point startedAt;
+    mutex serverMutex;
+    condition_variable timerSignal;
+    priority_queue<Due, vector<Due>, LaterFirst> due;
+    uint64_t sequence;
+    vector<shared_ptr<Connection>> connections;
+    vector<thread> readers;
+    thread acceptor;
+    thread timer;
+    Stats counters;
+
+    void acceptLoop();
+    void readerLoop(shared_ptr<Connection> connection);
+    void timerLoop();
+    bool inOutage(chrono::steady_clock::time_point now) const;
+
+public:
+    GatewayServer(const GatewayServerConfig& serverConfig);
+    ~GatewayServer();
+    GatewayServer(const GatewayServer&) = delete;
+    GatewayServer& operator=(const GatewayServer&) = delete;
+
+    bool start(string& error);
+    void stop();
+    Stats stats();
+};
+
+// Serve until SIGINT or SIGTERM
+int runGatewayServer(const GatewayServerConfig& config);
+
+// Authorization engine configuration
+struct AuthorizationConfig {
+    chrono::microseconds timeout = chrono::microseconds(30000);
+    size_t completionThreads = 2;
+    // Sends requests here instead of the simulator; timeouts are then the client's
+    shared_ptr<GatewayClient> gateway;
+};
+
+// Keeps many authorizations in flight. Requests wait on a timer heap until the
+// simulated gateway answers (or the timeout fires), then a completion thread
+// finalizes status and auth code and runs the caller's callback.
+class AuthorizationEngine {
+public:
+    typedef function<void(PaymentDetails&)> Completion;
+
+private:
+    struct Pending {
+        chrono::steady_clock::time_point due;
+        uint64_t sequence;
+        uint64_t submittedTicks;   // for the authorize stage metric
+        PaymentDetails payment;
+        GatewayReply reply;
+        Completion onComplete;
+        promise<PaymentDetails> done;
+    };
+    struct LaterFirst {
+        bool operator()(const unique_ptr<Pending>& a, const unique_ptr<Pending>& b) const {
+            return a->due != b->due ? a->due > b->due : a->sequence > b->sequence;
+        }
+    };
+
+    AuthorizationConfig config;
+    unique_ptr<AuthorizationSimulator> simulator;
+    priority_queue<unique_ptr<Pending>, vector<unique_ptr<Pending>>, LaterFirst> waiting;
+    deque<unique_ptr<Pending>> ready;
+    mutex engineMutex;
+    condition_variable timerSignal;
+    condition_variable readySignal;
+    condition_variable idleSignal;
+    thread timer;
+    vector<thread> completers;
+    bool stopping;
+    uint64_t sequence;
+    size_t inFlight;
+    size_t maxInFlight;
+    size_t approvedCount;
+    size_t declinedCount;
+    size_t timeoutCount;
+    size_t unavailableCount;
+
+    void timerLoop();
+    void completionLoop();
+    void complete(Pending& pending);
+    void answered(unique_ptr<Pending> pending);
+
+public:
+    AuthorizationEngine(const AuthorizationConfig& engineConfig = AuthorizationConfig(),
+                        unique_ptr<AuthorizationSimulator> gateway = unique_ptr<AuthorizationSimulator>());
+    ~AuthorizationEngine();
+
+    // Queue a pending payment; onComplete runs on an engine thread once it is decided
+    future<PaymentDetails> authorize(const PaymentDetails& payment, Completion onComplete);
+    void drain();   // wait until nothing is in flight
+    void printStats();
+};
+
+// Card networks and account types known to the BIN table
+enum class CardNetwork : uint8_t {
+    Unknown, Visa, Mastercard, Amex, Discover, Jcb, DinersClub, UnionPay, Maestro, Count
+};
+
+enum class CardKind : uint8_t {
+    Unknown,    // the cashier's choice stands
+    Credit,
+    Debit,
+    Prepaid,
+    Count
+};
+
+struct CardInfo {
+    CardNetwork network = CardNetwork::Unknown;
+    CardKind kind = CardKind::Unknown;
+};
+
+const char* cardNetworkName(CardNetwork network);
+// Whether a network issues card numbers of this many digits
+bool cardLengthValid(CardNetwork network, size_t digits);
+const char* cardKindName(CardKind kind);
+
+// Copy the digits of text into digits (capacity bytes), skipping spaces and dashes.
+// Returns the number of digits found, which may exceed capacity.
+size_t extractCardDigits(string_view text, char* digits, size_t capacity);
+
+// Luhn (mod 10) checksum over n ASCII digits
+bool luhnValid(const char* digits, size_t n);
+
+// Sorted, non-overlapping issuer ranges over the first eight digits of a card (the BIN/IIN).
+// Overlapping input ranges are resolved in favour of the narrowest one when the table is built.
+class BinTable {
+public:
+    static const size_t KeyDigits = 8;
+
+    struct Range {
+        uint32_t low;       // inclusive, KeyDigits digits
+        uint32_t high;
+        CardInfo info;
+    };
+
+private:
+    static const uint32_t BucketWidth = 10000;                 // keys per first-four-digit bucket
+    static const size_t BucketCount = 100000000 / BucketWidth;
+
+    vector<uint32_t> lows;
+    vector<uint32_t> highs;
+    vector<CardInfo> infos;
+    vector<uint32_t> buckets;   // first range that can hold each bucket's keys
+
+    void build(vector<Range> ranges);
+
+public:
+    BinTable(const vector<Range>& ranges = vector<Range>());
+
+    // Major network prefixes; account types are left to the cashier
+    static shared_ptr<const BinTable> standard();
+
+    // Load "<prefix>[-<prefix>] <network> <credit|debit|prepaid|unknown>" lines; '#' starts a comment
+    static shared_ptr<const BinTable> fromFile(const string& path, string& error);
+
+    size_t size() const { return lows.size(); }
+    bool lookup(const char* digits, size_t n, CardInfo& info) const;
+};
+
+// Receipt layout: each piece of literal text is followed by one field
+enum ReceiptField : uint8_t {
+    ReceiptNoField,
+    ReceiptPaymentId,
+    ReceiptMethod,
+    ReceiptAmount,
+    ReceiptTime,
+    ReceiptStatus,
+    ReceiptAuthorization,
+    ReceiptClosing
+};
+
+struct ReceiptSegment {
+    string_view text;
+    ReceiptField field;
+};
+
+// Fixed receipt layouts, one per payment type
+constexpr ReceiptSegment cashReceiptLayout[] = {
+    {"\n========================================\n===     CASH PAYMENT RECEIPT        ===\nTransaction ID: PAY-",
+     ReceiptPaymentId},
+    {"\nPayment Method: ", ReceiptMethod},
+    {"\nAmount: $", ReceiptAmount},
+    {"\nTime: ", ReceiptTime},
+    {"\nStatus: ", ReceiptStatus},
+    {"\nAuthorization: ", ReceiptAuthorization},
+    {"\n", ReceiptClosing},
+    {"\n========================================\n\n", ReceiptNoField}
+};
+
+constexpr ReceiptSegment cardReceiptLayout[] = {
+    {"\n========================================\n===     CARD PAYMENT RECEIPT        ===\nTransaction ID: PAY-",
+     ReceiptPaymentId},
+    {"\nPayment Method: ", ReceiptMethod},
+    {"\nAmount: $", ReceiptAmount},
+    {"\nTime: ", ReceiptTime},
+    {"\nStatus: ", ReceiptStatus},
+    {"\nAuthorization: ", ReceiptAuthorization},
+    {"\n", ReceiptClosing},
+    {"\n========================================\n\n", ReceiptNoField}
+};
+
+constexpr ReceiptSegment mobileReceiptLayout[] = {
+    {"\n========================================\n===   MOBILE PAYMENT RECEIPT        ===\nTransaction ID: PAY-",
+     ReceiptPaymentId},
+    {"\nPayment Method: ", ReceiptMethod},
+    {"\nAmount: $", ReceiptAmount},
+    {"\nTime: ", ReceiptTime},
+    {"\nStatus: ", ReceiptStatus},
+    {"\nAuthorization: ", ReceiptAuthorization},
+    {"\n", ReceiptClosing},
+    {"\n========================================\n\n", ReceiptNoField}
+};
+
+// Where rendered receipts go
+enum class ReceiptOutput {
+    Console,    // stdout, one write per receipt
+    Spool,      // appended to a file, printer device or FIFO in batches
+    Discard     // not rendered at all
+};
+
+// Renders receipts into a preallocated buffer and emits them in one write.
+// One printer may be shared by several lanes.
+class ReceiptPrinter {
+public:
+    static const size_t ReceiptCapacity = 1024;
+
+private:
+    ReceiptOutput output;
+    int fd;
+    size_t spoolReceipts;       // receipts per spool write
+    size_t pendingReceipts;
+    string spool;
+    mutex spoolMutex;
+
+    void writeSpoolLocked();
+
+public:
+    ReceiptPrinter(ReceiptOutput mode = ReceiptOutput::Console, const string& spoolPath = string(),
+                   size_t receiptsPerWrite = 64);
+    ~ReceiptPrinter();
+    ReceiptPrinter(const ReceiptPrinter&) = delete;
+    ReceiptPrinter& operator=(const ReceiptPrinter&) = delete;
+
+    // Process-wide console printer, the default for every processor
+    static shared_ptr<ReceiptPrinter> console();
+
+    // Format one receipt into text (at least ReceiptCapacity bytes); returns its length
+    static size_t render(const PaymentDetails& payment, char* text);
+
+    bool isOpen() const { return output != ReceiptOutput::Spool || fd >= 0; }
+    void print(const PaymentDetails& payment);
+    void flush();
+};
+
+// Results of recent payments by idempotency key, so a resubmitted payment gets
+// its first result back instead of being authorized and journaled again.
+// A bloom filter answers most new keys without touching the table. The table
+// is a fixed array searched in short probe windows; a new key takes an empty or
+// expired slot there, otherwise it evicts the entry closest to expiry.
+class IdempotencyCache {
+public:
+    static const size_t MaxKeyLength = 47;
+    typedef InlineText<MaxKeyLength> Key;
+
+    enum Outcome {
+        Claimed,      // new key: this caller makes the payment
+        Replayed,     // finished earlier; result holds the original record
+        InProgress,   // the first attempt has not finished; result is still Pending
+        Conflict      // key already used for a different amount or method
+    };
+
+    struct Stats {
+        uint64_t hits = 0;          // Replayed or InProgress
+        uint64_t misses = 0;        // Claimed
+        uint64_t bloomMisses = 0;   // misses answered by the bloom filter alone
+        uint64_t conflicts = 0;
+        uint64_t evictions = 0;     // live entries pushed out before expiry
+    };
+
+private:
+    static const size_t ProbeWindow = 16;
+    static const size_t BloomBitsPerEntry = 8;   // per slot; about 1% false positives at half load
+
+    struct Entry {
+        uint64_t hash;
+        EpochMicros expires;   // 0 when the slot is empty
+        Key key;
+        PaymentMethod requested;
+        Money amount;
+        PaymentDetails result;  // status Pending while the first attempt runs
+    };
+
+    vector<Entry> entries;      // size is a power of two
+    vector<uint64_t> bloom;
+    size_t bloomAdds;           // since the last rebuild; stale bits pile up as entries expire
+    int64_t ttlMicros;
+    Stats counters;
+    mutable mutex cacheMutex;
+
+    Entry* findLocked(uint64_t hash, string_view key, EpochMicros now);
+    bool bloomMayContain(uint64_t hash) const;
+    void bloomAdd(uint64_t hash);
+    void rebuildBloomLocked(EpochMicros now);
+
+public:
+    IdempotencyCache(size_t capacity = 16384, chrono::seconds ttl = chrono::seconds(600));
+
+    // Look the key up, claiming it for this caller when it is new
+    Outcome claim(string_view key, Money amount, PaymentMethod requested, PaymentDetails& result);
+    // Record the final result of a claimed key
+    void complete(string_view key, const PaymentDetails& result);
+    // Give a claim back when the payment never reached authorization
+    void release(string_view key);
+    Stats stats() const;
+};
+
+// Payment Processor Class
+class PaymentProcessor {
+private:
+    static atomic<int> nextPaymentId;   // shared by every lane
+    PaymentDetails* currentPayment;     // &paymentRecord once a payment has started
+    PaymentDetails paymentRecord;       // reused for every payment
+    bool verbose;   // print validation and processing messages
+    shared_ptr<ReceiptPrinter> receipts;
+    shared_ptr<const BinTable> binTable;
+    shared_ptr<IdempotencyCache> idempotency;
+    shared_ptr<GatewayClient> gateway;   // authorizes card and mobile payments when set
+    bool duplicate;  // the last payment call repeated an idempotency key
+    bool authorizeOnly;  // approved card and mobile payments are held as Authorized
+
+public:
+    // Constructor and Destructor
+    PaymentProcessor();
+    ~PaymentProcessor();
+
+    // Core payment methods. A payment refused before it starts (bad amount,
+    // invalid card) leaves getCurrentPayment() null: there is nothing to
+    // record or print. With an idempotency key, a repeat of an earlier
+    // payment returns its result without authorizing again; isDuplicate() is
+    // then true and the caller must not record the payment a second time.
+    bool processCashPayment(Money amount, Money tendered);
+    bool processCardPayment(Money amount, string_view cardNumber, string_view expiry, string_view cvv,
+                            PaymentMethod cardType, string_view idempotencyKey = string_view());
+    bool processMobilePayment(Money amount, string_view mobileProvider, string_view idempotencyKey = string_view());
+
+    // Asynchronous variants: validate now, authorize through the engine and
+    // return at once so the next sale can start. onComplete receives the final
+    // record; it is not called for a replayed payment.
+    future<PaymentDetails> beginCardPayment(AuthorizationEngine& engine, Money amount, string_view cardNumber,
+                                            string_view expiry, string_view cvv, PaymentMethod cardType,
+                                            AuthorizationEngine::Completion onComplete,
+                                            string_view idempotencyKey = string_view());
+    future<PaymentDetails> beginMobilePayment(AuthorizationEngine& engine, Money amount, string_view mobileProvider,
+                                              AuthorizationEngine::Completion onComplete,
+                                              string_view idempotencyKey = string_view());
+
+    // Utility functions
+    void displayPaymentReceipt();
+    Money calculateChange(Money amount, Money tendered);
+    AuthorizationCode generateAuthorizationCode(int paymentId);
+    bool validateCard(string_view cardNumber, string_view expiry, string_view cvv, CardInfo* card = nullptr);
+    string getCurrentTime();
+    PaymentDetails* getCurrentPayment() { return currentPayment; }
+    void setVerbose(bool enabled) { verbose = enabled; }
+    void setReceiptPrinter(shared_ptr<ReceiptPrinter> printer) { receipts = printer; }
+    void setBinTable(shared_ptr<const BinTable> table) { binTable = table; }
+    void setIdempotencyCache(shared_ptr<IdempotencyCache> cache) { idempotency = cache; }
+    void setGateway(shared_ptr<GatewayClient> client) { gateway = client; }
+    // Hold the next approved card and mobile payments for a later capture
+    void setAuthorizeOnly(bool enabled) { authorizeOnly = enabled; }
+    bool isDuplicate() const { return duplicate; }
+
+    // Continue the ID sequence after the last ID already issued
+    static void resumePaymentIds(int lastIssuedId);
+
+private:
+    PaymentDetails& startPayment(PaymentMethod method, Money amount);
+    bool rejectPayment(const char* reason, bool markCurrentFailed);
+    IdempotencyCache::Outcome claimKey(string_view key, Money amount, PaymentMethod requested);
+    bool settlePayment(string_view key);
+    AuthorizationEngine::Completion settleLater(string_view key, AuthorizationEngine::Completion onComplete);
+};
+
+// Initialize static member
+atomic<int> PaymentProcessor::nextPaymentId(1001);
+
+// Journal durability levels, chosen per payment method
+enum class DurabilityMode {
+    Lazy,   // buffered until the next group commit
+    Flush,  // written to the OS before addTransaction returns
+    Fsync   // written and synced to disk before addTransaction returns
+};
+
+// Journal configuration
+struct JournalConfig {
+    string path = "transactions.txt";
+    size_t groupCommitRecords = 64;     // commit after N buffered records
+    long groupCommitMicros = 5000;      // or once the oldest record is T microseconds old
+    bool syncOnGroupCommit = false;     // fsync as part of each group commit
+    uint64_t segmentBytes = 64 << 20;   // seal the open segment once it is this large (0 = never)
+    bool sealDaily = true;              // and before the first record of a new local day
+    bool archiveSealed = true;          // compact sealed segments into columnar archives
+    map<string, DurabilityMode> methodDurability = {
+        {"Cash", DurabilityMode::Lazy},
+        {"Credit Card", DurabilityMode::Fsync},
+        {"Debit Card", DurabilityMode::Fsync},
+        {"Mobile", DurabilityMode::Fsync}
+    };
+};
+
+// Append-only transaction journal with group commit.
+// Records go to config.path, the open segment. Sealing renames it to
+// "<stem>.<sequence>.log" and starts the next one; a background thread then
+// appends a summary to each sealed segment and compacts it into a columnar
+// archive ("<stem>.<sequence>.col").
+class TransactionJournal {
+private:
+    JournalConfig config;
+    int fd;
+    bool regularFile;           // only files are sealed, never e.g. /dev/null
+    string buffer;
+    size_t pendingRecords;
+    chrono::steady_clock::time_point oldestPending;
+    mutex journalMutex;
+    condition_variable commitSignal;
+    thread committer;
+    bool stopping;
+    // Records are numbered as they are appended. An fdatasync runs without
+    // journalMutex; appenders needing a sync wait for it, then sync everything
+    // written meanwhile together.
+    uint64_t appendedRecords;
+    uint64_t writtenRecords;    // reached the file
+    uint64_t syncedRecords;     // durable
+    uint64_t failedSyncs;       // records a failed fdatasync should have covered
+    bool syncing;
+    condition_variable syncSignal;
+    DurabilityMode methodModes[MethodCount];  // config.methodDurability resolved per method
+    uint64_t sequence;          // of the open segment
+    uint64_t openBytes;         // written to the open segment
+    EpochMicros dayEnd;         // local midnight after the open segment's first record; 0 when empty
+
+    // Summary and compaction of sealed segments, started by the first seal
+    thread compactor;
+    mutex compactMutex;
+    condition_variable compactSignal;
+    bool compactPending;
+    atomic<bool> compactStopping;
+
+    bool writeBufferLocked();
+    bool commitLocked(bool sync);
+    bool syncThroughLocked(unique_lock<mutex>& lock, uint64_t record);
+    bool sealLocked();
+    void startRecordLocked(EpochMicros timestamp);
+    bool finishRecordLocked(unique_lock<mutex>& lock, DurabilityMode mode);
+    void committerLoop();
+    void compactorLoop();
+
+public:
+    TransactionJournal(const JournalConfig& journalConfig = JournalConfig());
+    ~TransactionJournal();
+
+    bool isOpen() const { return fd >= 0; }
+    const string& path() const { return config.path; }
+    // False when the record is known not to have reached the file: the journal
+    // is not open, or a write (or the sync its durability mode asks for) failed
+    bool append(const PaymentDetails& payment);
+    bool append(const PaymentAdjustment& adjustment);   // always synced
+    bool flush();
+    bool sync();
+    uint64_t checkpoint();
+    bool seal();                // false when the open segment is empty
+    uint64_t openSequence();
+    DurabilityMode durabilityFor(PaymentMethod method) const;
+};
+
+// One structured entry for the error log
+struct LogRecord {
+    enum Kind : uint8_t { PaymentFailure, Message };
+    EpochMicros timestamp;
+    int64_t amountCents;
+    int paymentId;
+    Kind kind;
+    PaymentMethod method;
+    char reason[16];        // authorization outcome, e.g. "DECLINED"
+    char text[96];          // Message only; longer messages are truncated
+};
+
+// Asynchronous logger for payment_errors.log.
+// Producers claim slots in a bounded lock-free ring and never touch the disk;
+// a writer thread drains the ring and appends in batches. When the ring is
+// full the event is dropped and counted, and the writer logs the count.
+class EventLogger {
+private:
+    struct Slot {
+        atomic<size_t> sequence;
+        LogRecord record;
+    };
+
+    string path;
+    int fd;
+    unique_ptr<Slot[]> slots;
+    size_t mask;
+    atomic<size_t> head;                // next slot to claim (producers)
+    size_t tail;                        // next slot to drain (writer only)
+    atomic<uint64_t> written;
+    atomic<uint64_t> dropped;
+    uint64_t droppedReported;
+    mutex wakeMutex;
+    condition_variable wake;
+    bool stopping;
+    thread writer;
+
+    bool push(const LogRecord& record);
+    bool pop(LogRecord& record);
+    void writerLoop();
+    size_t drainInto(string& batch);
+
+public:
+    EventLogger(const string& filePath = "payment_errors.log", size_t capacity = 8192);
+    ~EventLogger();
+    EventLogger(const EventLogger&) = delete;
+    EventLogger& operator=(const EventLogger&) = delete;
+
+    // The process-wide error log every lane writes to
+    static EventLogger& shared();
+
+    void paymentFailed(const PaymentDetails& payment);
+    void message(string_view text);
+    uint64_t writtenEvents() const { return written.load(memory_order_relaxed); }
+    uint64_t droppedEvents() const { return dropped.load(memory_order_relaxed); }
+};
+
+// Payment stages timed by the metrics build, per payment method
+enum class MetricStage : uint8_t {
+    Validate,    // card checks
+    Authorize,   // gateway decision, submit to completion when asynchronous
+    Record,      // addTransaction up to the journal hand-off, including the lock wait
+    Journal,     // handing the record to the journal
+    Receipt,
+    Count
+};
+const size_t StageCount = size_t(MetricStage::Count);
+static const char* const stageNames[StageCount] = {"validate", "authorize", "record", "journal", "receipt"};
+
+enum class MetricOutcome : uint8_t {
+    Approved,
+    Declined,
+    TimedOut,
+    Count
+};
+const size_t OutcomeCount = size_t(MetricOutcome::Count);
+static const char* const outcomeNames[OutcomeCount] = {"approved", "declined", "timeout"};
+
+#ifdef POS_METRICS
+const bool MetricsEnabled = true;
+
+// Cheap timestamp for stage timing: the TSC on x86, the steady clock elsewhere.
+// MetricsRegistry converts ticks to nanoseconds when the histograms are read.
+inline uint64_t metricTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return uint64_t(chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Log-linear (HDR style) histogram of tick counts: 16 sub-buckets per power of
+// two, so every value is kept to within 1/16 of itself. One thread records;
+// any thread may read it at any time.
+class LatencyHistogram {
+public:
+    static const unsigned SubBucketBits = 4;
+    static const size_t SubBuckets = size_t(1) << SubBucketBits;
+    static const unsigned MaxBits = 44;   // longer stages are clamped
+    static const size_t BucketCount = (MaxBits - SubBucketBits + 1) * SubBuckets;
+
+    atomic<uint64_t> counts[BucketCount];
+    atomic<uint64_t> sum;
+
+    LatencyHistogram();
+    void record(uint64_t ticks) {
+        bump(counts[bucketOf(ticks)], 1);
+        bump(sum, ticks);
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        if (value >= (uint64_t(1) << MaxBits)) value = (uint64_t(1) << MaxBits) - 1;
+        if (value < SubBuckets) return size_t(value);
+        unsigned top = 63 - unsigned(__builtin_clzll(value));
+        return (top - SubBucketBits + 1) * SubBuckets + size_t((value >> (top - SubBucketBits)) & (SubBuckets - 1));
+    }
+    static uint64_t bucketLow(size_t bucket);
+    static uint64_t bucketHigh(size_t bucket);
+
+private:
+    // Single writer: a plain load and store, no locked read-modify-write
+    static void bump(atomic<uint64_t>& counter, uint64_t by) {
+        counter.store(counter.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+};
+
+// Everything one thread records
+struct MetricsShard {
+    LatencyHistogram stages[StageCount][MethodCount];
+    atomic<uint64_t> outcomes[MethodCount][OutcomeCount];
+    atomic<uint64_t> journalWrites;
+    atomic<uint64_t> journalSyncs;
+
+    MetricsShard();
+};
+#else
+const bool MetricsEnabled = false;
+
+// Compiled out: the hooks below inline to nothing
+inline uint64_t metricTicks() { return 0; }
+#endif
+
+// Merged histogram for one stage and method, in ticks
+struct StageTotals {
+    vector<uint64_t> counts;
+    uint64_t count = 0;
+    uint64_t sumTicks = 0;
+
+    uint64_t percentileTicks(double p) const;   // bucket midpoint
+    uint64_t countUpTo(double ticks) const;     // values whose bucket midpoint is at most ticks
+};
+
+// All shards merged, as reported by the menu, batch and metrics file
+struct MetricsSnapshot {
+    StageTotals stages[StageCount][MethodCount];
+    uint64_t outcomes[MethodCount][OutcomeCount] = {};
+    uint64_t journalWrites = 0;
+    uint64_t journalSyncs = 0;
+    double nanosPerTick = 1.0;
+};
+
+// Per-thread metric shards, merged on demand. A thread takes a shard on its
+// first record; when it exits the shard (and its counts) passes to the next
+// new thread, so lane and worker threads that come and go do not pile up shards.
+class MetricsRegistry {
+private:
+#ifdef POS_METRICS
+    mutable mutex shardsMutex;
+    vector<unique_ptr<MetricsShard>> shards;
+    vector<MetricsShard*> idle;
+    uint64_t startTicks;
+    chrono::steady_clock::time_point startTime;
+
+    MetricsShard* acquire();
+    void release(MetricsShard* shard);
+#endif
+
+public:
+    MetricsRegistry();
+    static MetricsRegistry& shared();
+
+#ifdef POS_METRICS
+    MetricsShard& local();
+#endif
+    MetricsSnapshot snapshot() const;
+    void printSummary() const;
+    string prometheusText() const;
+    bool writePrometheus(const string& path) const;   // replaced atomically
+};
+
+#ifdef POS_METRICS
+// A plain pointer has no thread_local guard, so the hot path is one TLS load
+inline MetricsShard& localMetrics() {
+    thread_local MetricsShard* shard = nullptr;
+    if (shard == nullptr) shard = &MetricsRegistry::shared().local();
+    return *shard;
+}
+
+inline void recordStage(MetricStage stage, PaymentMethod method, uint64_t ticks) {
+    localMetrics().stages[size_t(stage)][size_t(method)].record(ticks);
+}
+
+inline void countOutcome(PaymentMethod method, MetricOutcome outcome) {
+    atomic<uint64_t>& counter = localMetrics().outcomes[size_t(method)][size_t(outcome)];
+    counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+inline void countJournalWrite() {
+    MetricsShard& shard = localMetrics();
+    shard.journalWrites.store(shard.journalWrites.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+inline void countJournalSync() {
+    MetricsShard& shard = localMetrics();
+    shard.journalSyncs.store(shard.journalSyncs.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+#else
+inline void recordStage(MetricStage, PaymentMethod, uint64_t) {}
+inline void countOutcome(PaymentMethod, MetricOutcome) {}
+inline void countJournalWrite() {}
+inline void countJournalSync() {}
+#endif
+
+// Metrics build only: where and how often the Prometheus text file is rewritten
+const char* const DefaultMetricsPath = "pos_metrics.prom";
+const long DefaultMetricsSeconds = 10;
+
+// Rewrites the metrics file every interval and once more on shutdown
+class MetricsDumper {
+private:
+    string path;
+    chrono::milliseconds interval;
+    mutex dumperMutex;
+    condition_variable wake;
+    bool stopping;
+    thread writer;
+
+    void writerLoop();
+
+public:
+    MetricsDumper(const string& filePath, chrono::milliseconds every);
+    ~MetricsDumper();
+};
+
+// Per method and status sums, as produced by TransactionStore::aggregate()
+struct MethodStatusTotals {
+    static const size_t KeyCount = MethodCount * StatusCount;
+    int64_t cents[KeyCount];
+    uint64_t counts[KeyCount];
+
+    MethodStatusTotals() {
+        memset(cents, 0, sizeof(cents));
+        memset(counts, 0, sizeof(counts));
+    }
+    static size_t key(PaymentMethod method, PaymentStatus status) {
+        return size_t(method) * StatusCount + size_t(status);
+    }
+    Money amount(PaymentMethod method, PaymentStatus status) const { return Money::fromCents(cents[key(method, status)]); }
+    uint64_t count(PaymentMethod method, PaymentStatus status) const { return counts[key(method, status)]; }
+    Money statusAmount(PaymentStatus status) const;
+    uint64_t statusCount(PaymentStatus status) const;
+    void merge(const MethodStatusTotals& other);
+};
+static_assert(MethodStatusTotals::KeyCount <= 256, "method/status keys are packed in a byte");
+
+// Growable chunked arena for transaction records.
+// Records live in fixed-size chunks that never move, so a handle (the record's
+// position in insertion order) stays valid for the lifetime of the store.
+class TransactionStore {
+public:
+    typedef uint32_t Handle;
+    static const size_t ChunkBits = 12;
+    static const size_t ChunkSize = size_t(1) << ChunkBits;  // records per chunk
+
+private:
+    vector<PaymentDetails*> chunks;
+    // Net amount and method/status key of each record, packed per chunk for aggregate()
+    vector<int64_t*> centsColumns;
+    vector<uint8_t*> keyColumns;
+    size_t count;
+
+    void pack(Handle handle);
+
+public:
+    TransactionStore();
+    ~TransactionStore();
+    TransactionStore(const TransactionStore&) = delete;
+    TransactionStore& operator=(const TransactionStore&) = delete;
+
+    Handle append(const PaymentDetails& payment);
+    void clear();
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    PaymentDetails& operator[](Handle handle) { return chunks[handle >> ChunkBits][handle & (ChunkSize - 1)]; }
+    const PaymentDetails& operator[](Handle handle) const { return chunks[handle >> ChunkBits][handle & (ChunkSize - 1)]; }
+    const PaymentDetails& back() const { return (*this)[Handle(count - 1)]; }
+    // After a record's status or adjusted amount changes in place
+    void repack(Handle handle) { pack(handle); }
+
+    // Totals by method and status in one pass over the packed columns, without
+    // the rollups: an exact recount of everything the store holds
+    MethodStatusTotals aggregate() const;
+
+    // Visit records a chunk at a time: visit(const PaymentDetails* records, size_t n, Handle first)
+    template <typename Visitor>
+    void forEachChunk(Visitor visit) const {
+        size_t remaining = count;
+        for (size_t c = 0; c < chunks.size() && remaining > 0; c++) {
+            size_t n = remaining < ChunkSize ? remaining : ChunkSize;
+            visit(static_cast<const PaymentDetails*>(chunks[c]), n, Handle(c << ChunkBits));
+            remaining -= n;
+        }
+    }
+};
+
+// Open-addressing map from payment ID to store handle. One flat array with
+// linear probing: no node per entry, and a lookup touches one or two cache lines.
+class PaymentIdTable {
+public:
+    typedef TransactionStore::Handle Handle;
+
+private:
+    static const int EmptyKey = INT_MIN;
+    struct Slot {
+        int key;
+        Handle handle;
+    };
+    vector<Slot> slots;   // size is a power of two
+    size_t used = 0;
+    unsigned shift = 64;  // 64 - log2(slots.size())
+
+    size_t home(int key) const {
+        // Fibonacci hashing spreads sequential IDs over the whole table
+        return size_t((uint64_t(uint32_t(key)) * 11400714819323198485ull) >> shift);
+    }
+    void rehash(size_t capacity);
+
+public:
+    void reserve(size_t keys);
+    void set(int key, Handle handle);   // replaces an existing entry
+    bool find(int key, Handle& handle) const;
+    void clear();
+    size_t size() const { return used; }
+};
+
+// Payment ID hash index plus secondary indexes over a TransactionStore.
+// Each index holds store handles and is updated as records are appended.
+// A record whose status changes joins its new status list but is not taken
+// out of the old one, so readers of withStatus() check the record's status.
+class TransactionIndex {
+public:
+    typedef TransactionStore::Handle Handle;
+
+private:
+    PaymentIdTable byId;                      // latest record for each payment ID
+    vector<Handle> byMethod[MethodCount];
+    vector<Handle> byStatus[StatusCount];
+    vector<pair<EpochMicros, Handle>> byTime; // ordered by timestamp
+    unordered_map<Handle, uint32_t> statusLists;  // changed records: bit per byStatus list holding them
+
+public:
+    void insert(const PaymentDetails& payment, Handle handle);
+    void statusChanged(const PaymentDetails& payment, PaymentStatus previous, Handle handle);
+    void clear();
+
+    // Bulk loading: index without keeping time order, then restore it once
+    void reserve(size_t records);
+    void insertUnordered(const PaymentDetails& payment, Handle handle);
+    void sortByTime();
+
+    bool findId(int paymentId, Handle& handle) const;
+    const vector<Handle>& withMethod(PaymentMethod method) const;
+    const vector<Handle>& withStatus(PaymentStatus status) const;
+    vector<Handle> inTimeRange(EpochMicros from, EpochMicros to) const;  // from <= time <= to
+
+    // The same range as positions [first, last) in time order, without copying handles
+    pair<size_t, size_t> timeSpan(EpochMicros from, EpochMicros to) const;
+    Handle inTimeOrder(size_t position) const { return byTime[position].second; }
+};
+
+// Count, sum, min and max of the amounts in one rollup cell
+struct RollupCell {
+    uint64_t count = 0;
+    int64_t sumCents = 0;
+    int64_t minCents = INT64_MAX;
+    int64_t maxCents = INT64_MIN;
+    bool stale = false;         // a removed amount was at min or max; they are only bounds until refreshed
+
+    void add(Money amount);
+    void remove(Money amount);
+    void merge(const RollupCell& other);
+    Money sum() const { return Money::fromCents(sumCents); }
+    Money min() const { return Money::fromCents(count > 0 ? minCents : 0); }
+    Money max() const { return Money::fromCents(count > 0 ? maxCents : 0); }
+};
+
+// Every payment in one time bucket, split by method and status
+struct RollupBucket {
+    RollupCell cells[MethodCount][StatusCount];
+
+    void add(const PaymentDetails& payment);
+    bool remove(const PaymentDetails& payment);   // true when it left the cell's min or max stale
+    void merge(const RollupBucket& other);
+    const RollupCell& cell(PaymentMethod method, PaymentStatus status) const {
+        return cells[size_t(method)][size_t(status)];
+    }
+    RollupCell withStatus(PaymentStatus status) const;   // all methods
+    uint64_t transactions() const;
+};
+
+// Per-minute and per-hour rollups, updated as transactions are added so
+// reports cost O(buckets) however many records the day holds.
+// Minute buckets are aligned to UTC minutes, hour buckets to local hours so they
+// match the hours reports print; the oldest are dropped once a series exceeds
+// its retention.
+class TransactionRollups {
+public:
+    static const time_t MinuteSeconds = 60;
+    static const time_t HourSeconds = 3600;
+
+private:
+    RollupBucket day;                       // every record since the manager started
+    map<time_t, RollupBucket> minutes;      // keyed by bucket start
+    map<time_t, RollupBucket> hours;
+    size_t minuteRetention;
+    size_t hourRetention;
+    bool staleBounds = false;   // some cell's min or max needs refreshing
+
+    static void addToSeries(map<time_t, RollupBucket>& series, time_t start, const PaymentDetails& payment,
+                            size_t retention);
+    void resetStaleBounds();
+    void widenStaleBounds(const PaymentDetails& payment);
+    void finishRefresh();
+
+public:
+    TransactionRollups(size_t minuteBuckets = 24 * 60, size_t hourBuckets = 7 * 24);
+
+    void add(const PaymentDetails& payment);
+    // A record changed in place: its old amount and status leave its buckets
+    // and the new ones take their place. Buckets already dropped stay dropped.
+    void replace(const PaymentDetails& before, const PaymentDetails& after);
+    void clear();
+    // Recompute the min and max that replace() left stale from the records;
+    // cheap when none are. forEachRecord(visit) calls visit(const PaymentDetails&)
+    // for every record.
+    template <typename ForEachRecord>
+    void refreshBounds(ForEachRecord forEachRecord) {
+        if (!staleBounds) return;
+        resetStaleBounds();
+        forEachRecord([this](const PaymentDetails& payment) { widenStaleBounds(payment); });
+        finishRefresh();
+    }
+
+    const RollupBucket& total() const { return day; }
+    const map<time_t, RollupBucket>& hourly() const { return hours; }
+    RollupBucket range(time_t from, time_t to) const;   // from <= time < to, to the minute
+};
+
+// Binary snapshot format (daily_summary.dat), version 5.
+// All integers are little-endian and every section is 8-byte aligned:
+//   header | records[recordCount] | string table | adjusted[adjustedCount] | sources[sourcesCount] |
+//   index footer[recordCount]
+// Records are fixed-width so a mapped file can be read in place. Method names
+// and authorization codes live in the string table as (u16 length, bytes).
+// The footer is (paymentId, record) pairs sorted by paymentId.
+// Version 2 appends the journal checkpoint to the version 1 header; version 3
+// adds the refunded and voided statuses and keeps the layout. Version 4 adds
+// the authorized status and the adjusted section: the amount refunded or
+// released of each record that has any, which records keep as sold. Version 5
+// adds the sources section, the stores and terminals the records were taken
+// on, which each record names; older records all come from the header's.
+const char SnapshotMagic[8] = {'P', 'O', 'S', 'S', 'N', 'A', 'P', 0};
+const uint32_t SnapshotVersion = 5;
+const uint64_t NoJournalCheckpoint = ~uint64_t(0);
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t recordCount;
+    uint64_t recordsOffset;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+    uint64_t indexOffset;
+    int64_t createdAt;
+    uint32_t storeId;
+    uint32_t terminalId;
+    uint64_t bodyChecksum;      // FNV-1a over everything after the header
+    uint64_t headerChecksum;    // FNV-1a over the header with this field zeroed
+    uint64_t journalOffset;     // v2: journal size when the snapshot was taken
+    uint64_t adjustedOffset;    // v4
+    uint64_t adjustedCount;     // v4
+    uint64_t sourcesOffset;     // v5
+    uint64_t sourcesCount;      // v5
+};
+
+struct SnapshotRecord {
+    uint32_t paymentId;
+    uint32_t methodRef;         // string table offset
+    int64_t amountCents;
+    int64_t timestamp;          // seconds since the epoch
+    uint32_t authRef;           // string table offset
+    uint8_t status;             // SnapshotStatus
+    uint8_t reserved;
+    uint16_t source;            // v5: entry in the sources section
+};
+
+struct SnapshotIndexEntry {
+    uint32_t paymentId;
+    uint32_t record;
+};
+
+// Sorted by record
+struct SnapshotAdjusted {
+    uint32_t record;
+    uint32_t reserved;
+    int64_t adjustedCents;
+};
+
+struct SnapshotSource {
+    uint32_t storeId;
+    uint32_t terminalId;
+};
+
+static_assert(sizeof(SnapshotHeader) == 128, "snapshot header layout changed");
+const uint32_t SnapshotHeaderSizeV1 = 88;
+const uint32_t SnapshotHeaderSizeV2 = 96;
+const uint32_t SnapshotHeaderSizeV4 = 112;
+static_assert(sizeof(SnapshotRecord) == 32, "snapshot record layout changed");
+static_assert(sizeof(SnapshotIndexEntry) == 8, "snapshot index layout changed");
+static_assert(sizeof(SnapshotAdjusted) == 16, "snapshot adjusted layout changed");
+static_assert(sizeof(SnapshotSource) == 8, "snapshot source layout changed");
+
+enum SnapshotStatus : uint8_t {
+    SnapshotPending = 0,
+    SnapshotCompleted = 1,
+    SnapshotFailed = 2,
+    SnapshotRefunded = 3,   // v3
+    SnapshotVoided = 4,     // v3
+    SnapshotAuthorized = 5  // v4
+};
+
+// The store and terminal this process runs as, from POS_STORE_ID and
+// POS_TERMINAL_ID; stamped on its snapshots so consolidation can tell them apart
+struct TerminalIdentity {
+    uint32_t storeId = 0;
+    uint32_t terminalId = 0;
+
+    static const TerminalIdentity& local();
+};
+
+// Streams records into a new snapshot file
+class SnapshotWriter {
+private:
+    string path;
+    string tempPath;
+    int fd;
+    vector<char> pending;
+    uint64_t checksum;
+    uint64_t offset;
+    uint64_t recordCount;
+    string strings;
+    vector<uint32_t> stringSlots;   // open addressing over string refs + 1; 0 is empty
+    size_t stringCount;
+    vector<SnapshotIndexEntry> index;
+    vector<SnapshotAdjusted> adjusted;
+    vector<SnapshotSource> sources;     // 0 is the writer's own store and terminal
+    uint32_t storeId;
+    uint32_t terminalId;
+    uint64_t journalOffset;
+
+    void emit(const void* data, size_t size);
+    void drain();
+    void pad();
+    uint32_t intern(string_view text);
+    string_view interned(uint32_t ref) const;
+    void growStringSlots();
+
+public:
+    SnapshotWriter(const string& filePath, uint32_t store = 0, uint32_t terminal = 0);
+    ~SnapshotWriter();
+
+    void add(int paymentId, string_view method, int64_t amountCents, int64_t timestamp,
+             uint8_t status, string_view authorizationCode, int64_t adjustedCents = 0, uint16_t source = 0);
+    void add(const PaymentDetails& payment);
+    uint16_t addSource(uint32_t store, uint32_t terminal);     // for records taken elsewhere
+    void setJournalOffset(uint64_t offset) { journalOffset = offset; }
+    void finish();
+};
+
+// Read-only view of a memory-mapped snapshot
+class SnapshotView {
+private:
+    int fd;
+    const char* base;
+    size_t length;
+    SnapshotHeader header;      // copied out so older headers read as the current one
+    const SnapshotRecord* records;
+    const SnapshotIndexEntry* index;
+    const SnapshotAdjusted* adjustedRecords;
+    const SnapshotSource* sourceTable;
+    size_t sourceTableSize;
+    SnapshotSource headerSource;    // the only source of a snapshot before version 5
+    const char* strings;
+
+    string checkReferences(uint64_t stringsSize) const;     // what is damaged, or empty
+
+public:
+    SnapshotView();
+    ~SnapshotView();
+    SnapshotView(const SnapshotView&) = delete;
+    SnapshotView& operator=(const SnapshotView&) = delete;
+
+    void open(const string& path, bool verifyBody = false);
+    void close();
+    bool isOpen() const { return base != nullptr; }
+
+    size_t size() const;
+    const SnapshotHeader& info() const { return header; }
+    uint64_t journalOffset() const;
+    int maxPaymentId() const;
+    const SnapshotRecord& record(size_t i) const { return records[i]; }
+    const SnapshotIndexEntry& indexEntry(size_t i) const { return index[i]; }   // by payment ID
+    string_view text(uint32_t ref) const;
+    const SnapshotRecord* findById(int paymentId) const;
+    Money adjusted(const SnapshotRecord& rec) const;    // refunded or released of its amount
+    size_t sourceCount() const { return sourceTableSize; }
+    TerminalIdentity source(size_t i) const;
+    TerminalIdentity source(const SnapshotRecord& rec) const;   // where it was taken
+    PaymentDetails toPaymentDetails(const SnapshotRecord& rec) const;
+    void generateReport() const;
+};
+
+// What startup recovery found
+struct RecoveryResult {
+    size_t snapshotRecords;
+    size_t journalRecords;
+    int maxPaymentId;
+    double elapsedMs;
+    size_t segmentsRead;        // sealed journal segments replayed
+    size_t segmentsSkipped;     // sealed journal segments the snapshot already covers
+    size_t adjustments;         // refunds, voids and captures replayed from the journal
+};
+
+// Journal positions (snapshot checkpoints) name a segment and an offset in it.
+// Journals from before segments were introduced are segment 0, so their plain
+// offsets read the same.
+const unsigned SegmentOffsetBits = 40;
+
+inline uint64_t journalPosition(uint64_t sequence, uint64_t offset) {
+    return (sequence << SegmentOffsetBits) | offset;
+}
+inline uint64_t positionSegment(uint64_t position) { return position >> SegmentOffsetBits; }
+inline uint64_t positionOffset(uint64_t position) {
+    return position & ((uint64_t(1) << SegmentOffsetBits) - 1);
+}
+
+// What one sealed journal segment holds. A sealed text segment ends with it
+// as a "#SEGMENT ..." line and an archive carries it in its header, so
+// recovery and journal queries can skip a segment without reading it.
+struct SegmentSummary {
+    uint64_t sequence = 0;
+    uint64_t records = 0;
+    int minId = INT_MAX;
+    int maxId = INT_MIN;
+    EpochMicros fromTime = INT64_MAX;
+    EpochMicros toTime = INT64_MIN;
+    uint32_t methods = 0;       // bit per PaymentMethod present
+    uint32_t statuses = 0;      // bit per PaymentStatus present
+    uint64_t adjustments = 0;   // adjustment records, which may name payments of any segment
+    uint64_t checksum = 0;      // FNV-1a over the segment's record lines
+
+    void add(const PaymentDetails& payment);
+};
+
+// A sealed segment file
+struct JournalSegment {
+    string path;
+    uint64_t sequence;
+    bool archived;              // columnar archive rather than text
+};
+
+// Columnar archive format (<stem>.<sequence>.col), version 2.
+// Little-endian; header | columns, each column 8-byte aligned:
+//   ids, timestamps   zigzag varint deltas (timestamps in timeUnit microseconds)
+//   amounts           zigzag varint cents
+//   methods, statuses one byte per record, a code into the dictionary
+//   auth codes        u8 length + bytes per record
+//   dictionary        u8 count + (u8 length, name) for methods, then statuses
+//   adjustments       per adjustment: zigzag varint id and time deltas, kind
+//                     byte, zigzag varint amount, status code, zigzag varint balance
+// Version 1 has no adjustments column and no adjustment count.
+const char ArchiveMagic[8] = {'P', 'O', 'S', 'A', 'R', 'C', 'H', 0};
+const uint32_t ArchiveVersion = 2;
+
+enum ArchiveColumn : uint8_t {
+    ArchiveIds,
+    ArchiveTimes,
+    ArchiveAmounts,
+    ArchiveMethods,
+    ArchiveStatuses,
+    ArchiveAuthCodes,
+    ArchiveDictionary,
+    ArchiveAdjustments,     // v2
+    ArchiveColumnCount
+};
+const size_t ArchiveColumnCountV1 = ArchiveAdjustments;
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t sequence;
+    uint64_t recordCount;
+    int32_t minId;
+    int32_t maxId;
+    int64_t fromTime;
+    int64_t toTime;
+    uint32_t methods;
+    uint32_t statuses;
+    uint64_t timeUnit;
+    uint64_t sourceChecksum;    // the text segment's summary checksum
+    uint64_t columnOffset[ArchiveColumnCount];
+    uint64_t columnSize[ArchiveColumnCount];
+    uint64_t adjustmentCount;   // v2
+    uint64_t bodyChecksum;      // FNV-1a over everything after the header
+    uint64_t headerChecksum;    // FNV-1a over the header with this field zeroed
+};
+
+static_assert(sizeof(ArchiveHeader) == 232, "archive header layout changed");
+const uint32_t ArchiveHeaderSizeV1 = 208;
+
+string journalSegmentPath(const string& journalPath, uint64_t sequence, const char* extension);
+vector<JournalSegment> listJournalSegments(const string& journalPath);    // in sequence order
+bool readSegmentSummary(const JournalSegment& segment, SegmentSummary& summary);
+// Adjustments are kept when adjustments is given and skipped otherwise
+bool loadJournalSegment(const JournalSegment& segment, vector<PaymentDetails>& records, string& error,
+                        vector<PaymentAdjustment>* adjustments = nullptr);
+// Summarize, then archive, sealed text segments until none are left or stop is set
+void compactJournalSegments(const string& journalPath, bool archive, const atomic<bool>& stop);
+
+// Totals behind the daily report, mergeable across lanes
+struct ReportTotals {
+    size_t transactions = 0;
+    size_t successful = 0;      // still completed; revenue is net of partial refunds
+    size_t refunded = 0;
+    size_t voided = 0;
+    size_t authorized = 0;      // approved, not yet captured; not revenue
+    Money revenue;
+    Money methodStats[MethodCount];          // completed payments only
+    size_t methodCounts[MethodCount] = {};   // methods with none are not listed
+
+    void add(const RollupBucket& bucket);
+    void add(const MethodStatusTotals& aggregate);
+    void merge(const ReportTotals& other);
+};
+
+// How a query's matches are grouped
+enum class QueryGroup : uint8_t {
+    None,
+    Method,
+    Status,
+    Hour,   // hour buckets aligned like the rollups'
+    Count
+};
+const size_t QueryGroupCount = size_t(QueryGroup::Count);
+
+// Ad-hoc filter over the transaction history. Every filter is inclusive and
+// matches everything until set. Clock times ("from=14:00") are kept as minutes
+// of the day until resolved() turns them into today's times.
+struct TransactionQuery {
+    uint32_t methods = (1u << MethodCount) - 1;     // one bit per PaymentMethod
+    uint32_t statuses = (1u << StatusCount) - 1;    // one bit per PaymentStatus
+    Money minAmount = Money::fromCents(INT64_MIN);
+    Money maxAmount = Money::fromCents(INT64_MAX);
+    EpochMicros from = INT64_MIN;
+    EpochMicros to = INT64_MAX;
+    int fromMinute = -1;
+    int toMinute = -1;
+    QueryGroup groupBy = QueryGroup::None;
+
+    bool matches(const PaymentDetails& payment) const {
+        return (methods >> size_t(payment.paymentMethod) & 1) && (statuses >> size_t(payment.status) & 1) &&
+               payment.net() >= minAmount && payment.net() <= maxAmount &&
+               payment.timestamp >= from && payment.timestamp <= to;
+    }
+    int64_t groupKey(const PaymentDetails& payment) const;
+    bool filtersAmount() const;
+    bool filtersTime() const;
+    bool mayMatch(const SegmentSummary& summary) const;   // false when no record in it can match
+    TransactionQuery resolved(time_t now) const;
+};
+
+// Parse query words from words[first] on:
+//   method=<cash|credit|debit|mobile|applepay|googlepay|paypal>[,...]
+//   status=<pending|completed|failed|refunded|voided|authorized>[,...]   min=<amount>   max=<amount>
+//   from=<HH:MM|YYYY-MM-DD[THH:MM]>   to=<same>   by=<method|status|hour>
+bool parseQuery(const vector<string_view>& words, size_t first, TransactionQuery& query, string& error);
+
+// Count, sum, min and max per group of a query's matches
+struct QueryResult {
+    map<int64_t, RollupCell> groups;   // keyed by method, status or hour start; 0 without a group-by
+    size_t scanned = 0;                // records read to answer it
+    size_t threads = 0;
+    const char* plan = nullptr;        // which index answered it
+
+    void merge(const QueryResult& other);
+};
+
+// Transaction Manager Class.
+// Public members are safe to call from several threads; each manager is
+// guarded by its own mutex and the journal may be shared between managers.
+class TransactionManager {
+private:
+    TransactionStore transactionHistory;
+    TransactionIndex transactionIndex;
+    mutable TransactionRollups rollups;     // min/max refreshed by readers after a refund or void
+    // Records recovered from the snapshot are read in place from its mapping.
+    // One is copied out when it is looked up by ID or adjusted, and from then
+    // on the copy stands for it.
+    unique_ptr<SnapshotView> recovered;
+    unordered_map<uint32_t, PaymentDetails> recoveredCopies;    // by record number
+    array<string, 4> supportedMethods;
+    shared_ptr<TransactionJournal> journal;
+    mutable mutex managerMutex;
+    mutex adjustMutex;      // one adjustment at a time, from planning until it is applied
+
+    // Handle of a record that is a copy of a recovered one, not in the store
+    static const TransactionStore::Handle RecoveredHandle = UINT32_MAX;
+
+    void restoreTransaction(const PaymentDetails& transaction);
+    bool restoreAdjustment(const PaymentAdjustment& adjustment);
+    PaymentDetails* lookup(int paymentId, TransactionStore::Handle& handle);
+    void applyAdjustment(PaymentDetails& record, TransactionStore::Handle handle, const PaymentAdjustment& adjustment);
+    size_t recoveredCount() const { return recovered ? recovered->size() : 0; }
+    PaymentDetails recoveredRecord(size_t i) const;
+    PaymentDetails* copyRecovered(const SnapshotRecord& rec);
+    MethodStatusTotals aggregateLocked() const;     // every record's totals; the caller holds managerMutex
+
+    // Visit every record, recovered ones first: visit(const PaymentDetails&)
+    template <typename Visitor>
+    void forEachRecord(Visitor visit) const {
+        for (size_t i = 0; i < recoveredCount(); i++) {
+            visit(recoveredRecord(i));
+        }
+        transactionHistory.forEachChunk([&](const PaymentDetails* records, size_t n, TransactionStore::Handle) {
+            for (size_t i = 0; i < n; i++) {
+                visit(records[i]);
+            }
+        });
+    }
+    void replayJournalTail(uint64_t checkpoint, int watermark, const SnapshotView* snapshot, RecoveryResult& result);
+
+public:
+    TransactionManager(const JournalConfig& journalConfig = JournalConfig());
+    TransactionManager(shared_ptr<TransactionJournal> sharedJournal);
+    ~TransactionManager();
+
+    void addTransaction(PaymentDetails* transaction);
+    // Refunds or voids a completed payment, or captures or voids an authorized
+    // one. The adjustment is journaled and synced before it is applied.
+    bool adjustTransaction(int paymentId, AdjustmentKind kind, Money amount, PaymentAdjustment& adjustment,
+                           string& error);
+    // Not journaled; returns how many adjustments named a payment that is not loaded
+    size_t importTransactions(const vector<vector<PaymentDetails>>& batches,
+                              const vector<vector<PaymentAdjustment>>& adjustments = {});
+    RecoveryResult recover(const string& snapshotPath = "daily_summary.dat");
+    PaymentDetails* findTransactionById(int paymentId);
+    vector<PaymentDetails*> findTransactionsByMethod(PaymentMethod method);
+    vector<PaymentDetails*> findTransactionsByStatus(PaymentStatus status);
+    vector<PaymentDetails*> findTransactionsInTimeRange(time_t from, time_t to);
+    void generateDailyReport();
+    void generateHourlyReport();
+    void generateShiftReport(time_t from, time_t to);
+    void generateQueryReport(const TransactionQuery& query);
+    void saveTransactionsToFile(const PaymentDetails& transaction);
+    void displayTransactionHistory();
+    void updatePaymentStats(const PaymentDetails& transaction);
+    void saveBinaryBackup();
+    void closeBatch();
+    void logError(string errorMessage);
+
+    // Merged views across lanes
+    ReportTotals reportTotals() const;       // from the rollups
+    ReportTotals recountTotals() const;      // the same, from every record
+    ReportTotals shiftTotals(time_t from, time_t to) const;
+    QueryResult runQuery(const TransactionQuery& query) const;
+    void collectHourly(map<time_t, RollupBucket>& hours) const;
+    void collectHistory(vector<PaymentDetails>& records) const;
+    void writeSnapshot(SnapshotWriter& writer) const;
+    TransactionJournal& transactionJournal() { return *journal; }
+
+    static void printDailyReport(const ReportTotals& totals);
+    static void printShiftReport(time_t from, time_t to, const ReportTotals& totals);
+    static void printHourlyReport(const map<time_t, RollupBucket>& hours);
+    static void printQueryReport(const TransactionQuery& query, const QueryResult& result, double elapsedMs);
+    static void printHistoryLine(size_t line, const PaymentDetails& transaction);
+    static void printMethodStats(const ReportTotals& totals);
+};
+
+// One TransactionManager per checkout lane, all writing one journal.
+// Lanes never share a lock on the payment path; reports merge the shards.
+class ShardedTransactionManager {
+private:
+    shared_ptr<TransactionJournal> journal;
+    vector<unique_ptr<TransactionManager>> shards;
+
+public:
+    ShardedTransactionManager(size_t lanes, const JournalConfig& journalConfig = JournalConfig());
+
+    size_t laneCount() const { return shards.size(); }
+    TransactionManager& lane(size_t index) { return *shards[index]; }
+
+    RecoveryResult recover(const string& snapshotPath = "daily_summary.dat");
+    PaymentDetails* findTransactionById(int paymentId);
+    bool adjustTransaction(int paymentId, AdjustmentKind kind, Money amount, PaymentAdjustment& adjustment,
+                           string& error);
+    void generateDailyReport();
+    void generateHourlyReport();
+    void generateShiftReport(time_t from, time_t to);
+    void generateQueryReport(const TransactionQuery& query);
+    void displayTransactionHistory();
+    void saveBinaryBackup();
+    void closeBatch();
+};
+
+// What an import of historical journals found
+struct ImportResult {
+    size_t files = 0;
+    uint64_t bytes = 0;
+    size_t records = 0;
+    size_t rejected = 0;
+    size_t adjustments = 0;
+    size_t orphaned = 0;        // adjustments to payments none of the files hold
+    size_t threads = 0;
+    double parseMs = 0.0;
+    double loadMs = 0.0;
+};
+
+// Loads historical transactions.txt journals into a TransactionManager.
+// Each file is memory-mapped and cut at line boundaries into slices that
+// worker threads parse in place; the records are then loaded in file order.
+// Lines that do not parse go to the reject file as "<file>:<line>: <text>".
+class JournalImporter {
+private:
+    struct MappedJournal {
+        string path;
+        const char* data;
+        size_t size;
+    };
+    struct Slice {
+        size_t file;
+        size_t begin, end;                         // byte range, ends after a newline
+        size_t lines = 0;
+        vector<PaymentDetails> records;
+        vector<PaymentAdjustment> adjustments;
+        vector<pair<size_t, string_view>> rejects;   // line within the slice, text
+    };
+
+    size_t threadCount;
+    string rejectPath;
+    vector<MappedJournal> journals;
+    vector<Slice> slices;
+
+    void map(const string& path);
+    void unmapAll();
+    void cutSlices(size_t sliceBytes);
+    static void parseSlice(const MappedJournal& journal, Slice& slice);
+    void writeRejects() const;
+
+public:
+    JournalImporter(size_t threads = 0, const string& rejectFile = "rejected_lines.txt");
+    ~JournalImporter();
+
+    ImportResult run(const vector<string>& paths, TransactionManager& manager);
+};
+
+// One store's share of a consolidation
+struct StoreTotals {
+    set<uint32_t> terminals;
+    RollupBucket payments;
+};
+
+// A payment ID more than one terminal issued for different payments
+struct CollidingId {
+    int paymentId;
+    vector<TerminalIdentity> terminals;
+};
+
+// What a consolidation of terminal backups found
+struct ConsolidationResult {
+    size_t files = 0;
+    uint64_t bytes = 0;
+    size_t unreadable = 0;          // backups skipped
+    size_t records = 0;             // written to the consolidated snapshot
+    size_t duplicates = 0;          // identical records in more than one backup, written once
+    size_t collisions = 0;          // payment IDs shared by different records, all kept
+    vector<CollidingId> collidingIds;   // the first few
+    size_t threads = 0;
+    double readMs = 0.0;
+    double mergeMs = 0.0;
+    double writeMs = 0.0;
+    map<uint32_t, StoreTotals> stores;
+};
+
+// Combines daily_summary.dat backups from many terminals into one snapshot.
+// Backups are mapped, verified and put in (timestamp, payment ID) order on
+// parallel threads. The merge is cut into time ranges that threads k-way merge
+// independently, and the ranges are written in order. A payment ID found in
+// more than one record is a duplicate when the records are identical and come
+// from the same terminal (a backup submitted twice), written once, or a
+// collision otherwise (terminals numbering from the same start), all kept and
+// reported with the terminals that issued them. Each record is written with the
+// store and terminal it was taken on, so colliding IDs stay apart.
+class SnapshotConsolidator {
+private:
+    struct Source {
+        string path;
+        SnapshotView view;
+        vector<uint32_t> order;     // records by (timestamp, payment ID)
+        vector<uint64_t> terminals; // store << 32 | terminal of each of the backup's sources
+        vector<uint16_t> written;   // the same sources in the consolidated snapshot
+        vector<bool> used;          // sources any record names
+    };
+    struct Ref {
+        uint32_t source;
+        uint32_t record;
+    };
+    struct Range {
+        vector<Ref> records;
+        size_t duplicates = 0;
+        size_t collisions = 0;
+        vector<CollidingId> collidingIds;
+        map<uint32_t, StoreTotals> stores;
+    };
+
+    size_t threadCount;
+    vector<unique_ptr<Source>> sources;
+
+    void load(const vector<string>& paths, ConsolidationResult& result);
+    void mergeTimes(int64_t from, int64_t to, Range& range) const;     // timestamps in [from, to)
+    void findCollisions(uint64_t from, uint64_t to, Range& range) const; // payment IDs in [from, to)
+    uint64_t terminalOf(Ref ref) const;
+    bool sameRecord(Ref a, Ref b) const;
+    template <typename Task>
+    void parallel(size_t tasks, Task task) const;
+
+public:
+    explicit SnapshotConsolidator(size_t threads = 0);
+
+    ConsolidationResult run(const vector<string>& paths, const string& outputPath);
+};
+
+// Simulation Implementation
+static uint64_t drawSimulationSeed() {
+    random_device device;
+    return (uint64_t(device()) << 32) | device();
+}
+
+// Set before any lane or gateway thread starts; only read afterwards
+static uint64_t simulationSeedValue = drawSimulationSeed();
+static bool simulationSeedFixed = false;
+
+void setSimulationSeed(uint64_t seed) {
+    simulationSeedValue = seed;
+    simulationSeedFixed = true;
+}
+
+bool parseSimulationSeed(const char* text, uint64_t& seed) {
+    // strtoull would take "12abc" as 12 and "-1" as UINT64_MAX
+    if (text == nullptr || *text < '0' || *text > '9') return false;
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 0);
+    if (errno != 0 || end == text || *end != '\0') return false;
+    seed = uint64_t(value);
+    return true;
+}
+
+uint64_t simulationSeed() {
+    return simulationSeedValue;
+}
+
+bool simulationSeeded() {
+    return simulationSeedFixed;
+}
+
+FastRandom paymentRandom(int paymentId) {
+    return FastRandom(simulationSeedValue ^ (uint64_t(uint32_t(paymentId)) * 0xD6E8FEB86659FD93ull));
+}
+
+// The key must not change between runs that share a journal: payment IDs carry
+// on from the last run, and under a new permutation an ID could take a code an
+// earlier one already had. A drawn seed changes every start, so the key comes
+// from the terminal's identity, which does not.
+static uint64_t authorizationCodeKey() {
+    static const uint64_t key = [] {
+        const TerminalIdentity& terminal = TerminalIdentity::local();
+        FastRandom mix((uint64_t(terminal.storeId) << 32) | terminal.terminalId);
+        return mix();
+    }();
+    return key;
+}
+
+AuthorizationCode makeAuthorizationCode(int paymentId) {
+    // Four-round Feistel network over 32 bits, cycle-walked down to the 36^6
+    // codes: a bijection, so distinct IDs in range never meet
+    const uint32_t codes = 2176782336u;   // 36^6
+    uint64_t key = authorizationCodeKey();
+    uint32_t value = uint32_t(paymentId) % codes;
+    do {
+        uint32_t left = value >> 16, right = value & 0xFFFF;
+        for (uint64_t round = 0; round < 4; round++) {
+            uint64_t mix = (key ^ (round << 56) ^ right) * 0x9E3779B97F4A7C15ull;
+            uint32_t next = left ^ uint32_t((mix ^ (mix >> 29)) >> 32 & 0xFFFF);
+            left = right;
+            right = next;
+        }
+        value = (left << 16) | right;
+    } while (value >= codes);
+
+    const char alphanum[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    char code[11] = {'A', 'U', 'T', 'H', '-'};
+    for (int i = 10; i >= 5; i--) {
+        code[i] = alphanum[value % 36];
+        value /= 36;
+    }
+    return AuthorizationCode(string_view(code, sizeof(code)));
+}
+
+// PaymentProcessor Implementation
+void PaymentProcessor::resumePaymentIds(int lastIssuedId) {
+    int current = nextPaymentId.load();
+    while (lastIssuedId >= current && !nextPaymentId.compare_exchange_weak(current, lastIssuedId + 1)) {
+    }
+}
+
+PaymentProcessor::PaymentProcessor() {
+    currentPayment = nullptr;
+    verbose = true;
+    duplicate = false;
+    authorizeOnly = false;
+    receipts = ReceiptPrinter::console();
+    binTable = BinTable::standard();
+}
+
+PaymentProcessor::~PaymentProcessor() {
+    // The payment record is a member; nothing to free
+    currentPayment = nullptr;
+}
+
+// Reset the reusable record for a new payment
+PaymentDetails& PaymentProcessor::startPayment(PaymentMethod method, Money amount) {
+    currentPayment = &paymentRecord;
+    paymentRecord.paymentId = nextPaymentId.fetch_add(1);
+    paymentRecord.paymentMethod = method;
+    paymentRecord.outcome = GatewayOutcome::Unavailable;
+    paymentRecord.amount = amount;
+    paymentRecord.timestamp = currentEpochMicros();
+    paymentRecord.status = PaymentStatus::Pending;
+    paymentRecord.authorizationCode = string_view();
+    paymentRecord.adjusted = Money();
+    return paymentRecord;
+}
+
+// Report a refused payment. Card and mobile payments also mark the payment this
+// call started Failed, if it got that far; nothing is thrown so a decline costs
+// no allocation.
+bool PaymentProcessor::rejectPayment(const char* reason, bool markCurrentFailed) {
+    if (verbose) cout << "ERROR: " << reason << endl;
+    if (markCurrentFailed && currentPayment != nullptr) {
+        currentPayment->status = PaymentStatus::Failed;
+    }
+    return false;
+}
+
+string PaymentProcessor::getCurrentTime() {
+    return string(transactionTimeText(currentEpochMicros()));
+}
+
+AuthorizationCode PaymentProcessor::generateAuthorizationCode(int paymentId) {
+    return makeAuthorizationCode(paymentId);
+}
+
+Money PaymentProcessor::calculateChange(Money amount, Money tendered) {
+    return tendered - amount;
+}
+
+bool PaymentProcessor::validateCard(string_view cardNumber, string_view expiry, string_view cvv, CardInfo* card) {
+    // Remove spaces from card number
+    char digits[32];
+    size_t digitCount = extractCardDigits(cardNumber, digits, sizeof(digits));
+
+    // Card numbers run from 12 to 19 digits; the issuer's network narrows that below
+    if (digitCount < 12 || digitCount > 19) {
+        if (verbose) cout << "ERROR: Invalid card number length (must be 12-19 digits)" << endl;
+        return false;
+    }
+
+    // Mistyped numbers are caught here instead of by the issuer
+    if (!luhnValid(digits, digitCount)) {
+        if (verbose) cout << "ERROR: Invalid card number (checksum failed)" << endl;
+        return false;
+    }
+
+    CardInfo info;
+    if (!binTable->lookup(digits, digitCount, info)) {
+        if (verbose) cout << "ERROR: Card issuer not recognized" << endl;
+        return false;
+    }
+    if (!cardLengthValid(info.network, digitCount)) {
+        if (verbose) cout << "ERROR: Invalid card number length for " << cardNetworkName(info.network) << endl;
+        return false;
+    }
+    if (card != nullptr) {
+        *card = info;
+    }
+
+    // Validate expiry format (MM/YY)
+    if (expiry.length() != 5 || expiry[2] != '/') {
+        if (verbose) cout << "ERROR: Invalid expiry format (use MM/YY)" << endl;
+        return false;
+    }
+
+    // Check CVV length (3-4 digits)
+    if (cvv.length() < 3 || cvv.length() > 4) {
+        if (verbose) cout << "ERROR: Invalid CVV length (must be 3-4 digits)" << endl;
+        return false;
+    }
+
+    for (char c : cvv) {
+        if (!isdigit(static_cast<unsigned char>(c))) {
+            if (verbose) cout << "ERROR: CVV must contain only digits" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// What the cashier is told when the gateway does not approve a payment
+static const char* gatewayFailure(const PaymentDetails& payment, GatewayOutcome outcome) {
+    if (outcome == GatewayOutcome::Unavailable) return "Payment gateway unavailable - Please try again later";
+    if (outcome == GatewayOutcome::Declined) {
+        return isMobile(payment.paymentMethod) ? "Payment Declined - Please use another payment method"
+                                               : "Payment Declined - Insufficient Funds";
+    }
+    return "Payment Timeout - Please try again";
+}
+
+// Card type for a validated card: the issuer's account type when the BIN table knows it
+static PaymentMethod cardMethod(const CardInfo& card, PaymentMethod chosen) {
+    if (card.kind == CardKind::Debit || card.kind == CardKind::Prepaid) return PaymentMethod::DebitCard;
+    if (card.kind == CardKind::Credit) return PaymentMethod::CreditCard;
+    return chosen;
+}
+
+bool PaymentProcessor::processCashPayment(Money amount, Money tendered) {
+    duplicate = false;
+    currentPayment = nullptr;   // nothing started yet
+    // Validate amount
+    if (amount.cents <= 0) {
+        return rejectPayment("Amount must be greater than zero", false);
+    }
+
+    if (tendered < amount) {
+        return rejectPayment("Insufficient cash tendered", false);
+    }
+
+    PaymentDetails& payment = startPayment(PaymentMethod::Cash, amount);
+    payment.status = PaymentStatus::Completed;
+    payment.outcome = GatewayOutcome::Approved;
+
+    // "CASH-<id>"
+    char code[24] = {'C', 'A', 'S', 'H', '-'};
+    auto digits = to_chars(code + 5, code + sizeof(code), payment.paymentId);
+    payment.authorizationCode = string_view(code, size_t(digits.ptr - code));
+    return true;
+}
+
+// Claim an idempotency key for a new payment. A Replayed key loads the earlier
+// record as the current payment and marks the call a duplicate. InProgress and
+// Conflict refuse the payment and leave the current payment alone: the first
+// attempt has no result to return yet, or the key belongs to another payment.
+IdempotencyCache::Outcome PaymentProcessor::claimKey(string_view key, Money amount, PaymentMethod requested) {
+    if (key.empty() || !idempotency) return IdempotencyCache::Claimed;
+
+    PaymentDetails earlier;
+    IdempotencyCache::Outcome outcome = idempotency->claim(key, amount, requested, earlier);
+    switch (outcome) {
+        case IdempotencyCache::Claimed:
+            break;
+        case IdempotencyCache::Replayed:
+            if (verbose) cout << "Duplicate submission: returning the result of PAY-" << earlier.paymentId << endl;
+            paymentRecord = earlier;
+            currentPayment = &paymentRecord;
+            duplicate = true;
+            break;
+        case IdempotencyCache::InProgress:
+            rejectPayment("Duplicate submission: the first attempt is still in progress", false);
+            break;
+        case IdempotencyCache::Conflict:
+            rejectPayment("Idempotency key was already used for a different payment", false);
+            break;
+    }
+    return outcome;
+}
+
+// Remember the finished current payment under its key; true when it was approved
+bool PaymentProcessor::settlePayment(string_view key) {
+    if (authorizeOnly && paymentRecord.status == PaymentStatus::Completed) {
+        paymentRecord.status = PaymentStatus::Authorized;
+    }
+    if (!key.empty() && idempotency) {
+        idempotency->complete(key, paymentRecord);
+    }
+    return isApproved(paymentRecord.status);
+}
+
+// Same as settlePayment, once the engine finishes the payment
+AuthorizationEngine::Completion PaymentProcessor::settleLater(string_view key,
+                                                              AuthorizationEngine::Completion onComplete) {
+    bool remember = !key.empty() && idempotency;
+    if (!remember && !authorizeOnly) return onComplete;
+    return [cache = remember ? idempotency : nullptr, key = string(key), hold = authorizeOnly,
+            next = move(onComplete)](PaymentDetails& payment) {
+        if (hold && payment.status == PaymentStatus::Completed) payment.status = PaymentStatus::Authorized;
+        if (cache) cache->complete(key, payment);
+        if (next) next(payment);
+    };
+}
+
+bool PaymentProcessor::processCardPayment(Money amount, string_view cardNumber, string_view expiry, string_view cvv,
+                                          PaymentMethod cardType, string_view idempotencyKey) {
+    duplicate = false;
+    currentPayment = nullptr;   // nothing started yet
+    // Validate amount
+    if (amount.cents <= 0) {
+        return rejectPayment("Amount must be greater than zero", true);
+    }
+
+    // Validate card details
+    CardInfo card;
+    uint64_t started = metricTicks();
+    bool valid = validateCard(cardNumber, expiry, cvv, &card);
+    uint64_t validated = metricTicks();
+    recordStage(MetricStage::Validate, cardType, validated - started);
+    if (!valid) {
+        return rejectPayment("Card validation failed", true);
+    }
+
+    switch (claimKey(idempotencyKey, amount, cardType)) {
+        case IdempotencyCache::Claimed: break;
+        case IdempotencyCache::Replayed: return isApproved(paymentRecord.status);
+        default: return false;
+    }
+    PaymentDetails& payment = startPayment(cardMethod(card, cardType), amount);
+
+    // Ask the gateway, or simulate it (90% success rate)
+    GatewayReply reply;
+    if (gateway) {
+        reply = gateway->authorizeAndWait(payment);
+    } else if (paymentRandom(payment.paymentId).below(100) < 90) {
+        reply.outcome = GatewayOutcome::Approved;
+        reply.code = generateAuthorizationCode(payment.paymentId);
+    } else {
+        reply.outcome = GatewayOutcome::Declined;
+    }
+    recordStage(MetricStage::Authorize, payment.paymentMethod, metricTicks() - validated);
+    applyGatewayReply(payment, reply);
+    if (reply.outcome != GatewayOutcome::Approved) {
+        rejectPayment(gatewayFailure(payment, reply.outcome), true);
+    }
+    return settlePayment(idempotencyKey);
+}
+
+bool PaymentProcessor::processMobilePayment(Money amount, string_view mobileProvider, string_view idempotencyKey) {
+    duplicate = false;
+    currentPayment = nullptr;   // nothing started yet
+    // Validate amount
+    if (amount.cents <= 0) {
+        return rejectPayment("Amount must be greater than zero", true);
+    }
+
+    PaymentMethod method = mobileMethod(mobileProvider);
+    switch (claimKey(idempotencyKey, amount, method)) {
+        case IdempotencyCache::Claimed: break;
+        case IdempotencyCache::Replayed: return isApproved(paymentRecord.status);
+        default: return false;
+    }
+    PaymentDetails& payment = startPayment(method, amount);
+
+    // Ask the gateway, or simulate it (95% success rate)
+    if (verbose) cout << "Processing mobile payment via " << mobileProvider << "..." << endl;
+    uint64_t started = metricTicks();
+    GatewayReply reply;
+    if (gateway) {
+        reply = gateway->authorizeAndWait(payment);
+    } else if (paymentRandom(payment.paymentId).below(100) < 95) {
+        reply.outcome = GatewayOutcome::Approved;
+        reply.code = generateAuthorizationCode(payment.paymentId);
+    } else {
+        reply.outcome = GatewayOutcome::Declined;
+    }
+    recordStage(MetricStage::Authorize, payment.paymentMethod, metricTicks() - started);
+    applyGatewayReply(payment, reply);
+    if (reply.outcome != GatewayOutcome::Approved) {
+        rejectPayment(gatewayFailure(payment, reply.outcome), true);
+    }
+    return settlePayment(idempotencyKey);
+}
+
+// A payment refused before it started (a bad amount or card, or a key in use
+// or conflicting): nothing to record, and onComplete is not run. The record
+// handed back is Failed and carries no payment ID.
+static future<PaymentDetails> refusedPayment(PaymentMethod method, Money amount) {
+    PaymentDetails refused{0, method, GatewayOutcome::Unavailable, amount, currentEpochMicros(), PaymentStatus::Failed,
+                           AuthorizationCode(), Money()};
+    refused.authorizationCode = "REJECTED";
+    promise<PaymentDetails> done;
+    done.set_value(refused);
+    return done.get_future();
+}
+
+// A repeated payment: hand back the earlier record without running onComplete
+static future<PaymentDetails> duplicatePayment(const PaymentDetails& earlier) {
+    promise<PaymentDetails> done;
+    done.set_value(earlier);
+    return done.get_future();
+}
+
+future<PaymentDetails> PaymentProcessor::beginCardPayment(AuthorizationEngine& engine, Money amount,
+                                                          string_view cardNumber, string_view expiry,
+                                                          string_view cvv, PaymentMethod cardType,
+                                                          AuthorizationEngine::Completion onComplete,
+                                                          string_view idempotencyKey) {
+    duplicate = false;
+    currentPayment = nullptr;   // nothing started yet
+    // Checked before a payment ID is issued, as processCardPayment does
+    if (amount.cents <= 0) {
+        rejectPayment("Amount must be greater than zero", false);
+        return refusedPayment(cardType, amount);
+    }
+    CardInfo card;
+    uint64_t started = metricTicks();
+    bool valid = validateCard(cardNumber, expiry, cvv, &card);
+    recordStage(MetricStage::Validate, cardType, metricTicks() - started);
+    if (!valid) {
+        rejectPayment("Card validation failed", false);
+        return refusedPayment(cardType, amount);
+    }
+
+    switch (claimKey(idempotencyKey, amount, cardType)) {
+        case IdempotencyCache::Claimed: break;
+        case IdempotencyCache::Replayed: return duplicatePayment(paymentRecord);
+        default: return refusedPayment(cardType, amount);
+    }
+
+    // The engine keeps its own copy of pending payments
+    PaymentDetails& payment = startPayment(cardMethod(card, cardType), amount);
+    return engine.authorize(payment, settleLater(idempotencyKey, move(onComplete)));
+}
+
+future<PaymentDetails> PaymentProcessor::beginMobilePayment(AuthorizationEngine& engine, Money amount,
+                                                            string_view mobileProvider,
+                                                            AuthorizationEngine::Completion onComplete,
+                                                            string_view idempotencyKey) {
+    duplicate = false;
+    currentPayment = nullptr;   // nothing started yet
+    PaymentMethod method = mobileMethod(mobileProvider);
+    if (amount.cents <= 0) {
+        rejectPayment("Amount must be greater than zero", false);
+        return refusedPayment(method, amount);
+    }
+    switch (claimKey(idempotencyKey, amount, method)) {
+        case IdempotencyCache::Claimed: break;
+        case IdempotencyCache::Replayed: return duplicatePayment(paymentRecord);
+        default: return refusedPayment(method, amount);
+    }
+
+    PaymentDetails& payment = startPayment(method, amount);
+    if (verbose) cout << "Processing mobile payment via " << mobileProvider << "..." << endl;
+    return engine.authorize(payment, settleLater(idempotencyKey, move(onComplete)));
+}
+
+// AuthorizationEngine Implementation
+chrono::microseconds DefaultAuthorizationSimulator::latency(const PaymentDetails&, FastRandom& random) {
+    long span = long(maxLatency.count() - minLatency.count());
+    return minLatency + chrono::microseconds(span > 0 ? long(random() % (span + 1)) : 0);
+}
+
+bool DefaultAuthorizationSimulator::approve(const PaymentDetails& payment, FastRandom& random) {
+    int threshold = isMobile(payment.paymentMethod) ? 95 : 90;
+    return int(random.below(100)) < threshold;
+}
+
+AuthorizationEngine::AuthorizationEngine(const AuthorizationConfig& engineConfig,
+                                         unique_ptr<AuthorizationSimulator> gateway)
+    : config(engineConfig), simulator(move(gateway)), stopping(false), sequence(0), inFlight(0),
+      maxInFlight(0), approvedCount(0), declinedCount(0), timeoutCount(0), unavailableCount(0) {
+    if (!simulator) {
+        simulator.reset(new DefaultAuthorizationSimulator());
+    }
+    timer = thread(&AuthorizationEngine::timerLoop, this);
+    size_t workers = config.completionThreads > 0 ? config.completionThreads : 1;
+    for (size_t i = 0; i < workers; i++) {
+        completers.push_back(thread(&AuthorizationEngine::completionLoop, this));
+    }
+}
+
+AuthorizationEngine::~AuthorizationEngine() {
+    drain();
+    {
+        lock_guard<mutex> lock(engineMutex);
+        stopping = true;
+    }
+    timerSignal.notify_all();
+    readySignal.notify_all();
+    timer.join();
+    for (thread& worker : completers) {
+        worker.join();
+    }
+}
+
+future<PaymentDetails> AuthorizationEngine::authorize(const PaymentDetails& payment, Completion onComplete) {
+    unique_ptr<Pending> pending(new Pending());
+    pending->submittedTicks = metricTicks();
+    pending->payment = payment;
+    pending->payment.status = PaymentStatus::Pending;
+    pending->onComplete = move(onComplete);
+    future<PaymentDetails> result = pending->done.get_future();
+
+    if (config.gateway) {
+        {
+            lock_guard<mutex> lock(engineMutex);
+            pending->sequence = sequence++;
+            inFlight++;
+            if (inFlight > maxInFlight) maxInFlight = inFlight;
+        }
+        // The client copies the request before it can answer, so the payment may go with the reply
+        Pending* sent = pending.release();
+        config.gateway->authorize(sent->payment, [this, sent](const GatewayReply& reply) {
+            sent->reply = reply;
+            answered(unique_ptr<Pending>(sent));
+        });
+        return result;
+    }
+
+    bool earliest;
+    {
+        // Approval is drawn first, as the synchronous path does, so a seeded
+        // workload is approved and declined alike with and without --async
+        FastRandom draws = paymentRandom(pending->payment.paymentId);
+        lock_guard<mutex> lock(engineMutex);
+        bool approved = simulator->approve(pending->payment, draws);
+        chrono::microseconds roundTrip = simulator->latency(pending->payment, draws);
+        bool timedOut = roundTrip > config.timeout;
+        pending->due = chrono::steady_clock::now() + (timedOut ? config.timeout : roundTrip);
+        pending->sequence = sequence++;
+        pending->reply.outcome = timedOut ? GatewayOutcome::TimedOut :
+                                 approved ? GatewayOutcome::Approved : GatewayOutcome::Declined;
+        if (approved && !timedOut) {
+            pending->reply.code = makeAuthorizationCode(pending->payment.paymentId);
+        }
+        earliest = waiting.empty() || pending->due < waiting.top()->due;
+        waiting.push(move(pending));
+        inFlight++;
+        if (inFlight > maxInFlight) maxInFlight = inFlight;
+    }
+    if (earliest) {
+        timerSignal.notify_one();
+    }
+    return result;
+}
+
+void AuthorizationEngine::timerLoop() {
+    unique_lock<mutex> lock(engineMutex);
+    while (!stopping) {
+        if (waiting.empty()) {
+            timerSignal.wait(lock);
+            continue;
+        }
+        auto now = chrono::steady_clock::now();
+        if (waiting.top()->due > now) {
+            timerSignal.wait_until(lock, waiting.top()->due);
+            continue;
+        }
+        // Hand every due request to the completion threads
+        while (!waiting.empty() && waiting.top()->due <= now) {
+            ready.push_back(move(const_cast<unique_ptr<Pending>&>(waiting.top())));
+            waiting.pop();
+        }
+        readySignal.notify_all();
+    }
+}
+
+// A gateway answer: finish it on a completion thread, not the client's.
+// Notified under the lock: once the last answer is in, drain() may return and
+// the engine be destroyed while this client thread is still here.
+void AuthorizationEngine::answered(unique_ptr<Pending> pending) {
+    lock_guard<mutex> lock(engineMutex);
+    ready.push_back(move(pending));
+    readySignal.notify_one();
+}
+
+void AuthorizationEngine::completionLoop() {
+    unique_lock<mutex> lock(engineMutex);
+    while (true) {
+        if (ready.empty()) {
+            if (stopping) return;
+            readySignal.wait(lock);
+            continue;
+        }
+        unique_ptr<Pending> pending = move(ready.front());
+        ready.pop_front();
+        lock.unlock();
+        complete(*pending);
+        lock.lock();
+        inFlight--;
+        if (inFlight == 0) {
+            idleSignal.notify_all();
+        }
+    }
+}
+
+void AuthorizationEngine::complete(Pending& pending) {
+    PaymentDetails& payment = pending.payment;
+    applyGatewayReply(payment, pending.reply);
+    recordStage(MetricStage::Authorize, payment.paymentMethod, metricTicks() - pending.submittedTicks);
+    {
+        lock_guard<mutex> lock(engineMutex);
+        switch (pending.reply.outcome) {
+            case GatewayOutcome::Approved: approvedCount++; break;
+            case GatewayOutcome::Declined: declinedCount++; break;
+            case GatewayOutcome::TimedOut: timeoutCount++; break;
+            default: unavailableCount++; break;
+        }
+    }
+    if (pending.onComplete) {
+        pending.onComplete(payment);
+    }
+    pending.done.set_value(payment);
+}
+
+void AuthorizationEngine::drain() {
+    unique_lock<mutex> lock(engineMutex);
+    idleSignal.wait(lock, [this]() { return inFlight == 0; });
+}
+
+void AuthorizationEngine::printStats() {
+    lock_guard<mutex> lock(engineMutex);
+    cout << "Authorizations: " << (approvedCount + declinedCount + timeoutCount + unavailableCount) << " (" << approvedCount
+         << " approved, " << declinedCount << " declined, " << timeoutCount << " timed out, ";
+    if (unavailableCount > 0) cout << unavailableCount << " gateway unavailable, ";
+    cout << "max " << maxInFlight << " in flight)" << endl;
+}
+
+void PaymentProcessor::displayPaymentReceipt() {
+    if (currentPayment == nullptr) {
+        cout << "No payment to display" << endl;
+        return;
+    }
+    uint64_t started = metricTicks();
+    receipts->print(*currentPayment);
+    recordStage(MetricStage::Receipt, currentPayment->paymentMethod, metricTicks() - started);
+}
+
+// Gateway Implementation
+void applyGatewayReply(PaymentDetails& payment, const GatewayReply& reply) {
+    payment.outcome = reply.outcome;
+    switch (reply.outcome) {
+        case GatewayOutcome::Approved:
+            payment.status = PaymentStatus::Completed;
+            payment.authorizationCode = reply.code;
+            break;
+        case GatewayOutcome::Declined:
+            payment.status = PaymentStatus::Failed;
+            payment.authorizationCode = "DECLINED";
+            break;
+        case GatewayOutcome::TimedOut:
+            payment.status = PaymentStatus::Failed;
+            payment.authorizationCode = "TIMEOUT";
+            break;
+        default:
+            payment.status = PaymentStatus::Failed;
+            payment.authorizationCode = "OFFLINE";
+            break;
+    }
+}
+
+GatewayReply GatewayClient::authorizeAndWait(const PaymentDetails& payment) {
+    promise<GatewayReply> answer;
+    future<GatewayReply> result = answer.get_future();
+    authorize(payment, [&answer](const GatewayReply& reply) { answer.set_value(reply); });
+    return result.get();
+}
+
+static bool gatewaySocketAddress(const string& address, sockaddr_storage& storage, socklen_t& length,
+                                 string& error) {
+    memset(&storage, 0, sizeof(storage));
+    bool local = address.compare(0, 5, "unix:") == 0;
+    if (local || address.find('/') != string::npos) {
+        string path = local ? address.substr(5) : address;
+        sockaddr_un* unixAddress = reinterpret_cast<sockaddr_un*>(&storage);
+        if (path.empty() || path.size() >= sizeof(unixAddress->sun_path)) {
+            error = "bad socket path '" + path + "'";
+            return false;
+        }
+        unixAddress->sun_family = AF_UNIX;
+        memcpy(unixAddress->sun_path, path.data(), path.size());
+        length = socklen_t(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+        return true;
+    }
+
+    string host = "127.0.0.1";
+    string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    sockaddr_in* inetAddress = reinterpret_cast<sockaddr_in*>(&storage);
+    int number = 0;
+    auto parsed = from_chars(port.data(), port.data() + port.size(), number);
+    if (port.empty() || parsed.ptr != port.data() + port.size() || number <= 0 || number > 65535 ||
+        inet_pton(AF_INET, host.c_str(), &inetAddress->sin_addr) != 1) {
+        error = "bad gateway address '" + address + "'";
+        return false;
+    }
+    inetAddress->sin_family = AF_INET;
+    inetAddress->sin_port = htons(uint16_t(number));
+    length = sizeof(sockaddr_in);
+    return true;
+}
+
+// A stream socket connected to address, or listening on it; -1 on failure
+static int openGatewaySocket(const string& address, bool listening, string& error) {
+    sockaddr_storage storage;
+    socklen_t length;
+    if (!gatewaySocketAddress(address, storage, length, error)) return -1;
+    int fd = socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = string("cannot create socket: ") + strerror(errno);
+        return -1;
+    }
+    const sockaddr* target = reinterpret_cast<const sockaddr*>(&storage);
+    int one = 1;
+    bool opened;
+    if (listening) {
+        if (storage.ss_family == AF_UNIX) {
+            unlink(reinterpret_cast<const sockaddr_un*>(&storage)->sun_path);   // left by an earlier run
+        } else {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        opened = bind(fd, target, length) == 0 && listen(fd, SOMAXCONN) == 0;
+    } else {
+        opened = ::connect(fd, target, length) == 0;
+    }
+    if (!opened) {
+        error = string(listening ? "cannot listen on " : "cannot connect to ") + address + ": " + strerror(errno);
+        ::close(fd);
+        return -1;
+    }
+    // Requests are batched here; Nagle would only add delay
+    if (storage.ss_family == AF_INET) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+// Like writeFully, without SIGPIPE when the peer has gone
+static bool sendFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += sent;
+        size -= size_t(sent);
+    }
+    return true;
+}
+
+SocketGatewayClient::SocketGatewayClient(const GatewayClientConfig& clientConfig)
+    : config(clientConfig), nextRequestId(1), nextConnection(0), stopping(false), breaker(BreakerState::Closed),
+      consecutiveFailures(0), inFlight(0) {
+    if (config.connections == 0) config.connections = 1;
+    if (config.maxBatch == 0) config.maxBatch = 1;
+    for (size_t i = 0; i < config.connections; i++) {
+        pool.push_back(unique_ptr<Connection>(new Connection()));
+    }
+}
+
+SocketGatewayClient::~SocketGatewayClient() {
+    stopping = true;
+    {
+        lock_guard<mutex> lock(reaperMutex);
+    }
+    reaperSignal.notify_all();
+    if (reaper.joinable()) reaper.join();
+    for (auto& connection : pool) {
+        disconnect(*connection);
+    }
+}
+
+bool SocketGatewayClient::start(string& error) {
+    size_t connected = 0;
+    for (auto& connection : pool) {
+        if (connect(*connection, error)) connected++;
+    }
+    reaper = thread(&SocketGatewayClient::reaperLoop, this);
+    return connected > 0;
+}
+
+bool SocketGatewayClient::connect(Connection& connection, string& error) {
+    int fd = openGatewaySocket(config.address, false, error);
+    if (fd < 0) return false;
+    connection.fd = fd;
+    {
+        lock_guard<mutex> lock(connection.connectionMutex);
+        connection.broken = false;
+    }
+    connection.sender = thread(&SocketGatewayClient::senderLoop, this, ref(connection));
+    connection.receiver = thread(&SocketGatewayClient::receiverLoop, this, ref(connection));
+    return true;
+}
+
+// Stop a connection's threads and close it; whatever was waiting on it has been failed
+void SocketGatewayClient::disconnect(Connection& connection) {
+    {
+        lock_guard<mutex> lock(connection.connectionMutex);
+        connection.broken = true;
+    }
+    connection.sendSignal.notify_all();
+    if (connection.fd >= 0) shutdown(connection.fd, SHUT_RDWR);   // wakes the receiver
+    if (connection.sender.joinable()) connection.sender.join();
+    if (connection.receiver.joinable()) connection.receiver.join();
+    if (connection.fd >= 0) ::close(connection.fd);
+    connection.fd = -1;
+}
+
+void SocketGatewayClient::authorize(const PaymentDetails& payment, Reply reply) {
+    GatewayReply unavailable;
+    if (!allowRequest()) {
+        {
+            lock_guard<mutex> lock(statsMutex);
+            counters.rejected++;
+        }
+        reply(unavailable);
+        return;
+    }
+
+    GatewayRequestFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.requestId = nextRequestId.fetch_add(1);
+    frame.amountCents = payment.amount.cents;
+    frame.paymentId = payment.paymentId;
+    frame.method = uint8_t(payment.paymentMethod);
+    TimePoint deadline = chrono::steady_clock::now() + config.timeout;
+    {
+        // Counted before it is queued, since the reply may come back at once
+        lock_guard<mutex> lock(statsMutex);
+        counters.requests++;
+        inFlight++;
+        counters.maxInFlight = max(counters.maxInFlight, inFlight);
+    }
+
+    // Round-robin over the connections that are up
+    size_t first = nextConnection.fetch_add(1);
+    for (size_t i = 0; i < pool.size(); i++) {
+        Connection& connection = *pool[(first + i) % pool.size()];
+        {
+            lock_guard<mutex> lock(connection.connectionMutex);
+            if (connection.broken) continue;
+            connection.waiting.emplace(frame.requestId, Waiting{deadline, move(reply)});
+            connection.deadlines.emplace_back(deadline, frame.requestId);
+            connection.outbox.append(reinterpret_cast<const char*>(&frame), sizeof(frame));
+        }
+        connection.sendSignal.notify_one();
+        return;
+    }
+    {
+        lock_guard<mutex> lock(statsMutex);
+        counters.requests--;
+        counters.rejected++;
+        inFlight--;
+    }
+    recordFailures(1);   // a probe with nowhere to go reopens the breaker
+    reply(unavailable);
+}
+
+void SocketGatewayClient::senderLoop(Connection& connection) {
+    const size_t batchBytes = config.maxBatch * sizeof(GatewayRequestFrame);
+    string batch;
+    unique_lock<mutex> lock(connection.connectionMutex);
+    while (true) {
+        connection.sendSignal.wait(lock, [&connection]() { return connection.broken || !connection.outbox.empty(); });
+        if (connection.broken) return;
+        // Everything queued since the last write, up to maxBatch requests
+        size_t n = min(connection.outbox.size(), batchBytes);
+        batch.assign(connection.outbox, 0, n);
+        connection.outbox.erase(0, n);
+        lock.unlock();
+        bool sent = sendFully(connection.fd, batch.data(), batch.size());
+        {
+            lock_guard<mutex> statsLock(statsMutex);
+            counters.writes++;
+        }
+        lock.lock();
+        if (!sent) {
+            // The receiver fails everything waiting on the connection
+            connection.broken = true;
+            shutdown(connection.fd, SHUT_RDWR);
+            return;
+        }
+    }
+}
+
+void SocketGatewayClient::receiverLoop(Connection& connection) {
+    const size_t FrameSize = sizeof(GatewayReplyFrame);
+    vector<char> buffer(256 * FrameSize);
+    size_t have = 0;
+    vector<pair<Reply, GatewayReply>> answered;
+    while (true) {
+        ssize_t n = read(connection.fd, buffer.data() + have, buffer.size() - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += size_t(n);
+        size_t frames = have / FrameSize;
+        {
+            lock_guard<mutex> lock(connection.connectionMutex);
+            for (size_t i = 0; i < frames; i++) {
+                GatewayReplyFrame frame;
+                memcpy(&frame, buffer.data() + i * FrameSize, FrameSize);
+                auto found = connection.waiting.find(frame.requestId);
+                if (found == connection.waiting.end()) continue;   // already timed out
+                GatewayReply reply;
+                reply.outcome = frame.outcome == uint8_t(GatewayOutcome::Approved) ? GatewayOutcome::Approved
+                                                                                    : GatewayOutcome::Declined;
+                reply.code = string_view(frame.code, strnlen(frame.code, sizeof(frame.code)));
+                answered.emplace_back(move(found->second.reply), reply);
+                connection.waiting.erase(found);
+            }
+        }
+        have -= frames * FrameSize;
+        memmove(buffer.data(), buffer.data() + frames * FrameSize, have);
+        if (!answered.empty()) {
+            settled(answered.size(), &counters.replies);
+            recordAnswer();
+            for (auto& entry : answered) {
+                entry.first(entry.second);
+            }
+            answered.clear();
+        }
+    }
+
+    // The connection is gone, and with it every answer still owed on it
+    vector<Reply> lost;
+    {
+        lock_guard<mutex> lock(connection.connectionMutex);
+        connection.broken = true;
+        for (auto& entry : connection.waiting) {
+            lost.push_back(move(entry.second.reply));
+        }
+        connection.waiting.clear();
+        connection.deadlines.clear();
+        connection.outbox.clear();
+    }
+    connection.sendSignal.notify_all();
+    if (!stopping) recordFailures(1);
+    settled(lost.size(), nullptr);
+    GatewayReply unavailable;
+    for (Reply& reply : lost) {
+        reply(unavailable);
+    }
+}
+
+void SocketGatewayClient::reaperLoop() {
+    // Checked eight times per timeout, so a request times out at most 12.5% late
+    const chrono::microseconds period = max(chrono::microseconds(500), config.timeout / 8);
+    TimePoint lastReconnect = chrono::steady_clock::now();
+    vector<Reply> expired;
+    unique_lock<mutex> lock(reaperMutex);
+    while (!stopping) {
+        reaperSignal.wait_for(lock, period);
+        if (stopping) break;
+        lock.unlock();
+
+        TimePoint now = chrono::steady_clock::now();
+        for (auto& entry : pool) {
+            Connection& connection = *entry;
+            lock_guard<mutex> connectionLock(connection.connectionMutex);
+            while (!connection.deadlines.empty() && connection.deadlines.front().first <= now) {
+                auto found = connection.waiting.find(connection.deadlines.front().second);
+                if (found != connection.waiting.end()) {
+                    expired.push_back(move(found->second.reply));
+                    connection.waiting.erase(found);
+                }
+                connection.deadlines.pop_front();
+            }
+        }
+        if (!expired.empty()) {
+            settled(expired.size(), &counters.timeouts);
+            recordFailures(expired.size());
+            GatewayReply timedOut;
+            timedOut.outcome = GatewayOutcome::TimedOut;
+            for (Reply& reply : expired) {
+                reply(timedOut);
+            }
+            expired.clear();
+        }
+
+        // Lost connections are retried once per breaker cooldown
+        if (now - lastReconnect >= config.breakerCooldown) {
+            lastReconnect = now;
+            for (auto& entry : pool) {
+                bool broken;
+                {
+                    lock_guard<mutex> connectionLock(entry->connectionMutex);
+                    broken = entry->broken;
+                }
+                if (!broken) continue;
+                disconnect(*entry);
+                string error;
+                if (connect(*entry, error)) {
+                    lock_guard<mutex> statsLock(statsMutex);
+                    counters.reconnects++;
+                }
+            }
+        }
+        lock.lock();
+    }
+}
+
+bool SocketGatewayClient::allowRequest() {
+    lock_guard<mutex> lock(breakerMutex);
+    switch (breaker) {
+        case BreakerState::Closed:
+            return true;
+        case BreakerState::Open:
+            if (chrono::steady_clock::now() - openedAt < config.breakerCooldown) return false;
+            breaker = BreakerState::HalfOpen;   // this request is the probe
+            return true;
+        default:
+            return false;   // the probe has not come back yet
+    }
+}
+
+void SocketGatewayClient::recordAnswer() {
+    lock_guard<mutex> lock(breakerMutex);
+    consecutiveFailures = 0;
+    breaker = BreakerState::Closed;
+}
+
+void SocketGatewayClient::recordFailures(size_t failures) {
+    lock_guard<mutex> lock(breakerMutex);
+    consecutiveFailures += failures;
+    if (breaker == BreakerState::HalfOpen ||
+        (breaker == BreakerState::Closed && consecutiveFailures >= config.breakerFailures)) {
+        breaker = BreakerState::Open;
+        openedAt = chrono::steady_clock::now();
+        lock_guard<mutex> statsLock(statsMutex);
+        counters.breakerOpens++;
+    }
+}
+
+void SocketGatewayClient::settled(size_t requests, uint64_t* counter) {
+    lock_guard<mutex> lock(statsMutex);
+    inFlight -= requests;
+    if (counter != nullptr) *counter += requests;
+}
+
+SocketGatewayClient::Stats SocketGatewayClient::stats() const {
+    lock_guard<mutex> lock(statsMutex);
+    return counters;
+}
+
+void SocketGatewayClient::printStats() {
+    Stats totals = stats();
+    cout << "Gateway: " << totals.requests << " requests in " << totals.writes << " writes (" << fixed
+         << setprecision(1) << (totals.writes > 0 ? double(totals.requests) / totals.writes : 0.0)
+         << " per write), " << totals.replies << " answered, " << totals.timeouts << " timed out, "
+         << totals.rejected << " failed fast, max " << totals.maxInFlight << " in flight" << endl;
+    if (totals.breakerOpens > 0 || totals.reconnects > 0) {
+        cout << "Circuit breaker opened " << totals.breakerOpens << " time" << (totals.breakerOpens == 1 ? "" : "s")
+             << ", " << totals.reconnects << " reconnect" << (totals.reconnects == 1 ? "" : "s") << endl;
+    }
+}
+
+chrono::microseconds LatencyDistribution::sample(FastRandom& random) const {
+    switch (shape) {
+        case Fixed:
+            return low;
+        case Exponential: {
+            exponential_distribution<double> draw(1.0 / double(max<int64_t>(1, low.count())));
+            return chrono::microseconds(int64_t(draw(random)));
+        }
+        default: {
+            long span = long(high.count() - low.count());
+            return low + chrono::microseconds(span > 0 ? long(random() % (span + 1)) : 0);
+        }
+    }
+}
+
+bool parseLatencyDistribution(string_view text, LatencyDistribution& latency) {
+    string spec(text);
+    long first = 0, second = 0;
+    int consumed = 0;
+    auto whole = [&]() { return size_t(consumed) == spec.size(); };
+    if (sscanf(spec.c_str(), "fixed:%ld%n", &first, &consumed) == 1 && whole() && first >= 0) {
+        latency.shape = LatencyDistribution::Fixed;
+        second = first;
+    } else if (sscanf(spec.c_str(), "uniform:%ld:%ld%n", &first, &second, &consumed) == 2 && whole() &&
+               first >= 0 && first <= second) {
+        latency.shape = LatencyDistribution::Uniform;
+    } else if (sscanf(spec.c_str(), "exp:%ld%n", &first, &consumed) == 1 && whole() && first > 0) {
+        latency.shape = LatencyDistribution::Exponential;
+        second = first;
+    } else {
+        return false;
+    }
+    latency.low = chrono::microseconds(first);
+    latency.high = chrono::microseconds(second);
+    return true;
+}
+
+GatewayServer::GatewayServer(const GatewayServerConfig& serverConfig)
+    : config(serverConfig), listenFd(-1), stopping(false), sequence(0) {}
+
+GatewayServer::~GatewayServer() {
+    stop();
+}
+
+bool GatewayServer::start(string& error) {
+    listenFd = openGatewaySocket(config.address, true, error);
+    if (listenFd < 0) return false;
+    startedAt = chrono::steady_clock::now();
+    timer = thread(&GatewayServer::timerLoop, this);
+    acceptor = thread(&GatewayServer::acceptLoop, this);
+    return true;
+}
+
+void GatewayServer::stop() {
+    if (listenFd < 0 || stopping.exchange(true)) return;
+    shutdown(listenFd, SHUT_RDWR);   // wakes accept
+    acceptor.join();
+    ::close(listenFd);
+    {
+        lock_guard<mutex> lock(serverMutex);
+        for (auto& connection : connections) {
+            lock_guard<mutex> writeLock(connection->writeMutex);
+            if (connection->fd >= 0) shutdown(connection->fd, SHUT_RDWR);
+        }
+    }
+    for (thread& reader : readers) {
+        reader.join();
+    }
+    {
+        lock_guard<mutex> lock(serverMutex);
+    }
+    timerSignal.notify_all();
+    timer.join();
+}
+
+bool GatewayServer::inOutage(chrono::steady_clock::time_point now) const {
+    if (config.outageEvery.count() <= 0 || config.outageFor.count() <= 0) return false;
+    // Up for the first part of every period, down for the last outageFor of it
+    auto phase = (now - startedAt) % config.outageEvery;
+    return phase >= config.outageEvery - config.outageFor;
+}
+
+void GatewayServer::acceptLoop() {
+    while (!stopping) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));   // fails harmlessly on Unix sockets
+        auto connection = make_shared<Connection>();
+        connection->fd = fd;
+        {
+            lock_guard<mutex> lock(serverMutex);
+            connections.push_back(connection);
+            counters.connections++;
+        }
+        readers.push_back(thread(&GatewayServer::readerLoop, this, connection));
+    }
+}
+
+void GatewayServer::readerLoop(shared_ptr<Connection> connection) {
+    const size_t FrameSize = sizeof(GatewayRequestFrame);
+    vector<char> buffer(256 * FrameSize);
+    size_t have = 0;
+    while (true) {
+        ssize_t n = read(connection->fd, buffer.data() + have, buffer.size() - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        have += size_t(n);
+        size_t frames = have / FrameSize;
+        auto now = chrono::steady_clock::now();
+        {
+            lock_guard<mutex> lock(serverMutex);
+            bool outage = inOutage(now);
+            for (size_t i = 0; i < frames; i++) {
+                GatewayRequestFrame request;
+                memcpy(&request, buffer.data() + i * FrameSize, FrameSize);
+                counters.requests++;
+                if (outage) {
+                    counters.dropped++;
+                    continue;
+                }
+                FastRandom draws = paymentRandom(request.paymentId);
+                bool mobile = request.method < MethodCount && isMobile(PaymentMethod(request.method));
+                unsigned declinePercent = mobile ? config.mobileDeclinePercent : config.cardDeclinePercent;
+                bool declined = draws.below(100) < declinePercent;
+                Due reply;
+                reply.due = now + config.latency.sample(draws);
+                reply.sequence = sequence++;
+                reply.connection = connection;
+                memset(&reply.frame, 0, sizeof(reply.frame));
+                reply.frame.requestId = request.requestId;
+                if (declined) {
+                    reply.frame.outcome = uint8_t(GatewayOutcome::Declined);
+                    counters.declined++;
+                } else {
+                    reply.frame.outcome = uint8_t(GatewayOutcome::Approved);
+                    AuthorizationCode code = makeAuthorizationCode(request.paymentId);
+                    memcpy(reply.frame.code, code.data(), min(code.size(), sizeof(reply.frame.code)));
+                    counters.approved++;
+                }
+                due.push(move(reply));
+            }
+        }
+        timerSignal.notify_one();
+        have -= frames * FrameSize;
+        memmove(buffer.data(), buffer.data() + frames * FrameSize, have);
+    }
+
+    // Replies still due for this connection find it closed
+    {
+        lock_guard<mutex> writeLock(connection->writeMutex);
+        ::close(connection->fd);
+        connection->fd = -1;
+    }
+    lock_guard<mutex> lock(serverMutex);
+    connections.erase(remove(connections.begin(), connections.end(), connection), connections.end());
+}
+
+void GatewayServer::timerLoop() {
+    vector<pair<shared_ptr<Connection>, string>> batches;
+    unique_lock<mutex> lock(serverMutex);
+    while (!stopping) {
+        if (due.empty()) {
+            timerSignal.wait(lock);
+            continue;
+        }
+        auto now = chrono::steady_clock::now();
+        if (due.top().due > now) {
+            timerSignal.wait_until(lock, due.top().due);
+            continue;
+        }
+        // Everything due now, one write per connection
+        while (!due.empty() && due.top().due <= now) {
+            const Due& next = due.top();
+            size_t b = 0;
+            while (b < batches.size() && batches[b].first != next.connection) b++;
+            if (b == batches.size()) batches.emplace_back(next.connection, string());
+            batches[b].second.append(reinterpret_cast<const char*>(&next.frame), sizeof(next.frame));
+            due.pop();
+        }
+        lock.unlock();
+        for (auto& batch : batches) {
+            lock_guard<mutex> writeLock(batch.first->writeMutex);
+            if (batch.first->fd >= 0) sendFully(batch.first->fd, batch.second.data(), batch.second.size());
+        }
+        size_t writes = batches.size();
+        batches.clear();
+        lock.lock();
+        counters.writes += writes;
+    }
+}
+
+GatewayServer::Stats GatewayServer::stats() {
+    lock_guard<mutex> lock(serverMutex);
+    return counters;
+}
+
+int runGatewayServer(const GatewayServerConfig& config) {
+    // Blocked before any thread starts, so only sigwait below sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    GatewayServer server(config);
+    string error;
+    if (!server.start(error)) {
+        cout << "ERROR: " << error << endl;
+        return 1;
+    }
+    static const char* const shapes[] = {"fixed", "uniform", "exp"};
+    cout << "Gateway listening on " << config.address << ": " << shapes[config.latency.shape] << " latency "
+         << config.latency.low.count() << ".." << config.latency.high.count() << " us, declines "
+         << config.cardDeclinePercent << "% card / " << config.mobileDeclinePercent << "% mobile";
+    if (config.outageEvery.count() > 0 && config.outageFor.count() > 0) {
+        cout << ", down " << config.outageFor.count() << " ms of every " << config.outageEvery.count() << " ms";
+    }
+    cout << ", seed " << simulationSeed() << endl;
+
+    int received;
+    sigwait(&signals, &received);
+    server.stop();
+    GatewayServer::Stats totals = server.stats();
+    cout << "Gateway stopped: " << totals.connections << " connections, " << totals.requests << " requests ("
+         << totals.approved << " approved, " << totals.declined << " declined, " << totals.dropped
+         << " dropped in outages), " << totals.writes << " reply writes" << endl;
+    return 0;
+}
+
+// Card validation Implementation
+const char* cardNetworkName(CardNetwork network) {
+    static const char* const names[size_t(CardNetwork::Count)] = {
+        "unknown", "visa", "mastercard", "amex", "discover", "jcb", "diners", "unionpay", "maestro"
+    };
+    return size_t(network) < size_t(CardNetwork::Count) ? names[size_t(network)] : "unknown";
+}
+
+// Digit counts low..high, one bit per count
+static constexpr uint32_t cardLengths(unsigned low, unsigned high) {
+    return ((uint32_t(1) << (high + 1)) - 1) & ~((uint32_t(1) << low) - 1);
+}
+
+bool cardLengthValid(CardNetwork network, size_t digits) {
+    // A network the table does not name may be any ISO length
+    static const uint32_t allowed[size_t(CardNetwork::Count)] = {
+        cardLengths(12, 19),            // unknown
+        1u << 13 | 1u << 16 | 1u << 19, // visa
+        1u << 16,                       // mastercard
+        1u << 15,                       // amex
+        cardLengths(16, 19),            // discover
+        cardLengths(16, 19),            // jcb
+        cardLengths(14, 19),            // diners
+        cardLengths(16, 19),            // unionpay
+        cardLengths(12, 19)             // maestro
+    };
+    return size_t(network) < size_t(CardNetwork::Count) && digits < 32 && (allowed[size_t(network)] >> digits & 1);
+}
+
+const char* cardKindName(CardKind kind) {
+    static const char* const names[size_t(CardKind::Count)] = {"unknown", "credit", "debit", "prepaid"};
+    return size_t(kind) < size_t(CardKind::Count) ? names[size_t(kind)] : "unknown";
+}
+
+size_t extractCardDigits(string_view text, char* digits, size_t capacity) {
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Sixteen bytes at a time while the input is nothing but digits (the usual keyed or swiped form)
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    while (i + 16 <= text.size() && count + 16 <= capacity) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+        __m128i offset = _mm_sub_epi8(chunk, zero);
+        __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(offset, nine), offset);
+        if (_mm_movemask_epi8(isDigit) != 0xFFFF) break;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(digits + count), chunk);
+        count += 16;
+        i += 16;
+    }
+#endif
+    // Branch-free tail: store every byte, advance only past digits
+    for (; i < text.size(); i++) {
+        char c = text[i];
+        digits[count < capacity ? count : capacity - 1] = c;
+        count += unsigned(c - '0') < 10u;
+    }
+    return count;
+}
+
+bool luhnValid(const char* digits, size_t n) {
+    // Every second digit from the right is doubled, with the digits of the product summed
+    static const uint8_t weighted[2][10] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9},
+        {0, 2, 4, 6, 8, 1, 3, 5, 7, 9}
+    };
+    if (n == 0) return false;
+    unsigned sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned digit = unsigned(digits[n - 1 - i] - '0');
+        if (digit > 9) return false;
+        sum += weighted[i & 1][digit];
+    }
+    return sum % 10 == 0;
+}
+
+// BinTable Implementation
+BinTable::BinTable(const vector<Range>& ranges) {
+    build(ranges);
+}
+
+void BinTable::build(vector<Range> ranges) {
+    // Split the key space at every range boundary and give each piece to the
+    // narrowest range covering it, then merge neighbours with the same answer
+    struct Boundary {
+        uint64_t at;
+        bool opens;
+        size_t range;
+    };
+    vector<Boundary> boundaries;
+    boundaries.reserve(ranges.size() * 2);
+    for (size_t r = 0; r < ranges.size(); r++) {
+        if (ranges[r].low > ranges[r].high) continue;
+        boundaries.push_back(Boundary{ranges[r].low, true, r});
+        boundaries.push_back(Boundary{uint64_t(ranges[r].high) + 1, false, r});
+    }
+    sort(boundaries.begin(), boundaries.end(), [](const Boundary& a, const Boundary& b) {
+        return a.at < b.at;
+    });
+
+    auto narrower = [&ranges](size_t a, size_t b) {
+        uint32_t widthA = ranges[a].high - ranges[a].low;
+        uint32_t widthB = ranges[b].high - ranges[b].low;
+        return widthA != widthB ? widthA < widthB : a > b;   // later lines win ties
+    };
+    set<size_t, decltype(narrower)> active(narrower);
+
+    lows.clear();
+    highs.clear();
+    infos.clear();
+    for (size_t b = 0; b < boundaries.size();) {
+        uint64_t at = boundaries[b].at;
+        for (; b < boundaries.size() && boundaries[b].at == at; b++) {
+            if (boundaries[b].opens) {
+                active.insert(boundaries[b].range);
+            } else {
+                active.erase(boundaries[b].range);
+            }
+        }
+        if (active.empty() || b == boundaries.size()) continue;
+        uint32_t low = uint32_t(at);
+        uint32_t high = uint32_t(boundaries[b].at - 1);
+        const CardInfo& info = ranges[*active.begin()].info;
+        if (!lows.empty() && highs.back() + 1 == low && infos.back().network == info.network &&
+            infos.back().kind == info.kind) {
+            highs.back() = high;
+        } else {
+            lows.push_back(low);
+            highs.push_back(high);
+            infos.push_back(info);
+        }
+    }
+
+    // Per four-digit prefix, the first range that ends inside or after it
+    buckets.assign(BucketCount + 1, uint32_t(lows.size()));
+    size_t r = 0;
+    for (size_t bucket = 0; bucket < BucketCount; bucket++) {
+        uint32_t bucketStart = uint32_t(bucket) * BucketWidth;
+        while (r < highs.size() && highs[r] < bucketStart) r++;
+        buckets[bucket] = uint32_t(r);
+    }
+}
+
+bool BinTable::lookup(const char* digits, size_t n, CardInfo& info) const {
+    if (n < KeyDigits) return false;
+    uint32_t key = 0;
+    for (size_t i = 0; i < KeyDigits; i++) {
+        key = key * 10 + uint32_t(digits[i] - '0');
+    }
+    // The bucket narrows the search to the ranges that can hold this prefix
+    size_t bucket = key / BucketWidth;
+    auto first = lows.begin() + buckets[bucket];
+    auto last = lows.begin() + min(size_t(buckets[bucket + 1]) + 1, lows.size());
+    auto it = upper_bound(first, last, key);
+    if (it == lows.begin()) return false;
+    size_t r = size_t(it - lows.begin()) - 1;
+    if (key < lows[r] || key > highs[r]) return false;
+    info = infos[r];
+    return true;
+}
+
+// Expand a prefix range such as "51"-"55" to KeyDigits-digit keys
+static bool binRangeFromPrefixes(string_view lowPrefix, string_view highPrefix, BinTable::Range& range) {
+    auto expand = [](string_view prefix, char fill, uint32_t& key) {
+        if (prefix.empty() || prefix.size() > BinTable::KeyDigits) return false;
+        key = 0;
+        for (size_t i = 0; i < BinTable::KeyDigits; i++) {
+            char c = i < prefix.size() ? prefix[i] : fill;
+            if (c < '0' || c > '9') return false;
+            key = key * 10 + uint32_t(c - '0');
+        }
+        return true;
+    };
+    return expand(lowPrefix, '0', range.low) && expand(highPrefix, '9', range.high) && range.low <= range.high;
+}
+
+shared_ptr<const BinTable> BinTable::standard() {
+    static shared_ptr<const BinTable> table = [] {
+        struct Entry {
+            const char* low;
+            const char* high;
+            CardNetwork network;
+        };
+        static const Entry entries[] = {
+            {"4", "4", CardNetwork::Visa},
+            {"51", "55", CardNetwork::Mastercard},
+            {"2221", "2720", CardNetwork::Mastercard},
+            {"34", "34", CardNetwork::Amex},
+            {"37", "37", CardNetwork::Amex},
+            {"6011", "6011", CardNetwork::Discover},
+            {"644", "649", CardNetwork::Discover},
+            {"65", "65", CardNetwork::Discover},
+            {"3528", "3589", CardNetwork::Jcb},
+            {"300", "305", CardNetwork::DinersClub},
+            {"36", "36", CardNetwork::DinersClub},
+            {"38", "39", CardNetwork::DinersClub},
+            {"62", "62", CardNetwork::UnionPay},
+            {"50", "50", CardNetwork::Maestro},
+            {"56", "58", CardNetwork::Maestro},
+            {"6304", "6304", CardNetwork::Maestro},
+            {"67", "67", CardNetwork::Maestro}
+        };
+        vector<Range> ranges;
+        for (const Entry& entry : entries) {
+            Range range;
+            binRangeFromPrefixes(entry.low, entry.high, range);
+            range.info.network = entry.network;
+            ranges.push_back(range);
+        }
+        return make_shared<const BinTable>(ranges);
+    }();
+    return table;
+}
+
+shared_ptr<const BinTable> BinTable::fromFile(const string& path, string& error) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        error = "cannot open " + path;
+        return nullptr;
+    }
+
+    vector<Range> ranges;
+    string line;
+    size_t lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        size_t hash = line.find('#');
+        vector<string_view> words = splitWords(string_view(line).substr(0, hash));
+        if (words.empty()) continue;
+
+        Range range;
+        bool wellFormed = words.size() == 3;
+        if (wellFormed) {
+            size_t dash = words[0].find('-');
+            string_view lowPrefix = words[0].substr(0, dash);
+            string_view highPrefix = dash == string_view::npos ? lowPrefix : words[0].substr(dash + 1);
+            wellFormed = binRangeFromPrefixes(lowPrefix, highPrefix, range);
+        }
+        if (wellFormed) {
+            wellFormed = false;
+            for (size_t n = 0; n < size_t(CardNetwork::Count); n++) {
+                if (words[1] == cardNetworkName(CardNetwork(n))) {
+                    range.info.network = CardNetwork(n);
+                    wellFormed = true;
+                }
+            }
+        }
+        if (wellFormed) {
+            wellFormed = false;
+            for (size_t k = 0; k < size_t(CardKind::Count); k++) {
+                if (words[2] == cardKindName(CardKind(k))) {
+                    range.info.kind = CardKind(k);
+                    wellFormed = true;
+                }
+            }
+        }
+        if (!wellFormed) {
+            error = path + " line " + to_string(lineNumber) + ": expected <prefix>[-<prefix>] <network> <type>";
+            return nullptr;
+        }
+        ranges.push_back(range);
+    }
+    return make_shared<const BinTable>(ranges);
+}
+
+// IdempotencyCache Implementation
+// std::hash may leave the low bits poorly mixed (or be the identity);
+// spread them before taking slot and bloom positions
+static uint64_t idempotencyHash(string_view key) {
+    uint64_t hash = uint64_t(std::hash<string_view>()(key)) * 11400714819323198485ull;
+    return hash ^ (hash >> 29);
+}
+
+IdempotencyCache::IdempotencyCache(size_t capacity, chrono::seconds ttl)
+    : bloomAdds(0), ttlMicros(int64_t(ttl.count()) * MicrosPerSecond) {
+    size_t slots = 64;
+    while (slots < capacity * 2) slots *= 2;   // half full at capacity keeps evictions rare
+    entries.assign(slots, Entry());
+    for (Entry& entry : entries) entry.expires = 0;
+    bloom.assign(slots * BloomBitsPerEntry / 64, 0);
+}
+
+bool IdempotencyCache::bloomMayContain(uint64_t hash) const {
+    size_t mask = bloom.size() * 64 - 1;
+    uint64_t step = (hash >> 32) | 1;
+    for (uint64_t i = 0; i < 3; i++) {
+        size_t bit = size_t(hash + i * step) & mask;
+        if (!(bloom[bit / 64] & (1ull << (bit % 64)))) return false;
+    }
+    return true;
+}
+
+void IdempotencyCache::bloomAdd(uint64_t hash) {
+    size_t mask = bloom.size() * 64 - 1;
+    uint64_t step = (hash >> 32) | 1;
+    for (uint64_t i = 0; i < 3; i++) {
+        size_t bit = size_t(hash + i * step) & mask;
+        bloom[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+// Expired and evicted keys leave their bits behind; start over from the live entries
+void IdempotencyCache::rebuildBloomLocked(EpochMicros now) {
+    fill(bloom.begin(), bloom.end(), 0);
+    bloomAdds = 0;
+    for (const Entry& entry : entries) {
+        if (entry.expires > now) bloomAdd(entry.hash);
+    }
+}
+
+IdempotencyCache::Entry* IdempotencyCache::findLocked(uint64_t hash, string_view key, EpochMicros now) {
+    size_t mask = entries.size() - 1;
+    for (size_t i = 0; i < ProbeWindow; i++) {
+        Entry& entry = entries[(hash + i) & mask];
+        if (entry.expires > now && entry.hash == hash && entry.key == key) return &entry;
+    }
+    return nullptr;
+}
+
+IdempotencyCache::Outcome IdempotencyCache::claim(string_view key, Money amount, PaymentMethod requested,
+                                                  PaymentDetails& result) {
+    uint64_t hash = idempotencyHash(key);
+    EpochMicros now = currentEpochMicros();
+    lock_guard<mutex> lock(cacheMutex);
+
+    if (!bloomMayContain(hash)) {
+        counters.bloomMisses++;
+    } else if (Entry* entry = findLocked(hash, key, now)) {
+        result = entry->result;
+        if (entry->amount != amount || entry->requested != requested) {
+            counters.conflicts++;
+            return Conflict;
+        }
+        counters.hits++;
+        return entry->result.status == PaymentStatus::Pending ? InProgress : Replayed;
+    }
+    counters.misses++;
+
+    // Take the first free slot in the window, else the one closest to expiry
+    size_t mask = entries.size() - 1;
+    Entry* slot = nullptr;
+    for (size_t i = 0; i < ProbeWindow; i++) {
+        Entry& entry = entries[(hash + i) & mask];
+        if (entry.expires <= now) {
+            slot = &entry;
+            break;
+        }
+        if (!slot || entry.expires < slot->expires) slot = &entry;
+    }
+    if (slot->expires > now) counters.evictions++;
+
+    slot->hash = hash;
+    slot->expires = now + ttlMicros;
+    slot->key = key;
+    slot->requested = requested;
+    slot->amount = amount;
+    slot->result = PaymentDetails{0, requested, GatewayOutcome::Unavailable, amount, now, PaymentStatus::Pending,
+                                  AuthorizationCode(), Money()};
+    bloomAdd(hash);
+    if (++bloomAdds > entries.size()) rebuildBloomLocked(now);
+    result = slot->result;
+    return Claimed;
+}
+
+void IdempotencyCache::complete(string_view key, const PaymentDetails& result) {
+    uint64_t hash = idempotencyHash(key);
+    EpochMicros now = currentEpochMicros();
+    lock_guard<mutex> lock(cacheMutex);
+    // Gone if it was evicted while the payment ran; the next repeat pays again
+    if (Entry* entry = findLocked(hash, key, now)) {
+        entry->result = result;
+        entry->expires = now + ttlMicros;
+    }
+}
+
+void IdempotencyCache::release(string_view key) {
+    uint64_t hash = idempotencyHash(key);
+    EpochMicros now = currentEpochMicros();
+    lock_guard<mutex> lock(cacheMutex);
+    if (Entry* entry = findLocked(hash, key, now)) entry->expires = 0;
+}
+
+IdempotencyCache::Stats IdempotencyCache::stats() const {
+    lock_guard<mutex> lock(cacheMutex);
+    return counters;
+}
+
+// ReceiptPrinter Implementation
+ReceiptPrinter::ReceiptPrinter(ReceiptOutput mode, const string& spoolPath, size_t receiptsPerWrite)
+    : output(mode), fd(-1), spoolReceipts(receiptsPerWrite > 0 ? receiptsPerWrite : 1), pendingReceipts(0) {
+    if (output == ReceiptOutput::Spool) {
+        fd = open(spoolPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            cout << "Error opening receipt spool " << spoolPath << endl;
+            return;
+        }
+        spool.reserve(spoolReceipts * 512);
+    }
+}
+
+ReceiptPrinter::~ReceiptPrinter() {
+    flush();
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+shared_ptr<ReceiptPrinter> ReceiptPrinter::console() {
+    static shared_ptr<ReceiptPrinter> printer = make_shared<ReceiptPrinter>();
+    return printer;
+}
+
+size_t ReceiptPrinter::render(const PaymentDetails& payment, char* text) {
+    const ReceiptSegment* layout = cardReceiptLayout;
+    size_t segments = sizeof(cardReceiptLayout) / sizeof(cardReceiptLayout[0]);
+    if (payment.paymentMethod == PaymentMethod::Cash) {
+        layout = cashReceiptLayout;
+        segments = sizeof(cashReceiptLayout) / sizeof(cashReceiptLayout[0]);
+    } else if (isMobile(payment.paymentMethod)) {
+        layout = mobileReceiptLayout;
+        segments = sizeof(mobileReceiptLayout) / sizeof(mobileReceiptLayout[0]);
+    }
+
+    char* out = text;
+    char* const end = text + ReceiptCapacity;
+    // Free-form fields are cut short rather than overrun the buffer
+    auto put = [&](string_view piece) {
+        size_t n = min(piece.size(), size_t(end - out));
+        memcpy(out, piece.data(), n);
+        out += n;
+    };
+    for (size_t i = 0; i < segments; i++) {
+        put(layout[i].text);
+        switch (layout[i].field) {
+            case ReceiptPaymentId: {
+                char digits[16];
+                auto result = to_chars(digits, digits + sizeof(digits), payment.paymentId);
+                put(string_view(digits, size_t(result.ptr - digits)));
+                break;
+            }
+            case ReceiptMethod:
+                put(methodName(payment.paymentMethod));
+                break;
+            case ReceiptAmount: {
+                char amount[32];
+                put(string_view(amount, formatMoney(payment.amount, amount, sizeof(amount))));
+                break;
+            }
+            case ReceiptTime:
+                put(transactionTimeText(payment.timestamp));
+                break;
+            case ReceiptStatus:
+                put(statusName(payment.status));
+                break;
+            case ReceiptAuthorization:
+                put(payment.authorizationCode);
+                break;
+            case ReceiptClosing:
+                put(isApproved(payment.status) ? "     Thank you for your purchase!      "
+                                                               : "   Please use alternative payment      ");
+                break;
+            default:
+                break;
+        }
+    }
+    return size_t(out - text);
+}
+
+void ReceiptPrinter::print(const PaymentDetails& payment) {
+    if (output == ReceiptOutput::Discard) return;
+
+    char text[ReceiptCapacity];
+    size_t length = render(payment, text);
+    if (output == ReceiptOutput::Console) {
+        // Through cout so the receipt stays in order with the rest of the output
+        cout.write(text, streamsize(length));
+        cout.flush();
+        return;
+    }
+
+    lock_guard<mutex> lock(spoolMutex);
+    spool.append(text, length);
+    if (++pendingReceipts >= spoolReceipts) {
+        writeSpoolLocked();
+    }
+}
+
+void ReceiptPrinter::flush() {
+    if (output != ReceiptOutput::Spool) return;
+    lock_guard<mutex> lock(spoolMutex);
+    writeSpoolLocked();
+}
+
+void ReceiptPrinter::writeSpoolLocked() {
+    const char* data = spool.data();
+    size_t remaining = spool.size();
+    while (remaining > 0 && fd >= 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            cout << "Error writing receipt spool" << endl;
+            break;
+        }
+        data += written;
+        remaining -= size_t(written);
+    }
+    spool.clear();
+    pendingReceipts = 0;
+}
+
+// TransactionJournal Implementation
+TransactionJournal::TransactionJournal(const JournalConfig& journalConfig)
+    : config(journalConfig), fd(-1), regularFile(false), pendingRecords(0), stopping(false),
+      appendedRecords(0), writtenRecords(0), syncedRecords(0), failedSyncs(0), syncing(false), sequence(0), openBytes(0), dayEnd(0), compactPending(false), compactStopping(false) {
+    // Resolve the by-name settings once so append() does not search the map.
+    // Mobile methods are named "Mobile (<provider>)" and fall back to "Mobile".
+    for (size_t i = 0; i < MethodCount; i++) {
+        PaymentMethod method = PaymentMethod(i);
+        auto it = config.methodDurability.find(methodName(method));
+        if (it == config.methodDurability.end() && isMobile(method)) {
+            it = config.methodDurability.find("Mobile");
+        }
+        methodModes[i] = it != config.methodDurability.end() ? it->second : DurabilityMode::Lazy;
+    }
+    fd = open(config.path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        cout << "Error opening transactions file" << endl;
+        return;
+    }
+    // The open segment follows the last sealed one
+    vector<JournalSegment> sealed = listJournalSegments(config.path);
+    if (!sealed.empty()) {
+        sequence = sealed.back().sequence + 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        regularFile = true;
+        openBytes = uint64_t(st.st_size);
+        if (openBytes > 0) {
+            dayEnd = nextLocalMidnight(epochMicros(st.st_mtime));
+        }
+    }
+    buffer.reserve(64 * 1024);
+    committer = thread(&TransactionJournal::committerLoop, this);
+}
+
+TransactionJournal::~TransactionJournal() {
+    {
+        lock_guard<mutex> lock(compactMutex);
+        compactStopping = true;
+    }
+    compactSignal.notify_all();
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+    {
+        lock_guard<mutex> lock(journalMutex);
+        stopping = true;
+    }
+    commitSignal.notify_all();
+    if (committer.joinable()) {
+        committer.join();
+    }
+    if (fd >= 0) {
+        lock_guard<mutex> lock(journalMutex);
+        commitLocked(true);
+        close(fd);
+        fd = -1;
+    }
+}
+
+DurabilityMode TransactionJournal::durabilityFor(PaymentMethod method) const {
+    return size_t(method) < MethodCount ? methodModes[size_t(method)] : DurabilityMode::Lazy;
+}
+
+bool TransactionJournal::append(const PaymentDetails& payment) {
+    if (fd < 0) return false;
+
+    // Same line layout as the original per-call ofstream writer
+    char amountText[32];
+    size_t amountLength = formatMoney(payment.amount, amountText, sizeof(amountText));
+
+    DurabilityMode mode = durabilityFor(payment.paymentMethod);
+
+    unique_lock<mutex> lock(journalMutex);
+    startRecordLocked(payment.timestamp);
+    buffer += "PAY-";
+    buffer += to_string(payment.paymentId);
+    buffer += " | ";
+    buffer += methodName(payment.paymentMethod);
+    buffer += " | $";
+    buffer.append(amountText, amountLength);
+    buffer += " | ";
+    buffer += statusName(payment.status);
+    buffer += " | ";
+    buffer += transactionTimeText(payment.timestamp);
+    buffer += " | ";
+    buffer += payment.authorizationCode;
+    buffer += '\n';
+    return finishRecordLocked(lock, mode);
+}
+
+bool TransactionJournal::append(const PaymentAdjustment& adjustment) {
+    if (fd < 0) return false;
+
+    char amountText[32];
+    size_t amountLength = formatMoney(adjustment.amount, amountText, sizeof(amountText));
+    char balanceText[32];
+    size_t balanceLength = formatMoney(adjustment.balance, balanceText, sizeof(balanceText));
+
+    unique_lock<mutex> lock(journalMutex);
+    startRecordLocked(adjustment.timestamp);
+    buffer += "ADJ-";
+    buffer += to_string(adjustment.paymentId);
+    buffer += " | ";
+    buffer += adjustmentName(adjustment.kind);
+    buffer += " | $";
+    buffer.append(amountText, amountLength);
+    buffer += " | ";
+    buffer += transactionTimeText(adjustment.timestamp);
+    buffer += " | ";
+    buffer += statusName(adjustment.status);
+    buffer += " | $";
+    buffer.append(balanceText, balanceLength);
+    buffer += '\n';
+    // Money going back is rare enough to sync every time
+    return finishRecordLocked(lock, DurabilityMode::Fsync);
+}
+
+void TransactionJournal::startRecordLocked(EpochMicros timestamp) {
+    // A new local day starts a new segment
+    if (config.sealDaily) {
+        if (dayEnd != 0 && timestamp >= dayEnd) {
+            sealLocked();
+        }
+        if (dayEnd == 0) {
+            dayEnd = nextLocalMidnight(timestamp);
+        }
+    }
+    if (pendingRecords == 0) {
+        oldestPending = chrono::steady_clock::now();
+    }
+}
+
+// The record is in the buffer: commit it as its durability mode asks
+bool TransactionJournal::finishRecordLocked(unique_lock<mutex>& lock, DurabilityMode mode) {
+    pendingRecords++;
+    uint64_t record = ++appendedRecords;
+    if (mode == DurabilityMode::Fsync) {
+        return commitLocked(false) && syncThroughLocked(lock, record);
+    } else if (mode == DurabilityMode::Flush) {
+        return commitLocked(false);
+    } else if (pendingRecords >= config.groupCommitRecords) {
+        return commitLocked(false) && (!config.syncOnGroupCommit || syncThroughLocked(lock, record));
+    } else if (pendingRecords == 1) {
+        lock.unlock();
+        commitSignal.notify_one();
+    }
+    return true;
+}
+
+bool TransactionJournal::flush() {
+    lock_guard<mutex> lock(journalMutex);
+    return commitLocked(false);
+}
+
+bool TransactionJournal::sync() {
+    unique_lock<mutex> lock(journalMutex);
+    return commitLocked(false) && syncThroughLocked(lock, appendedRecords);
+}
+
+uint64_t TransactionJournal::checkpoint() {
+    // Everything appended so far is on disk and below the returned offset
+    lock_guard<mutex> lock(journalMutex);
+    if (fd < 0 || !commitLocked(true)) return NoJournalCheckpoint;
+    struct stat st;
+    if (fstat(fd, &st) != 0) return NoJournalCheckpoint;
+    return journalPosition(sequence, uint64_t(st.st_size));
+}
+
+bool TransactionJournal::seal() {
+    lock_guard<mutex> lock(journalMutex);
+    return sealLocked();
+}
+
+uint64_t TransactionJournal::openSequence() {
+    lock_guard<mutex> lock(journalMutex);
+    return sequence;
+}
+
+// On failure the bytes already written leave the buffer, so a retry does not
+// write them a second time
+bool TransactionJournal::writeBufferLocked() {
+    size_t done = 0;
+    while (done < buffer.size()) {
+        ssize_t written = write(fd, buffer.data() + done, buffer.size() - done);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            cout << "Error writing transactions file" << endl;
+            buffer.erase(0, done);
+            openBytes += done;
+            return false;
+        }
+        done += size_t(written);
+    }
+    openBytes += done;
+    buffer.clear();
+    return true;
+}
+
+// False when the buffered records could not be written or, with sync, were
+// not made durable
+bool TransactionJournal::commitLocked(bool sync) {
+    if (fd < 0) return false;
+    if (pendingRecords > 0) {
+        if (!writeBufferLocked()) return false;
+        pendingRecords = 0;
+        writtenRecords = appendedRecords;
+        countJournalWrite();
+    }
+    if (sync) {
+        countJournalSync();
+        if (fdatasync(fd) != 0) {
+            cout << "Error syncing transactions file" << endl;
+            return false;
+        }
+        syncedRecords = writtenRecords;
+    }
+    if (config.segmentBytes > 0 && openBytes >= config.segmentBytes) {
+        sealLocked();
+    }
+    return true;
+}
+
+// Wait until the given record, already written, is durable. The fdatasync
+// runs on a duplicate descriptor with journalMutex released, so other lanes
+// keep appending; a caller whose record was written after a sync started
+// waits for it and then syncs everything written meanwhile in one go.
+bool TransactionJournal::syncThroughLocked(unique_lock<mutex>& lock, uint64_t record) {
+    while (syncedRecords < record) {
+        if (failedSyncs >= record) return false;
+        if (syncing) {
+            syncSignal.wait(lock);
+            continue;
+        }
+        int syncFd = fd >= 0 ? dup(fd) : -1;
+        if (syncFd < 0) return false;
+        uint64_t target = writtenRecords;
+        syncing = true;
+        lock.unlock();
+        bool synced = fdatasync(syncFd) == 0;
+        ::close(syncFd);
+        countJournalSync();
+        lock.lock();
+        syncing = false;
+        if (synced) {
+            syncedRecords = max(syncedRecords, target);
+        } else {
+            failedSyncs = max(failedSyncs, target);
+            cout << "Error syncing transactions file" << endl;
+        }
+        syncSignal.notify_all();
+    }
+    return true;
+}
+
+bool TransactionJournal::sealLocked() {
+    if (fd < 0 || !regularFile) return false;
+    if (pendingRecords > 0) {
+        if (!writeBufferLocked()) return false;
+        pendingRecords = 0;
+        writtenRecords = appendedRecords;
+        countJournalWrite();
+    }
+    if (openBytes == 0) return false;
+
+    // The records are durable under the sealed name before the next segment opens
+    countJournalSync();
+    if (fdatasync(fd) != 0) {
+        cout << "Error syncing transactions file" << endl;
+        return false;
+    }
+    syncedRecords = writtenRecords;
+    string sealedPath = journalSegmentPath(config.path, sequence, ".log");
+    if (rename(config.path.c_str(), sealedPath.c_str()) != 0) {
+        cout << "Error sealing journal segment " << sealedPath << endl;
+        return false;
+    }
+    close(fd);
+    fd = open(config.path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        cout << "Error opening transactions file" << endl;
+    }
+    sequence++;
+    openBytes = 0;
+    dayEnd = 0;
+
+    {
+        lock_guard<mutex> lock(compactMutex);
+        compactPending = true;
+        if (!compactor.joinable() && !compactStopping) {
+            compactor = thread(&TransactionJournal::compactorLoop, this);
+        }
+    }
+    compactSignal.notify_one();
+    return true;
+}
+
+void TransactionJournal::compactorLoop() {
+    unique_lock<mutex> lock(compactMutex);
+    while (!compactStopping) {
+        if (!compactPending) {
+            compactSignal.wait(lock);
+            continue;
+        }
+        compactPending = false;
+        lock.unlock();
+        compactJournalSegments(config.path, config.archiveSealed, compactStopping);
+        lock.lock();
+    }
+}
+
+void TransactionJournal::committerLoop() {
+    unique_lock<mutex> lock(journalMutex);
+    while (!stopping) {
+        if (pendingRecords == 0) {
+            commitSignal.wait(lock);
+            continue;
+        }
+        auto deadline = oldestPending + chrono::microseconds(config.groupCommitMicros);
+        if (chrono::steady_clock::now() >= deadline) {
+            if (commitLocked(false) && config.syncOnGroupCommit) syncThroughLocked(lock, writtenRecords);
+        } else {
+            commitSignal.wait_until(lock, deadline);
+        }
+    }
+}
+
+// EventLogger Implementation
+EventLogger::EventLogger(const string& filePath, size_t capacity)
+    : path(filePath), fd(-1), mask(0), head(0), tail(0), written(0), dropped(0), droppedReported(0),
+      stopping(false) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    slots.reset(new Slot[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        slots[i].sequence.store(i, memory_order_relaxed);
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        cout << "Error opening log file" << endl;
+    }
+    writer = thread(&EventLogger::writerLoop, this);
+}
+
+EventLogger::~EventLogger() {
+    {
+        lock_guard<mutex> lock(wakeMutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+EventLogger& EventLogger::shared() {
+    static EventLogger logger;
+    return logger;
+}
+
+bool EventLogger::push(const LogRecord& record) {
+    // Bounded multi-producer queue: a slot is free when its sequence equals the claim position
+    size_t pos = head.load(memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &slots[pos & mask];
+        size_t sequence = slot->sequence.load(memory_order_acquire);
+        intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false;   // full: the writer has not drained this slot yet
+        } else {
+            pos = head.load(memory_order_relaxed);
+        }
+    }
+    slot->record = record;
+    slot->sequence.store(pos + 1, memory_order_release);
+    return true;
+}
+
+bool EventLogger::pop(LogRecord& record) {
+    Slot& slot = slots[tail & mask];
+    if (slot.sequence.load(memory_order_acquire) != tail + 1) {
+        return false;
+    }
+    record = slot.record;
+    slot.sequence.store(tail + mask + 1, memory_order_release);
+    tail++;
+    return true;
+}
+
+void EventLogger::paymentFailed(const PaymentDetails& payment) {
+    LogRecord record;
+    record.timestamp = currentEpochMicros();
+    record.amountCents = payment.amount.cents;
+    record.paymentId = payment.paymentId;
+    record.kind = LogRecord::PaymentFailure;
+    record.method = payment.paymentMethod;
+    size_t length = min(payment.authorizationCode.size(), sizeof(record.reason) - 1);
+    memcpy(record.reason, payment.authorizationCode.data(), length);
+    record.reason[length] = '\0';
+    record.text[0] = '\0';
+    if (!push(record)) {
+        dropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void EventLogger::message(string_view text) {
+    LogRecord record;
+    record.timestamp = currentEpochMicros();
+    record.amountCents = 0;
+    record.paymentId = 0;
+    record.kind = LogRecord::Message;
+    record.method = PaymentMethod::Cash;
+    record.reason[0] = '\0';
+    size_t length = min(text.size(), sizeof(record.text) - 1);
+    memcpy(record.text, text.data(), length);
+    record.text[length] = '\0';
+    if (!push(record)) {
+        dropped.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+size_t EventLogger::drainInto(string& batch) {
+    // Same line layout the per-call ofstream writer produced
+    auto stamp = [&](EpochMicros when) {
+        batch += '[';
+        batch += transactionTimeText(when);
+        batch += "] ";
+    };
+
+    size_t count = 0;
+    LogRecord record;
+    while (pop(record)) {
+        stamp(record.timestamp);
+        if (record.kind == LogRecord::PaymentFailure) {
+            batch += "Payment ID: PAY-";
+            batch += to_string(record.paymentId);
+            batch += " | Method: ";
+            batch += methodName(record.method);
+            batch += " | Amount: $";
+            batch += formatMoney(Money::fromCents(record.amountCents));
+            batch += " | Reason: ";
+            batch += record.reason;
+        } else {
+            batch += record.text;
+        }
+        batch += '\n';
+        count++;
+    }
+
+    uint64_t lost = dropped.load(memory_order_relaxed);
+    if (lost != droppedReported) {
+        stamp(currentEpochMicros());
+        batch += "Log buffer full: dropped " + to_string(lost - droppedReported) + " events (" +
+                 to_string(lost) + " total)\n";
+        droppedReported = lost;
+    }
+    return count;
+}
+
+void EventLogger::writerLoop() {
+    string batch;
+    batch.reserve(64 * 1024);
+    for (;;) {
+        bool finishing;
+        {
+            // Producers never signal; the writer polls so logging stays wait-free for them
+            unique_lock<mutex> lock(wakeMutex);
+            wake.wait_for(lock, chrono::milliseconds(5), [this] { return stopping; });
+            finishing = stopping;
+        }
+
+        size_t count = drainInto(batch);
+        if (!batch.empty() && fd >= 0) {
+            const char* data = batch.data();
+            size_t remaining = batch.size();
+            while (remaining > 0) {
+                ssize_t n = ::write(fd, data, remaining);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                data += n;
+                remaining -= size_t(n);
+            }
+        }
+        batch.clear();
+        written.fetch_add(count, memory_order_relaxed);
+        if (finishing) break;
+    }
+}
+
+// Metrics Implementation
+#ifdef POS_METRICS
+LatencyHistogram::LatencyHistogram() : sum(0) {
+    for (auto& count : counts) count.store(0, memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::bucketLow(size_t bucket) {
+    if (bucket < SubBuckets) return bucket;
+    unsigned top = unsigned(bucket / SubBuckets) + SubBucketBits - 1;
+    return (SubBuckets + bucket % SubBuckets) << (top - SubBucketBits);
+}
+
+uint64_t LatencyHistogram::bucketHigh(size_t bucket) {
+    if (bucket < SubBuckets) return bucket;
+    unsigned top = unsigned(bucket / SubBuckets) + SubBucketBits - 1;
+    return bucketLow(bucket) + (uint64_t(1) << (top - SubBucketBits)) - 1;
+}
+
+MetricsShard::MetricsShard() : journalWrites(0), journalSyncs(0) {
+    for (auto& method : outcomes) {
+        for (auto& count : method) count.store(0, memory_order_relaxed);
+    }
+}
+
+MetricsRegistry::MetricsRegistry() : startTicks(metricTicks()), startTime(chrono::steady_clock::now()) {
+}
+
+MetricsShard* MetricsRegistry::acquire() {
+    lock_guard<mutex> lock(shardsMutex);
+    if (!idle.empty()) {
+        MetricsShard* shard = idle.back();
+        idle.pop_back();
+        return shard;
+    }
+    shards.emplace_back(new MetricsShard());
+    return shards.back().get();
+}
+
+void MetricsRegistry::release(MetricsShard* shard) {
+    lock_guard<mutex> lock(shardsMutex);
+    idle.push_back(shard);
+}
+
+MetricsShard& MetricsRegistry::local() {
+    struct Lease {
+        MetricsShard* shard = nullptr;
+        ~Lease() {
+            if (shard != nullptr) MetricsRegistry::shared().release(shard);
+        }
+    };
+    thread_local Lease lease;
+    if (lease.shard == nullptr) {
+        lease.shard = acquire();
+    }
+    return *lease.shard;
+}
+#else
+MetricsRegistry::MetricsRegistry() {
+}
+#endif
+
+MetricsRegistry& MetricsRegistry::shared() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+uint64_t StageTotals::percentileTicks(double p) const {
+#ifdef POS_METRICS
+    if (count == 0) return 0;
+    uint64_t rank = max<uint64_t>(1, uint64_t(ceil(p * double(count))));
+    uint64_t seen = 0;
+    for (size_t b = 0; b < counts.size(); b++) {
+        seen += counts[b];
+        if (seen >= rank) {
+            return (LatencyHistogram::bucketLow(b) + LatencyHistogram::bucketHigh(b)) / 2;
+        }
+    }
+#else
+    (void)p;
+#endif
+    return 0;
+}
+
+uint64_t StageTotals::countUpTo(double ticks) const {
+    uint64_t seen = 0;
+#ifdef POS_METRICS
+    for (size_t b = 0; b < counts.size(); b++) {
+        if ((LatencyHistogram::bucketLow(b) + LatencyHistogram::bucketHigh(b)) / 2.0 > ticks) break;
+        seen += counts[b];
+    }
+#else
+    (void)ticks;
+#endif
+    return seen;
+}
+
+MetricsSnapshot MetricsRegistry::snapshot() const {
+    MetricsSnapshot merged;
+#ifdef POS_METRICS
+    for (auto& method : merged.stages) {
+        for (StageTotals& totals : method) totals.counts.assign(LatencyHistogram::BucketCount, 0);
+    }
+    {
+        lock_guard<mutex> lock(shardsMutex);
+        for (const auto& shard : shards) {
+            for (size_t s = 0; s < StageCount; s++) {
+                for (size_t m = 0; m < MethodCount; m++) {
+                    const LatencyHistogram& histogram = shard->stages[s][m];
+                    StageTotals& totals = merged.stages[s][m];
+                    for (size_t b = 0; b < LatencyHistogram::BucketCount; b++) {
+                        uint64_t n = histogram.counts[b].load(memory_order_relaxed);
+                        totals.counts[b] += n;
+                        totals.count += n;
+                    }
+                    totals.sumTicks += histogram.sum.load(memory_order_relaxed);
+                }
+            }
+            for (size_t m = 0; m < MethodCount; m++) {
+                for (size_t o = 0; o < OutcomeCount; o++) {
+                    merged.outcomes[m][o] += shard->outcomes[m][o].load(memory_order_relaxed);
+                }
+            }
+            merged.journalWrites += shard->journalWrites.load(memory_order_relaxed);
+            merged.journalSyncs += shard->journalSyncs.load(memory_order_relaxed);
+        }
+    }
+
+    // Calibrate ticks against the steady clock over the registry's lifetime
+    auto elapsed = chrono::steady_clock::now() - startTime;
+    if (elapsed < chrono::milliseconds(10)) {
+        this_thread::sleep_for(chrono::milliseconds(10) - elapsed);
+    }
+    double nanos = double(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - startTime).count());
+    uint64_t ticks = metricTicks() - startTicks;
+    merged.nanosPerTick = ticks > 0 ? nanos / double(ticks) : 1.0;
+#endif
+    return merged;
+}
+
+void MetricsRegistry::printSummary() const {
+    cout << "\n========================================" << endl;
+    cout << "===      METRICS                    ===" << endl;
+    cout << "========================================" << endl;
+    if (!MetricsEnabled) {
+        cout << "Metrics are not compiled in (build with -DPOS_METRICS)" << endl;
+        cout << "========================================\n" << endl;
+        return;
+    }
+    MetricsSnapshot merged = snapshot();
+    double toMicros = merged.nanosPerTick / 1000.0;
+    cout << left << setw(10) << "Stage" << setw(20) << "Method" << right << setw(9) << "Count" << setw(11) << "Mean(us)"
+         << setw(10) << "p50(us)" << setw(10) << "p99(us)" << setw(11) << "p999(us)" << setw(10) << "Max(us)" << endl;
+    for (size_t s = 0; s < StageCount; s++) {
+        for (size_t m = 0; m < MethodCount; m++) {
+            const StageTotals& totals = merged.stages[s][m];
+            if (totals.count == 0) continue;
+            cout << left << setw(10) << stageNames[s] << setw(20) << methodName(PaymentMethod(m)) << right
+                 << setw(9) << totals.count << fixed << setprecision(2)
+                 << setw(11) << totals.sumTicks * toMicros / totals.count
+                 << setw(10) << totals.percentileTicks(0.50) * toMicros
+                 << setw(10) << totals.percentileTicks(0.99) * toMicros
+                 << setw(11) << totals.percentileTicks(0.999) * toMicros
+                 << setw(10) << totals.percentileTicks(1.0) * toMicros << endl;
+        }
+    }
+    cout << "----------------------------------------" << endl;
+    for (size_t m = 0; m < MethodCount; m++) {
+        const uint64_t* outcomes = merged.outcomes[m];
+        if (outcomes[0] + outcomes[1] + outcomes[2] == 0) continue;
+        cout << methodName(PaymentMethod(m)) << ": " << outcomes[0] << " approved, " << outcomes[1] << " declined, "
+             << outcomes[2] << " timed out" << endl;
+    }
+    cout << "Journal: " << merged.journalWrites << " writes, " << merged.journalSyncs << " syncs" << endl;
+    cout << "========================================\n" << endl;
+}
+
+string MetricsRegistry::prometheusText() const {
+    MetricsSnapshot merged = snapshot();
+    ostringstream out;
+    out << setprecision(9);
+
+    // Standard second-based boundaries; each fine bucket is counted at its midpoint
+    static const double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3,
+                                    2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    out << "# HELP pos_stage_duration_seconds Time spent in each payment stage.\n";
+    out << "# TYPE pos_stage_duration_seconds histogram\n";
+    for (size_t s = 0; s < StageCount; s++) {
+        for (size_t m = 0; m < MethodCount; m++) {
+            const StageTotals& totals = merged.stages[s][m];
+            if (totals.count == 0) continue;
+            string labels = string("stage=\"") + stageNames[s] + "\",method=\"" + methodName(PaymentMethod(m)) + "\"";
+            for (double bound : bounds) {
+                out << "pos_stage_duration_seconds_bucket{" << labels << ",le=\"" << bound << "\"} "
+                    << totals.countUpTo(bound * 1e9 / merged.nanosPerTick) << "\n";
+            }
+            out << "pos_stage_duration_seconds_bucket{" << labels << ",le=\"+Inf\"} " << totals.count << "\n";
+            out << "pos_stage_duration_seconds_sum{" << labels << "} "
+                << totals.sumTicks * merged.nanosPerTick / 1e9 << "\n";
+            out << "pos_stage_duration_seconds_count{" << labels << "} " << totals.count << "\n";
+        }
+    }
+
+    out << "# HELP pos_payments_total Recorded payments by outcome.\n";
+    out << "# TYPE pos_payments_total counter\n";
+    for (size_t m = 0; m < MethodCount; m++) {
+        for (size_t o = 0; o < OutcomeCount; o++) {
+            out << "pos_payments_total{method=\"" << methodName(PaymentMethod(m)) << "\",outcome=\""
+                << outcomeNames[o] << "\"} " << merged.outcomes[m][o] << "\n";
+        }
+    }
+    out << "# HELP pos_journal_writes_total Journal buffer writes.\n";
+    out << "# TYPE pos_journal_writes_total counter\n";
+    out << "pos_journal_writes_total " << merged.journalWrites << "\n";
+    out << "# HELP pos_journal_syncs_total Journal fdatasync calls.\n";
+    out << "# TYPE pos_journal_syncs_total counter\n";
+    out << "pos_journal_syncs_total " << merged.journalSyncs << "\n";
+    return out.str();
+}
+
+bool MetricsRegistry::writePrometheus(const string& path) const {
+    // Write beside the target and rename, so a scraper never sees half a file
+    string text = prometheusText();
+    string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, text.data(), text.size()) == ssize_t(text.size());
+    ::close(fd);
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+MetricsDumper::MetricsDumper(const string& filePath, chrono::milliseconds every)
+    : path(filePath), interval(every), stopping(false) {
+    if (MetricsEnabled && !path.empty() && interval.count() > 0) {
+        writer = thread(&MetricsDumper::writerLoop, this);
+    }
+}
+
+MetricsDumper::~MetricsDumper() {
+    {
+        lock_guard<mutex> lock(dumperMutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+        MetricsRegistry::shared().writePrometheus(path);
+    }
+}
+
+void MetricsDumper::writerLoop() {
+    unique_lock<mutex> lock(dumperMutex);
+    while (!stopping) {
+        if (wake.wait_for(lock, interval, [this] { return stopping; })) break;
+        lock.unlock();
+        if (!MetricsRegistry::shared().writePrometheus(path)) {
+            EventLogger::shared().message("Cannot write metrics file " + path);
+        }
+        lock.lock();
+    }
+}
+
+// TransactionStore Implementation
+TransactionStore::TransactionStore() {
+    count = 0;
+}
+
+TransactionStore::~TransactionStore() {
+    for (size_t c = 0; c < chunks.size(); c++) {
+        delete[] chunks[c];
+        delete[] centsColumns[c];
+        delete[] keyColumns[c];
+    }
+    chunks.clear();
+    centsColumns.clear();
+    keyColumns.clear();
+}
+
+TransactionStore::Handle TransactionStore::append(const PaymentDetails& payment) {
+    // Grow by a whole chunk only when the last one is full
+    if (count == chunks.size() * ChunkSize) {
+        chunks.push_back(new PaymentDetails[ChunkSize]);
+        centsColumns.push_back(new int64_t[ChunkSize]);
+        keyColumns.push_back(new uint8_t[ChunkSize]);
+    }
+    Handle handle = Handle(count);
+    (*this)[handle] = payment;
+    pack(handle);
+    count++;
+    return handle;
+}
+
+void TransactionStore::pack(Handle handle) {
+    const PaymentDetails& payment = (*this)[handle];
+    size_t c = handle >> ChunkBits;
+    size_t i = handle & (ChunkSize - 1);
+    centsColumns[c][i] = payment.net().cents;
+    keyColumns[c][i] = uint8_t(MethodStatusTotals::key(payment.paymentMethod, payment.status));
+}
+
+MethodStatusTotals TransactionStore::aggregate() const {
+    // Four independent accumulator banks: consecutive records rarely collide on a
+    // bank, so the adds do not serialize on one store-to-load dependency
+    const size_t Banks = 4;
+    const size_t Keys = MethodStatusTotals::KeyCount;
+    int64_t cents[Banks][Keys];
+    uint64_t counts[Banks][Keys];
+    memset(cents, 0, sizeof(cents));
+    memset(counts, 0, sizeof(counts));
+
+    size_t remaining = count;
+    for (size_t c = 0; c < chunks.size() && remaining > 0; c++) {
+        size_t n = remaining < ChunkSize ? remaining : ChunkSize;
+        const int64_t* amounts = centsColumns[c];
+        const uint8_t* keys = keyColumns[c];
+        size_t i = 0;
+        for (; i + Banks <= n; i += Banks) {
+            cents[0][keys[i]] += amounts[i];
+            cents[1][keys[i + 1]] += amounts[i + 1];
+            cents[2][keys[i + 2]] += amounts[i + 2];
+            cents[3][keys[i + 3]] += amounts[i + 3];
+            counts[0][keys[i]]++;
+            counts[1][keys[i + 1]]++;
+            counts[2][keys[i + 2]]++;
+            counts[3][keys[i + 3]]++;
+        }
+        for (; i < n; i++) {
+            cents[0][keys[i]] += amounts[i];
+            counts[0][keys[i]]++;
+        }
+        remaining -= n;
+    }
+
+    MethodStatusTotals totals;
+    for (size_t b = 0; b < Banks; b++) {
+        for (size_t k = 0; k < Keys; k++) {
+            totals.cents[k] += cents[b][k];
+            totals.counts[k] += counts[b][k];
+        }
+    }
+    return totals;
+}
+
+Money MethodStatusTotals::statusAmount(PaymentStatus status) const {
+    Money total;
+    for (size_t m = 0; m < MethodCount; m++) {
+        total += amount(PaymentMethod(m), status);
+    }
+    return total;
+}
+
+uint64_t MethodStatusTotals::statusCount(PaymentStatus status) const {
+    uint64_t total = 0;
+    for (size_t m = 0; m < MethodCount; m++) {
+        total += count(PaymentMethod(m), status);
+    }
+    return total;
+}
+
+void MethodStatusTotals::merge(const MethodStatusTotals& other) {
+    for (size_t k = 0; k < KeyCount; k++) {
+        cents[k] += other.cents[k];
+        counts[k] += other.counts[k];
+    }
+}
+
+// PaymentIdTable Implementation
+void PaymentIdTable::rehash(size_t capacity) {
+    vector<Slot> old;
+    old.swap(slots);
+    slots.assign(capacity, Slot{EmptyKey, Handle(0)});
+    shift = 64;
+    for (size_t n = capacity; n > 1; n >>= 1) shift--;
+    used = 0;
+    for (const Slot& slot : old) {
+        if (slot.key != EmptyKey) set(slot.key, slot.handle);
+    }
+}
+
+void PaymentIdTable::reserve(size_t keys) {
+    size_t capacity = slots.empty() ? 1024 : slots.size();
+    while (keys * 8 > capacity * 5) capacity *= 2;
+    if (capacity > slots.size()) rehash(capacity);
+}
+
+void PaymentIdTable::set(int key, Handle handle) {
+    if (key == EmptyKey) return;   // reserved; never issued as a payment ID
+    // Keep the load under 5/8 so probe runs stay short
+    if ((used + 1) * 8 > slots.size() * 5) rehash(slots.empty() ? 1024 : slots.size() * 2);
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(key);; i = (i + 1) & mask) {
+        if (slots[i].key == key) {
+            slots[i].handle = handle;
+            return;
+        }
+        if (slots[i].key == EmptyKey) {
+            slots[i] = Slot{key, handle};
+            used++;
+            return;
+        }
+    }
+}
+
+bool PaymentIdTable::find(int key, Handle& handle) const {
+    if (slots.empty() || key == EmptyKey) return false;
+    size_t mask = slots.size() - 1;
+    for (size_t i = home(key);; i = (i + 1) & mask) {
+        if (slots[i].key == key) {
+            handle = slots[i].handle;
+            return true;
+        }
+        if (slots[i].key == EmptyKey) return false;
+    }
+}
+
+void PaymentIdTable::clear() {
+    slots.clear();
+    used = 0;
+    shift = 64;
+}
+
+// TransactionIndex Implementation
+void TransactionIndex::insert(const PaymentDetails& payment, Handle handle) {
+    byId.set(payment.paymentId, handle);
+    byMethod[size_t(payment.paymentMethod)].push_back(handle);
+    byStatus[size_t(payment.status)].push_back(handle);
+
+    // Records normally arrive in time order; only a clock step back needs a real insert
+    if (byTime.empty() || byTime.back().first <= payment.timestamp) {
+        byTime.push_back(make_pair(payment.timestamp, handle));
+    } else {
+        auto pos = upper_bound(byTime.begin(), byTime.end(), make_pair(payment.timestamp, handle));
+        byTime.insert(pos, make_pair(payment.timestamp, handle));
+    }
+}
+
+void TransactionIndex::statusChanged(const PaymentDetails& payment, PaymentStatus previous, Handle handle) {
+    // A record not changed before is only in the list of its previous status
+    auto found = statusLists.find(handle);
+    uint32_t lists = found != statusLists.end() ? found->second : 1u << size_t(previous);
+    uint32_t bit = 1u << size_t(payment.status);
+    if (lists & bit) return;
+    byStatus[size_t(payment.status)].push_back(handle);
+    statusLists[handle] = lists | bit;
+}
+
+void TransactionIndex::reserve(size_t records) {
+    byId.reserve(records);
+    byTime.reserve(records);
+}
+
+void TransactionIndex::insertUnordered(const PaymentDetails& payment, Handle handle) {
+    byId.set(payment.paymentId, handle);
+    byMethod[size_t(payment.paymentMethod)].push_back(handle);
+    byStatus[size_t(payment.status)].push_back(handle);
+    byTime.push_back(make_pair(payment.timestamp, handle));
+}
+
+void TransactionIndex::sortByTime() {
+    // One sort instead of a middle insert per record when journals interleave
+    if (!is_sorted(byTime.begin(), byTime.end())) {
+        sort(byTime.begin(), byTime.end());
+    }
+}
+
+void TransactionIndex::clear() {
+    byId.clear();
+    for (auto& handles : byMethod) handles.clear();
+    for (auto& handles : byStatus) handles.clear();
+    byTime.clear();
+    statusLists.clear();
+}
+
+bool TransactionIndex::findId(int paymentId, Handle& handle) const {
+    return byId.find(paymentId, handle);
+}
+
+const vector<TransactionIndex::Handle>& TransactionIndex::withMethod(PaymentMethod method) const {
+    static const vector<Handle> none;
+    return size_t(method) < MethodCount ? byMethod[size_t(method)] : none;
+}
+
+const vector<TransactionIndex::Handle>& TransactionIndex::withStatus(PaymentStatus status) const {
+    static const vector<Handle> none;
+    return size_t(status) < StatusCount ? byStatus[size_t(status)] : none;
+}
+
+vector<TransactionIndex::Handle> TransactionIndex::inTimeRange(EpochMicros from, EpochMicros to) const {
+    vector<Handle> result;
+    auto first = lower_bound(byTime.begin(), byTime.end(), make_pair(from, Handle(0)));
+    for (auto it = first; it != byTime.end() && it->first <= to; ++it) {
+        result.push_back(it->second);
+    }
+    return result;
+}
+
+pair<size_t, size_t> TransactionIndex::timeSpan(EpochMicros from, EpochMicros to) const {
+    auto first = lower_bound(byTime.begin(), byTime.end(), make_pair(from, Handle(0)));
+    auto last = upper_bound(first, byTime.end(), to, [](EpochMicros time, const pair<EpochMicros, Handle>& entry) {
+        return time < entry.first;
+    });
+    return make_pair(size_t(first - byTime.begin()), size_t(last - byTime.begin()));
+}
+
+// TransactionRollups Implementation
+void RollupCell::add(Money amount) {
+    count++;
+    sumCents += amount.cents;
+    if (amount.cents < minCents) minCents = amount.cents;
+    if (amount.cents > maxCents) maxCents = amount.cents;
+}
+
+void RollupCell::remove(Money amount) {
+    count--;
+    sumCents -= amount.cents;
+    if (count == 0) {
+        minCents = INT64_MAX;
+        maxCents = INT64_MIN;
+        stale = false;
+    } else if (amount.cents <= minCents || amount.cents >= maxCents) {
+        stale = true;
+    }
+}
+
+void RollupCell::merge(const RollupCell& other) {
+    count += other.count;
+    sumCents += other.sumCents;
+    if (other.minCents < minCents) minCents = other.minCents;
+    if (other.maxCents > maxCents) maxCents = other.maxCents;
+    stale = stale || other.stale;
+}
+
+void RollupBucket::add(const PaymentDetails& payment) {
+    if (size_t(payment.paymentMethod) >= MethodCount || size_t(payment.status) >= StatusCount) return;
+    cells[size_t(payment.paymentMethod)][size_t(payment.status)].add(payment.net());
+}
+
+bool RollupBucket::remove(const PaymentDetails& payment) {
+    if (size_t(payment.paymentMethod) >= MethodCount || size_t(payment.status) >= StatusCount) return false;
+    RollupCell& cell = cells[size_t(payment.paymentMethod)][size_t(payment.status)];
+    cell.remove(payment.net());
+    return cell.stale;
+}
+
+void RollupBucket::merge(const RollupBucket& other) {
+    for (size_t m = 0; m < MethodCount; m++) {
+        for (size_t st = 0; st < StatusCount; st++) {
+            cells[m][st].merge(other.cells[m][st]);
+        }
+    }
+}
+
+RollupCell RollupBucket::withStatus(PaymentStatus status) const {
+    RollupCell result;
+    for (size_t m = 0; m < MethodCount; m++) {
+        result.merge(cells[m][size_t(status)]);
+    }
+    return result;
+}
+
+uint64_t RollupBucket::transactions() const {
+    uint64_t total = 0;
+    for (size_t m = 0; m < MethodCount; m++) {
+        for (size_t st = 0; st < StatusCount; st++) {
+            total += cells[m][st].count;
+        }
+    }
+    return total;
+}
+
+TransactionRollups::TransactionRollups(size_t minuteBuckets, size_t hourBuckets)
+    : minuteRetention(minuteBuckets), hourRetention(hourBuckets) {
+}
+
+void TransactionRollups::addToSeries(map<time_t, RollupBucket>& series, time_t start, const PaymentDetails& payment,
+                                     size_t retention) {
+    // Records arrive in time order, so the bucket is almost always the last one
+    if (!series.empty() && series.rbegin()->first == start) {
+        series.rbegin()->second.add(payment);
+    } else {
+        series[start].add(payment);
+    }
+    while (series.size() > retention) {
+        series.erase(series.begin());
+    }
+}
+
+void TransactionRollups::add(const PaymentDetails& payment) {
+    day.add(payment);
+    time_t when = epochSeconds(payment.timestamp);
+    addToSeries(minutes, when - when % MinuteSeconds, payment, minuteRetention);
+    addToSeries(hours, localHourStart(when), payment, hourRetention);
+}
+
+void TransactionRollups::replace(const PaymentDetails& before, const PaymentDetails& after) {
+    staleBounds = day.remove(before) || staleBounds;
+    day.add(after);
+    auto update = [&](map<time_t, RollupBucket>& series, time_t start) {
+        auto bucket = series.find(start);
+        if (bucket == series.end()) return;
+        staleBounds = bucket->second.remove(before) || staleBounds;
+        bucket->second.add(after);
+    };
+    time_t when = epochSeconds(before.timestamp);
+    update(minutes, when - when % MinuteSeconds);
+    update(hours, localHourStart(when));
+}
+
+void TransactionRollups::clear() {
+    day = RollupBucket();
+    minutes.clear();
+    hours.clear();
+    staleBounds = false;
+}
+
+void TransactionRollups::resetStaleBounds() {
+    auto reset = [](RollupBucket& bucket) {
+        for (auto& row : bucket.cells) {
+            for (RollupCell& cell : row) {
+                if (!cell.stale) continue;
+                cell.minCents = INT64_MAX;
+                cell.maxCents = INT64_MIN;
+            }
+        }
+    };
+    reset(day);
+    for (auto& bucket : minutes) reset(bucket.second);
+    for (auto& bucket : hours) reset(bucket.second);
+}
+
+void TransactionRollups::widenStaleBounds(const PaymentDetails& payment) {
+    // Only the stale cells take bounds from the records
+    if (size_t(payment.paymentMethod) >= MethodCount || size_t(payment.status) >= StatusCount) return;
+    auto widen = [&payment](RollupBucket& bucket) {
+        RollupCell& cell = bucket.cells[size_t(payment.paymentMethod)][size_t(payment.status)];
+        if (!cell.stale) return;
+        int64_t cents = payment.net().cents;
+        if (cents < cell.minCents) cell.minCents = cents;
+        if (cents > cell.maxCents) cell.maxCents = cents;
+    };
+    widen(day);
+    time_t when = epochSeconds(payment.timestamp);
+    auto minute = minutes.find(when - when % MinuteSeconds);
+    if (minute != minutes.end()) widen(minute->second);
+    auto hour = hours.find(localHourStart(when));
+    if (hour != hours.end()) widen(hour->second);
+}
+
+void TransactionRollups::finishRefresh() {
+    auto settle = [](RollupBucket& bucket) {
+        for (auto& row : bucket.cells) {
+            for (RollupCell& cell : row) cell.stale = false;
+        }
+    };
+    settle(day);
+    for (auto& bucket : minutes) settle(bucket.second);
+    for (auto& bucket : hours) settle(bucket.second);
+    staleBounds = false;
+}
+
+RollupBucket TransactionRollups::range(time_t from, time_t to) const {
+    // Whole hours come from the hour buckets, the ragged ends from the minute buckets
+    RollupBucket result;
+    auto addSeries = [&result](const map<time_t, RollupBucket>& series, time_t first, time_t last) {
+        for (auto it = series.lower_bound(first); it != series.end() && it->first < last; ++it) {
+            result.merge(it->second);
+        }
+    };
+    from -= from % MinuteSeconds;
+    time_t firstHour = localHourStart(from);
+    if (firstHour < from) firstHour += HourSeconds;
+    time_t lastHour = localHourStart(to);
+    if (firstHour >= lastHour) {
+        addSeries(minutes, from, to);
+    } else {
+        addSeries(minutes, from, firstHour);
+        addSeries(hours, firstHour, lastHour);
+        addSeries(minutes, lastHour, to);
+    }
+    return result;
+}
+
+// TransactionQuery Implementation
+static const char* const queryGroupNames[QueryGroupCount] = {"none", "method", "status", "hour"};
+static const char* const queryStatusNames[StatusCount] = {
+    "pending", "completed", "failed", "refunded", "voided", "authorized"
+};
+
+int64_t TransactionQuery::groupKey(const PaymentDetails& payment) const {
+    switch (groupBy) {
+        case QueryGroup::Method: return int64_t(payment.paymentMethod);
+        case QueryGroup::Status: return int64_t(payment.status);
+        case QueryGroup::Hour: {
+            return int64_t(localHourStart(epochSeconds(payment.timestamp)));
+        }
+        default: return 0;
+    }
+}
+
+bool TransactionQuery::filtersAmount() const {
+    return minAmount.cents != INT64_MIN || maxAmount.cents != INT64_MAX;
+}
+
+bool TransactionQuery::filtersTime() const {
+    return from != INT64_MIN || to != INT64_MAX;
+}
+
+bool TransactionQuery::mayMatch(const SegmentSummary& summary) const {
+    return summary.records > 0 && (summary.methods & methods) != 0 && (summary.statuses & statuses) != 0 &&
+           summary.toTime >= from && summary.fromTime <= to;
+}
+
+// Clock-time filters as times on now's day; "to" is exclusive, so 14:00-15:00 is one hour
+TransactionQuery TransactionQuery::resolved(time_t now) const {
+    TransactionQuery query = *this;
+    if (fromMinute >= 0 && toMinute >= 0) {
+        time_t start, end;
+        shiftWindow(fromMinute, toMinute, now, start, end);
+        query.from = epochMicros(start);
+        query.to = epochMicros(end) - 1;
+    } else if (fromMinute >= 0) {
+        query.from = epochMicros(clockTimeToday(fromMinute, now));
+    } else if (toMinute >= 0) {
+        query.to = epochMicros(clockTimeToday(toMinute, now)) - 1;
+    }
+    query.fromMinute = -1;
+    query.toMinute = -1;
+    return query;
+}
+
+// Method words for method=; "mobile" is every provider
+static bool queryMethodBits(string_view word, uint32_t& bits) {
+    static const struct {
+        const char* name;
+        uint32_t bits;
+    } names[] = {
+        {"cash", 1u << size_t(PaymentMethod::Cash)},
+        {"credit", 1u << size_t(PaymentMethod::CreditCard)},
+        {"debit", 1u << size_t(PaymentMethod::DebitCard)},
+        {"applepay", 1u << size_t(PaymentMethod::MobileApplePay)},
+        {"googlepay", 1u << size_t(PaymentMethod::MobileGooglePay)},
+        {"paypal", 1u << size_t(PaymentMethod::MobilePayPal)},
+        {"unknown", 1u << size_t(PaymentMethod::MobileUnknown)},
+        {"mobile", (1u << size_t(PaymentMethod::MobileApplePay)) | (1u << size_t(PaymentMethod::MobileGooglePay)) |
+                   (1u << size_t(PaymentMethod::MobilePayPal)) | (1u << size_t(PaymentMethod::MobileUnknown))},
+    };
+    for (const auto& entry : names) {
+        if (word == entry.name) {
+            bits |= entry.bits;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool queryStatusBits(string_view word, uint32_t& bits) {
+    for (size_t i = 0; i < StatusCount; i++) {
+        if (word == queryStatusNames[i]) {
+            bits |= 1u << i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parseQuery(const vector<string_view>& words, size_t first, TransactionQuery& query, string& error) {
+    query = TransactionQuery();
+    for (size_t i = first; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        if (equals == string_view::npos || equals + 1 == words[i].size()) {
+            error = "query filters look like name=value, not '" + string(words[i]) + "'";
+            return false;
+        }
+        string_view name = words[i].substr(0, equals);
+        string_view value = words[i].substr(equals + 1);
+
+        bool valid = true;
+        if (name == "method" || name == "status") {
+            uint32_t bits = 0;
+            while (valid && !value.empty()) {
+                size_t comma = value.find(',');
+                string_view item = value.substr(0, comma);
+                valid = name == "method" ? queryMethodBits(item, bits) : queryStatusBits(item, bits);
+                value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+            }
+            (name == "method" ? query.methods : query.statuses) = bits;
+        } else if (name == "min") {
+            valid = parseMoney(value, query.minAmount);
+        } else if (name == "max") {
+            valid = parseMoney(value, query.maxAmount);
+        } else if (name == "from" || name == "to") {
+            // A clock time is on the day the query runs; a date is absolute and "to" is exclusive
+            bool isFrom = name == "from";
+            time_t when;
+            if (parseCalendarTime(value, when)) {
+                (isFrom ? query.fromMinute : query.toMinute) = -1;
+                (isFrom ? query.from : query.to) = isFrom ? epochMicros(when) : epochMicros(when) - 1;
+            } else {
+                valid = parseClockTime(value, isFrom ? query.fromMinute : query.toMinute);
+            }
+        } else if (name == "by") {
+            size_t group = 0;
+            while (group < QueryGroupCount && value != queryGroupNames[group]) group++;
+            valid = group < QueryGroupCount;
+            if (valid) query.groupBy = QueryGroup(group);
+        } else {
+            error = "unknown query filter '" + string(name) + "'";
+            return false;
+        }
+        if (!valid) {
+            error = "invalid query filter '" + string(words[i]) + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+void QueryResult::merge(const QueryResult& other) {
+    for (const auto& group : other.groups) {
+        groups[group.first].merge(group.second);
+    }
+    scanned += other.scanned;
+    if (other.threads > threads) threads = other.threads;
+    if (plan == nullptr) plan = other.plan;
+}
+
+// One scan thread's groups. Method, status and ungrouped totals index a small
+// array; hour groups live in a map, with the last hour cached because records
+// mostly arrive in time order.
+class QueryAccumulator {
+private:
+    const TransactionQuery& query;
+    RollupCell cells[MethodCount > StatusCount ? MethodCount : StatusCount];
+    map<int64_t, RollupCell> hours;
+    map<int64_t, RollupCell>::iterator lastHour;
+
+public:
+    explicit QueryAccumulator(const TransactionQuery& filter) : query(filter), lastHour(hours.end()) {}
+
+    void add(const PaymentDetails& payment) {
+        if (!query.matches(payment)) return;
+        int64_t key = query.groupKey(payment);
+        if (query.groupBy != QueryGroup::Hour) {
+            cells[key].add(payment.net());
+            return;
+        }
+        if (lastHour == hours.end() || lastHour->first != key) {
+            lastHour = hours.emplace(key, RollupCell()).first;
+        }
+        lastHour->second.add(payment.net());
+    }
+
+    void finish(QueryResult& result) const {
+        for (size_t i = 0; i < sizeof(cells) / sizeof(cells[0]); i++) {
+            if (cells[i].count > 0) result.groups[int64_t(i)].merge(cells[i]);
+        }
+        for (const auto& hour : hours) {
+            result.groups[hour.first].merge(hour.second);
+        }
+    }
+};
+
+// Fewer candidates than this are scanned on the calling thread
+static const size_t QueryRecordsPerThread = size_t(1) << 18;
+
+// Scan candidates [0, count) split across threads; addCandidate(groups, i) adds
+// candidate i's record to the thread's accumulator
+template <typename AddCandidate>
+static void scanQuery(size_t count, AddCandidate addCandidate, const TransactionQuery& query, QueryResult& result) {
+    size_t threads = count / QueryRecordsPerThread;
+    size_t cores = thread::hardware_concurrency();
+    if (threads > cores) threads = cores;
+    if (threads == 0) threads = 1;
+    size_t perThread = (count + threads - 1) / threads;
+
+    vector<QueryResult> parts(threads);
+    auto scan = [&](size_t part) {
+        QueryAccumulator groups(query);
+        size_t end = min(count, (part + 1) * perThread);
+        for (size_t i = part * perThread; i < end; i++) {
+            addCandidate(groups, i);
+        }
+        groups.finish(parts[part]);
+    };
+    vector<thread> workers;
+    for (size_t part = 1; part < threads; part++) {
+        workers.push_back(thread(scan, part));
+    }
+    scan(0);
+    for (thread& worker : workers) {
+        worker.join();
+    }
+
+    for (const QueryResult& part : parts) {
+        result.merge(part);
+    }
+    result.scanned += count;
+    if (threads > result.threads) result.threads = threads;
+}
+
+// Snapshot Implementation
+static inline uint32_t toLittle32(uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(v);
+#else
+    return v;
+#endif
+}
+
+static inline uint64_t toLittle64(uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(v);
+#else
+    return v;
+#endif
+}
+
+static inline uint16_t toLittle16(uint16_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap16(v);
+#else
+    return v;
+#endif
+}
+
+static uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const TerminalIdentity& TerminalIdentity::local() {
+    static const TerminalIdentity identity = [] {
+        TerminalIdentity loaded;
+        const char* store = getenv("POS_STORE_ID");
+        const char* terminal = getenv("POS_TERMINAL_ID");
+        if (store != nullptr) loaded.storeId = uint32_t(strtoul(store, nullptr, 10));
+        if (terminal != nullptr) loaded.terminalId = uint32_t(strtoul(terminal, nullptr, 10));
+        return loaded;
+    }();
+    return identity;
+}
+
+static uint8_t snapshotStatusCode(PaymentStatus status) {
+    if (status == PaymentStatus::Completed) return SnapshotCompleted;
+    if (status == PaymentStatus::Failed) return SnapshotFailed;
+    if (status == PaymentStatus::Refunded) return SnapshotRefunded;
+    if (status == PaymentStatus::Voided) return SnapshotVoided;
+    if (status == PaymentStatus::Authorized) return SnapshotAuthorized;
+    return SnapshotPending;
+}
+
+static PaymentStatus snapshotStatus(uint8_t status) {
+    switch (status) {
+        case SnapshotCompleted: return PaymentStatus::Completed;
+        case SnapshotFailed: return PaymentStatus::Failed;
+        case SnapshotRefunded: return PaymentStatus::Refunded;
+        case SnapshotVoided: return PaymentStatus::Voided;
+        case SnapshotAuthorized: return PaymentStatus::Authorized;
+        default: return PaymentStatus::Pending;
+    }
+}
+
+static uint64_t headerChecksumOf(SnapshotHeader header, size_t headerSize) {
+    header.headerChecksum = 0;
+    return fnv1a(&header, headerSize);
+}
+
+SnapshotWriter::SnapshotWriter(const string& filePath, uint32_t store, uint32_t terminal)
+    : path(filePath), tempPath(filePath + ".tmp"), fd(-1), checksum(14695981039346656037ULL),
+      offset(0), recordCount(0), stringSlots(1024, 0), stringCount(0), storeId(store), terminalId(terminal),
+      journalOffset(NoJournalCheckpoint) {
+    sources.push_back(SnapshotSource{store, terminal});
+    fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw runtime_error("Cannot create " + tempPath);
+    }
+    pending.reserve(1 << 20);
+
+    // Reserve room for the header; it is written last
+    SnapshotHeader blank;
+    memset(&blank, 0, sizeof(blank));
+    pending.insert(pending.end(), reinterpret_cast<char*>(&blank), reinterpret_cast<char*>(&blank) + sizeof(blank));
+    offset = sizeof(blank);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    if (fd >= 0) {
+        // finish() was never reached; leave the previous snapshot untouched
+        ::close(fd);
+        unlink(tempPath.c_str());
+    }
+}
+
+void SnapshotWriter::emit(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    checksum = fnv1a(bytes, size, checksum);
+    pending.insert(pending.end(), bytes, bytes + size);
+    offset += size;
+    if (pending.size() >= (1 << 20)) {
+        drain();
+    }
+}
+
+void SnapshotWriter::drain() {
+    const char* data = pending.data();
+    size_t remaining = pending.size();
+    while (remaining > 0) {
+        ssize_t written = write(fd, data, remaining);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error("Write to " + tempPath + " failed");
+        }
+        data += written;
+        remaining -= written;
+    }
+    pending.clear();
+}
+
+void SnapshotWriter::pad() {
+    static const char zeros[8] = {0};
+    if (offset % 8 != 0) {
+        emit(zeros, 8 - offset % 8);
+    }
+}
+
+string_view SnapshotWriter::interned(uint32_t ref) const {
+    uint16_t len;
+    memcpy(&len, strings.data() + ref, sizeof(len));
+    return string_view(strings.data() + ref + sizeof(len), toLittle16(len));
+}
+
+void SnapshotWriter::growStringSlots() {
+    vector<uint32_t> slots(stringSlots.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (uint32_t entry : stringSlots) {
+        if (entry == 0) continue;
+        size_t slot = hash<string_view>()(interned(entry - 1)) & mask;
+        while (slots[slot] != 0) slot = (slot + 1) & mask;
+        slots[slot] = entry;
+    }
+    stringSlots.swap(slots);
+}
+
+// Strings are compared against the table itself, so interning one allocates
+// nothing beyond the table's own growth
+uint32_t SnapshotWriter::intern(string_view text) {
+    text = text.substr(0, 0xFFFF);
+    if ((stringCount + 1) * 2 > stringSlots.size()) {
+        growStringSlots();
+    }
+    size_t mask = stringSlots.size() - 1;
+    size_t slot = hash<string_view>()(text) & mask;
+    for (; stringSlots[slot] != 0; slot = (slot + 1) & mask) {
+        if (interned(stringSlots[slot] - 1) == text) return stringSlots[slot] - 1;
+    }
+
+    uint32_t ref = uint32_t(strings.size());
+    uint16_t len = toLittle16(uint16_t(text.size()));
+    strings.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    strings.append(text.data(), text.size());
+    stringSlots[slot] = ref + 1;
+    stringCount++;
+    return ref;
+}
+
+void SnapshotWriter::add(int paymentId, string_view method, int64_t amountCents, int64_t timestamp,
+                         uint8_t status, string_view authorizationCode, int64_t adjustedCents, uint16_t source) {
+    SnapshotRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.paymentId = toLittle32(uint32_t(paymentId));
+    rec.methodRef = toLittle32(intern(method));
+    rec.amountCents = int64_t(toLittle64(uint64_t(amountCents)));
+    rec.timestamp = int64_t(toLittle64(uint64_t(timestamp)));
+    rec.authRef = toLittle32(intern(authorizationCode));
+    rec.status = status;
+    rec.source = toLittle16(source);
+    emit(&rec, sizeof(rec));
+    if (adjustedCents != 0) {
+        SnapshotAdjusted adjustment;
+        adjustment.record = toLittle32(uint32_t(recordCount));
+        adjustment.reserved = 0;
+        adjustment.adjustedCents = int64_t(toLittle64(uint64_t(adjustedCents)));
+        adjusted.push_back(adjustment);
+    }
+
+    SnapshotIndexEntry entry;
+    entry.paymentId = uint32_t(paymentId);
+    entry.record = uint32_t(recordCount);
+    index.push_back(entry);
+    recordCount++;
+}
+
+void SnapshotWriter::add(const PaymentDetails& payment) {
+    add(payment.paymentId, methodName(payment.paymentMethod), payment.amount.cents,
+        int64_t(epochSeconds(payment.timestamp)), snapshotStatusCode(payment.status), payment.authorizationCode,
+        payment.adjusted.cents);
+}
+
+uint16_t SnapshotWriter::addSource(uint32_t store, uint32_t terminal) {
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (sources[i].storeId == store && sources[i].terminalId == terminal) return uint16_t(i);
+    }
+    if (sources.size() > UINT16_MAX) {
+        throw runtime_error("Too many terminals for one snapshot");
+    }
+    sources.push_back(SnapshotSource{store, terminal});
+    return uint16_t(sources.size() - 1);
+}
+
+void SnapshotWriter::finish() {
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SnapshotMagic, sizeof(SnapshotMagic));
+    header.version = toLittle32(SnapshotVersion);
+    header.headerSize = toLittle32(sizeof(SnapshotHeader));
+    header.recordCount = toLittle64(recordCount);
+    header.recordsOffset = toLittle64(sizeof(SnapshotHeader));
+
+    header.stringsOffset = toLittle64(offset);
+    header.stringsSize = toLittle64(strings.size());
+    emit(strings.data(), strings.size());
+    pad();
+    header.adjustedOffset = toLittle64(offset);
+    header.adjustedCount = toLittle64(adjusted.size());
+    emit(adjusted.data(), adjusted.size() * sizeof(SnapshotAdjusted));
+    header.sourcesOffset = toLittle64(offset);
+    header.sourcesCount = toLittle64(sources.size());
+    for (SnapshotSource& source : sources) {
+        source.storeId = toLittle32(source.storeId);
+        source.terminalId = toLittle32(source.terminalId);
+    }
+    emit(sources.data(), sources.size() * sizeof(SnapshotSource));
+
+    // Footer sorted by payment ID; ties keep insertion order so the last one is the latest
+    stable_sort(index.begin(), index.end(), [](const SnapshotIndexEntry& a, const SnapshotIndexEntry& b) {
+        return a.paymentId < b.paymentId;
+    });
+    header.indexOffset = toLittle64(offset);
+    for (SnapshotIndexEntry& entry : index) {
+        entry.paymentId = toLittle32(entry.paymentId);
+        entry.record = toLittle32(entry.record);
+    }
+    emit(index.data(), index.size() * sizeof(SnapshotIndexEntry));
+    drain();
+
+    header.createdAt = int64_t(toLittle64(uint64_t(time(0))));
+    header.storeId = toLittle32(storeId);
+    header.terminalId = toLittle32(terminalId);
+    header.bodyChecksum = toLittle64(checksum);
+    header.journalOffset = toLittle64(journalOffset);
+    header.headerChecksum = toLittle64(headerChecksumOf(header, sizeof(header)));
+    if (pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        throw runtime_error("Write to " + tempPath + " failed");
+    }
+
+    // Replace the old snapshot only once the new one is on disk
+    fsync(fd);
+    ::close(fd);
+    fd = -1;
+    if (rename(tempPath.c_str(), path.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        throw runtime_error("Cannot replace " + path);
+    }
+}
+
+SnapshotView::SnapshotView()
+    : fd(-1), base(nullptr), length(0), records(nullptr), index(nullptr), adjustedRecords(nullptr), sourceTable(nullptr),
+      sourceTableSize(0), headerSource{0, 0}, strings(nullptr) {
+    memset(&header, 0, sizeof(header));
+}
+
+SnapshotView::~SnapshotView() {
+    close();
+}
+
+void SnapshotView::open(const string& path, bool verifyBody) {
+    close();
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < SnapshotHeaderSizeV1) {
+        close();
+        throw runtime_error(path + " is not a snapshot");
+    }
+    length = size_t(st.st_size);
+    void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close();
+        throw runtime_error("Cannot map " + path);
+    }
+    base = static_cast<const char*>(mapped);
+
+    // Older headers are a prefix of the current one
+    memcpy(&header, base, SnapshotHeaderSizeV1);
+    uint32_t version = toLittle32(header.version);
+    uint32_t headerSize = toLittle32(header.headerSize);
+    if (memcmp(header.magic, SnapshotMagic, sizeof(SnapshotMagic)) != 0) {
+        close();
+        throw runtime_error(path + " is not a snapshot");
+    }
+    uint32_t expectedSize = version == 1 ? SnapshotHeaderSizeV1 :
+                            version < 4 ? SnapshotHeaderSizeV2 :
+                            version < 5 ? SnapshotHeaderSizeV4 : uint32_t(sizeof(SnapshotHeader));
+    if (version < 1 || version > SnapshotVersion || headerSize != expectedSize || headerSize > length) {
+        close();
+        throw runtime_error(path + " has unsupported snapshot version");
+    }
+    memcpy(&header, base, headerSize);
+    if (version == 1) {
+        header.journalOffset = toLittle64(NoJournalCheckpoint);
+    }
+    if (version < 4) {
+        header.adjustedOffset = header.indexOffset;
+        header.adjustedCount = 0;
+    }
+    if (version < 5) {
+        header.sourcesOffset = header.indexOffset;
+        header.sourcesCount = 0;
+    }
+    if (toLittle64(header.headerChecksum) != headerChecksumOf(header, headerSize)) {
+        close();
+        throw runtime_error(path + " has a corrupt header");
+    }
+
+    uint64_t count = toLittle64(header.recordCount);
+    uint64_t recordsOffset = toLittle64(header.recordsOffset);
+    uint64_t stringsOffset = toLittle64(header.stringsOffset);
+    uint64_t stringsSize = toLittle64(header.stringsSize);
+    uint64_t indexOffset = toLittle64(header.indexOffset);
+    uint64_t adjustedOffset = toLittle64(header.adjustedOffset);
+    uint64_t adjustedCount = toLittle64(header.adjustedCount);
+    uint64_t sourcesOffset = toLittle64(header.sourcesOffset);
+    uint64_t sourcesCount = toLittle64(header.sourcesCount);
+    // Sections in order, each within the file; sizes are compared by division so
+    // a huge count cannot wrap around
+    auto fits = [](uint64_t offset, uint64_t items, size_t itemSize, uint64_t end) {
+        return offset <= end && items <= (end - offset) / itemSize;
+    };
+    if (recordsOffset < headerSize || recordsOffset % 8 != 0 || adjustedOffset % 8 != 0 ||
+        sourcesOffset % 8 != 0 || indexOffset % 8 != 0 ||
+        !fits(indexOffset, count, sizeof(SnapshotIndexEntry), length) ||
+        indexOffset + count * sizeof(SnapshotIndexEntry) != length ||
+        !fits(sourcesOffset, sourcesCount, sizeof(SnapshotSource), indexOffset) || sourcesCount > UINT16_MAX + 1u ||
+        !fits(adjustedOffset, adjustedCount, sizeof(SnapshotAdjusted), sourcesOffset) || adjustedCount > count ||
+        !fits(stringsOffset, stringsSize, 1, adjustedOffset) ||
+        !fits(recordsOffset, count, sizeof(SnapshotRecord), stringsOffset)) {
+        close();
+        throw runtime_error(path + " is truncated");
+    }
+    records = reinterpret_cast<const SnapshotRecord*>(base + recordsOffset);
+    strings = base + stringsOffset;
+    adjustedRecords = reinterpret_cast<const SnapshotAdjusted*>(base + adjustedOffset);
+    index = reinterpret_cast<const SnapshotIndexEntry*>(base + indexOffset);
+    // Older snapshots name no sources; their records all read as source 0, the header's
+    headerSource = SnapshotSource{header.storeId, header.terminalId};
+    sourceTable = sourcesCount > 0 ? reinterpret_cast<const SnapshotSource*>(base + sourcesOffset) : &headerSource;
+    sourceTableSize = sourcesCount > 0 ? size_t(sourcesCount) : 1;
+
+    // The accessors follow string refs and record numbers without checking
+    // them, so they are all checked here, body checksum or not
+    string damage = checkReferences(stringsSize);
+    if (!damage.empty()) {
+        close();
+        throw runtime_error(path + " is corrupt: " + damage);
+    }
+
+    if (verifyBody) {
+        uint64_t sum = fnv1a(base + headerSize, length - headerSize);
+        if (sum != toLittle64(header.bodyChecksum)) {
+            close();
+            throw runtime_error(path + " failed checksum verification");
+        }
+    }
+}
+
+void SnapshotView::close() {
+    if (base != nullptr) {
+        munmap(const_cast<char*>(base), length);
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+    base = nullptr;
+    length = 0;
+    memset(&header, 0, sizeof(header));
+    records = nullptr;
+    index = nullptr;
+    adjustedRecords = nullptr;
+    sourceTable = nullptr;
+    sourceTableSize = 0;
+    strings = nullptr;
+}
+
+size_t SnapshotView::size() const {
+    return size_t(toLittle64(header.recordCount));
+}
+
+uint64_t SnapshotView::journalOffset() const {
+    return toLittle64(header.journalOffset);
+}
+
+int SnapshotView::maxPaymentId() const {
+    // The footer is sorted by payment ID
+    size_t count = size();
+    return count > 0 ? int(toLittle32(index[count - 1].paymentId)) : 0;
+}
+
+string SnapshotView::checkReferences(uint64_t stringsSize) const {
+    size_t count = size();
+    auto validText = [this, stringsSize](uint32_t ref) {
+        uint64_t at = toLittle32(ref);
+        if (at + sizeof(uint16_t) > stringsSize) return false;
+        uint16_t len;
+        memcpy(&len, strings + at, sizeof(len));
+        return at + sizeof(uint16_t) + toLittle16(len) <= stringsSize;
+    };
+    for (size_t i = 0; i < count; i++) {
+        if (!validText(records[i].methodRef) || !validText(records[i].authRef)) {
+            return "record " + to_string(i) + " names a string outside the string table";
+        }
+        if (toLittle16(records[i].source) >= sourceTableSize) {
+            return "record " + to_string(i) + " names no source";
+        }
+    }
+    // findById binary searches the footer and trusts where it points
+    for (size_t i = 0; i < count; i++) {
+        uint32_t record = toLittle32(index[i].record);
+        uint32_t paymentId = toLittle32(index[i].paymentId);
+        if (record >= count || toLittle32(records[record].paymentId) != paymentId ||
+            (i > 0 && paymentId < toLittle32(index[i - 1].paymentId))) {
+            return "index entry " + to_string(i) + " is out of order or names the wrong record";
+        }
+    }
+    size_t adjustedCount = size_t(toLittle64(header.adjustedCount));
+    for (size_t i = 0; i < adjustedCount; i++) {
+        uint32_t record = toLittle32(adjustedRecords[i].record);
+        if (record >= count || (i > 0 && record <= toLittle32(adjustedRecords[i - 1].record))) {
+            return "adjusted entry " + to_string(i) + " is out of order or names no record";
+        }
+    }
+    return string();
+}
+
+string_view SnapshotView::text(uint32_t ref) const {
+    const char* at = strings + toLittle32(ref);
+    uint16_t len;
+    memcpy(&len, at, sizeof(len));
+    return string_view(at + sizeof(len), toLittle16(len));
+}
+
+const SnapshotRecord* SnapshotView::findById(int paymentId) const {
+    // Binary search the footer, taking the latest record for a repeated ID
+    const SnapshotIndexEntry* first = index;
+    const SnapshotIndexEntry* last = index + size();
+    const SnapshotIndexEntry* pos = upper_bound(first, last, uint32_t(paymentId),
+        [](uint32_t id, const SnapshotIndexEntry& entry) { return id < toLittle32(entry.paymentId); });
+    if (pos == first || toLittle32((pos - 1)->paymentId) != uint32_t(paymentId)) {
+        return nullptr;
+    }
+    return &records[toLittle32((pos - 1)->record)];
+}
+
+Money SnapshotView::adjusted(const SnapshotRecord& rec) const {
+    // Few records are adjusted, so most lookups miss an empty or short section
+    uint32_t record = uint32_t(&rec - records);
+    const SnapshotAdjusted* first = adjustedRecords;
+    const SnapshotAdjusted* last = adjustedRecords + toLittle64(header.adjustedCount);
+    const SnapshotAdjusted* pos = lower_bound(first, last, record,
+        [](const SnapshotAdjusted& entry, uint32_t wanted) { return toLittle32(entry.record) < wanted; });
+    if (pos == last || toLittle32(pos->record) != record) return Money();
+    return Money::fromCents(int64_t(toLittle64(uint64_t(pos->adjustedCents))));
+}
+
+TerminalIdentity SnapshotView::source(size_t i) const {
+    TerminalIdentity identity;
+    identity.storeId = toLittle32(sourceTable[i].storeId);
+    identity.terminalId = toLittle32(sourceTable[i].terminalId);
+    return identity;
+}
+
+TerminalIdentity SnapshotView::source(const SnapshotRecord& rec) const {
+    return source(size_t(toLittle16(rec.source)));
+}
+
+PaymentDetails SnapshotView::toPaymentDetails(const SnapshotRecord& rec) const {
+    PaymentDetails payment;
+    payment.paymentId = int(toLittle32(rec.paymentId));
+    if (!methodFromName(text(rec.methodRef), payment.paymentMethod)) {
+        payment.paymentMethod = PaymentMethod::MobileUnknown;
+    }
+    payment.amount = Money::fromCents(int64_t(toLittle64(uint64_t(rec.amountCents))));
+    payment.timestamp = epochMicros(time_t(int64_t(toLittle64(uint64_t(rec.timestamp)))));
+    payment.status = snapshotStatus(rec.status);
+    payment.authorizationCode = text(rec.authRef);
+    payment.adjusted = adjusted(rec);
+    return payment;
+}
+
+void SnapshotView::generateReport() const {
+    size_t count = size();
+    int64_t revenueCents = 0;
+    size_t successCount = 0;
+    for (size_t i = 0; i < count; i++) {
+        // Branch-free so the loop vectorizes
+        int64_t completed = records[i].status == SnapshotCompleted;
+        revenueCents += int64_t(toLittle64(uint64_t(records[i].amountCents))) & -completed;
+        successCount += size_t(completed);
+    }
+    // Revenue is net of refunds and captures
+    for (uint64_t i = 0; i < toLittle64(header.adjustedCount); i++) {
+        const SnapshotAdjusted& entry = adjustedRecords[i];
+        if (records[toLittle32(entry.record)].status == SnapshotCompleted) {
+            revenueCents -= int64_t(toLittle64(uint64_t(entry.adjustedCents)));
+        }
+    }
+
+    cout << "\n========================================" << endl;
+    cout << "===      SNAPSHOT REPORT            ===" << endl;
+    cout << "========================================" << endl;
+    cout << "Total Transactions: " << count << endl;
+    cout << "Successful Transactions: " << successCount << endl;
+    cout << "Total Revenue: $" << Money::fromCents(revenueCents) << endl;
+    cout << "Success Rate: " << fixed << setprecision(2) << (count > 0 ? (successCount * 100.0 / count) : 0) << "%" << endl;
+    cout << "========================================\n" << endl;
+}
+
+// Journal segment Implementation
+static const char SegmentSummaryTag[] = "#SEGMENT ";
+
+void SegmentSummary::add(const PaymentDetails& payment) {
+    records++;
+    minId = min(minId, payment.paymentId);
+    maxId = max(maxId, payment.paymentId);
+    fromTime = min(fromTime, payment.timestamp);
+    toTime = max(toTime, payment.timestamp);
+    methods |= 1u << size_t(payment.paymentMethod);
+    statuses |= 1u << size_t(payment.status);
+}
+
+// "transactions.txt" -> "transactions.000042.log"
+string journalSegmentPath(const string& journalPath, uint64_t sequence, const char* extension) {
+    size_t slash = journalPath.rfind('/');
+    size_t dot = journalPath.rfind('.');
+    bool hasExtension = dot != string::npos && (slash == string::npos ? dot > 0 : dot > slash + 1);
+    char number[32];
+    snprintf(number, sizeof(number), ".%06llu", (unsigned long long)sequence);
+    return journalPath.substr(0, hasExtension ? dot : journalPath.size()) + number + extension;
+}
+
+vector<JournalSegment> listJournalSegments(const string& journalPath) {
+    string first = journalSegmentPath(journalPath, 0, "");
+    string prefix = first.substr(0, first.size() - 6);   // ".../<stem>."
+    size_t slash = prefix.rfind('/');
+    string directory = slash == string::npos ? string() : prefix.substr(0, slash + 1);
+    string namePrefix = prefix.substr(directory.size());
+
+    map<uint64_t, JournalSegment> found;
+    DIR* dir = opendir(directory.empty() ? "." : directory.c_str());
+    if (dir == nullptr) return {};
+    while (struct dirent* entry = readdir(dir)) {
+        string_view name(entry->d_name);
+        if (name.size() <= namePrefix.size() + 4 || name.compare(0, namePrefix.size(), namePrefix) != 0) continue;
+        string_view extension = name.substr(name.size() - 4);
+        bool archived = extension == ".col";
+        if (!archived && extension != ".log") continue;
+        string_view digits = name.substr(namePrefix.size(), name.size() - namePrefix.size() - 4);
+        uint64_t sequence = 0;
+        if (digits.empty() ||
+            from_chars(digits.data(), digits.data() + digits.size(), sequence).ptr != digits.data() + digits.size()) {
+            continue;
+        }
+        // Both exist only while an archive is replacing its text segment
+        JournalSegment& segment = found[sequence];
+        if (segment.path.empty() || archived) {
+            segment = JournalSegment{directory + string(name), sequence, archived};
+        }
+    }
+    closedir(dir);
+
+    vector<JournalSegment> segments;
+    for (auto& entry : found) {
+        segments.push_back(move(entry.second));
+    }
+    return segments;
+}
+
+static bool readWholeFile(const string& path, string& data) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        data.resize(size_t(st.st_size));
+        size_t done = 0;
+        while (ok && done < data.size()) {
+            ssize_t n = pread(fd, &data[done], data.size() - done, off_t(done));
+            if (n < 0 && errno == EINTR) continue;
+            ok = n > 0;
+            if (ok) done += size_t(n);
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+static bool writeFully(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= size_t(written);
+    }
+    return true;
+}
+
+static string formatSegmentSummary(const SegmentSummary& summary) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%s%llu records=%llu adjustments=%llu ids=%d..%d time=%lld..%lld methods=%x statuses=%x fnv=%016llx\n",
+             SegmentSummaryTag, (unsigned long long)summary.sequence, (unsigned long long)summary.records,
+             (unsigned long long)summary.adjustments, summary.minId, summary.maxId, (long long)summary.fromTime,
+             (long long)summary.toTime, summary.methods, summary.statuses, (unsigned long long)summary.checksum);
+    return line;
+}
+
+static bool parseSegmentSummary(string_view line, SegmentSummary& summary) {
+    if (line.compare(0, sizeof(SegmentSummaryTag) - 1, SegmentSummaryTag) != 0) return false;
+    string text(line);
+    unsigned long long sequence, records, adjustments = 0, checksum;
+    long long fromTime, toTime;
+    int consumed = 0;
+    // Segments sealed before adjustments existed have no count
+    if ((sscanf(text.c_str(),
+                "#SEGMENT %llu records=%llu adjustments=%llu ids=%d..%d time=%lld..%lld methods=%x statuses=%x fnv=%llx%n",
+                &sequence, &records, &adjustments, &summary.minId, &summary.maxId, &fromTime, &toTime,
+                &summary.methods, &summary.statuses, &checksum, &consumed) != 10 ||
+         size_t(consumed) != text.size()) &&
+        (sscanf(text.c_str(), "#SEGMENT %llu records=%llu ids=%d..%d time=%lld..%lld methods=%x statuses=%x fnv=%llx%n",
+                &sequence, &records, &summary.minId, &summary.maxId, &fromTime, &toTime,
+                &summary.methods, &summary.statuses, &checksum, &consumed) != 9 ||
+         size_t(consumed) != text.size())) {
+        return false;
+    }
+    summary.sequence = sequence;
+    summary.records = records;
+    summary.adjustments = adjustments;
+    summary.fromTime = fromTime;
+    summary.toTime = toTime;
+    summary.checksum = checksum;
+    return true;
+}
+
+// The summary line a sealed text segment ends with; bodySize is what precedes it
+static bool segmentTrailer(string_view data, SegmentSummary& summary, size_t& bodySize) {
+    bodySize = data.size();
+    if (data.size() < 2 || data.back() != '\n') return false;
+    size_t start = data.rfind('\n', data.size() - 2);
+    start = start == string_view::npos ? 0 : start + 1;
+    if (!parseSegmentSummary(data.substr(start, data.size() - 1 - start), summary)) return false;
+    bodySize = start;
+    return true;
+}
+
+// Returns how many lines did not parse. Adjustment lines are only read when
+// adjustments is given.
+static size_t parseSegmentLines(string_view body, vector<PaymentDetails>& records,
+                                vector<PaymentAdjustment>* adjustments) {
+    size_t unparsed = 0;
+    PaymentDetails payment;
+    PaymentAdjustment adjustment;
+    while (!body.empty()) {
+        size_t nl = body.find('\n');
+        string_view line = body.substr(0, nl);
+        body = nl == string_view::npos ? string_view() : body.substr(nl + 1);
+        if (line.empty() || line[0] == '#') continue;
+        if (line[0] == 'A') {
+            if (adjustments == nullptr) continue;
+            if (parseAdjustmentLine(line, adjustment)) {
+                adjustments->push_back(adjustment);
+                continue;
+            }
+        } else if (parseJournalLine(line, payment)) {
+            records.push_back(payment);
+            continue;
+        }
+        unparsed++;
+    }
+    return unparsed;
+}
+
+// Converts the integer fields between host and file order (its own inverse)
+static ArchiveHeader archiveByteOrder(ArchiveHeader header) {
+    header.version = toLittle32(header.version);
+    header.headerSize = toLittle32(header.headerSize);
+    header.sequence = toLittle64(header.sequence);
+    header.recordCount = toLittle64(header.recordCount);
+    header.minId = int32_t(toLittle32(uint32_t(header.minId)));
+    header.maxId = int32_t(toLittle32(uint32_t(header.maxId)));
+    header.fromTime = int64_t(toLittle64(uint64_t(header.fromTime)));
+    header.toTime = int64_t(toLittle64(uint64_t(header.toTime)));
+    header.methods = toLittle32(header.methods);
+    header.statuses = toLittle32(header.statuses);
+    header.timeUnit = toLittle64(header.timeUnit);
+    header.sourceChecksum = toLittle64(header.sourceChecksum);
+    for (size_t c = 0; c < ArchiveColumnCount; c++) {
+        header.columnOffset[c] = toLittle64(header.columnOffset[c]);
+        header.columnSize[c] = toLittle64(header.columnSize[c]);
+    }
+    header.adjustmentCount = toLittle64(header.adjustmentCount);
+    header.bodyChecksum = toLittle64(header.bodyChecksum);
+    header.headerChecksum = toLittle64(header.headerChecksum);
+    return header;
+}
+
+// FNV-1a over a stored header of size bytes with its checksum, the last field, zeroed
+static uint64_t archiveHeaderChecksum(const void* stored, size_t size) {
+    static const char zeros[sizeof(uint64_t)] = {0};
+    return fnv1a(zeros, sizeof(zeros), fnv1a(stored, size - sizeof(uint64_t)));
+}
+
+// The header in host order, if data starts with a readable header. A version 1
+// header is widened to the current layout with an empty adjustments column.
+static bool decodeArchiveHeader(const char* data, size_t size, ArchiveHeader& header) {
+    const size_t fixed = offsetof(ArchiveHeader, columnOffset);   // the same in both versions
+    if (size < ArchiveHeaderSizeV1 || memcmp(data, ArchiveMagic, sizeof(ArchiveMagic)) != 0) return false;
+    ArchiveHeader stored;
+    memset(&stored, 0, sizeof(stored));
+    memcpy(&stored, data, fixed);
+    uint32_t version = toLittle32(stored.version);
+    uint32_t headerSize = toLittle32(stored.headerSize);
+    if (version == ArchiveVersion && headerSize == sizeof(ArchiveHeader) && size >= headerSize) {
+        memcpy(&stored, data, sizeof(stored));
+    } else if (version == 1 && headerSize == ArchiveHeaderSizeV1) {
+        const size_t columns = ArchiveColumnCountV1 * sizeof(uint64_t);
+        memcpy(stored.columnOffset, data + fixed, columns);
+        memcpy(stored.columnSize, data + fixed + columns, columns);
+        memcpy(&stored.bodyChecksum, data + fixed + 2 * columns, sizeof(uint64_t));
+        memcpy(&stored.headerChecksum, data + fixed + 2 * columns + sizeof(uint64_t), sizeof(uint64_t));
+    } else {
+        return false;
+    }
+    header = archiveByteOrder(stored);
+    return header.headerChecksum == archiveHeaderChecksum(data, headerSize);
+}
+
+static SegmentSummary archiveSummary(const ArchiveHeader& header) {
+    SegmentSummary summary;
+    summary.sequence = header.sequence;
+    summary.records = header.recordCount;
+    summary.minId = header.minId;
+    summary.maxId = header.maxId;
+    summary.fromTime = header.fromTime;
+    summary.toTime = header.toTime;
+    summary.methods = header.methods;
+    summary.statuses = header.statuses;
+    summary.adjustments = header.adjustmentCount;
+    summary.checksum = header.sourceChecksum;
+    return summary;
+}
+
+static inline uint64_t zigzag(int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+static void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += char(uint8_t(value) | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+static bool getVarint(const char*& p, const char* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t byte = uint8_t(*p++);
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (byte < 0x80) return true;
+    }
+    return false;
+}
+
+static void putName(string& out, string_view name) {
+    out += char(uint8_t(name.size()));
+    out.append(name.data(), name.size());
+}
+
+static bool writeSegmentArchive(const string& path, const SegmentSummary& summary,
+                                const vector<PaymentDetails>& records,
+                                const vector<PaymentAdjustment>& adjustments) {
+    // Journal lines carry whole seconds; store them as seconds when they all are
+    uint64_t timeUnit = MicrosPerSecond;
+    for (const PaymentDetails& payment : records) {
+        if (payment.timestamp % MicrosPerSecond != 0) {
+            timeUnit = 1;
+            break;
+        }
+    }
+    for (const PaymentAdjustment& adjustment : adjustments) {
+        if (adjustment.timestamp % MicrosPerSecond != 0) {
+            timeUnit = 1;
+            break;
+        }
+    }
+
+    // Methods and statuses are coded in the order they first appear
+    string columns[ArchiveColumnCount];
+    uint8_t methodCodes[MethodCount];
+    uint8_t statusCodes[StatusCount];
+    memset(methodCodes, 0xFF, sizeof(methodCodes));
+    memset(statusCodes, 0xFF, sizeof(statusCodes));
+    string methodNames, statusNames;
+    uint8_t methodNameCount = 0, statusNameCount = 0;
+    auto statusCode = [&](PaymentStatus value) {
+        uint8_t& status = statusCodes[size_t(value)];
+        if (status == 0xFF) {
+            status = statusNameCount++;
+            putName(statusNames, statusName(value));
+        }
+        return char(status);
+    };
+    int64_t lastId = 0, lastTime = 0;
+    for (const PaymentDetails& payment : records) {
+        putVarint(columns[ArchiveIds], zigzag(int64_t(payment.paymentId) - lastId));
+        lastId = payment.paymentId;
+        int64_t time = payment.timestamp / int64_t(timeUnit);
+        putVarint(columns[ArchiveTimes], zigzag(time - lastTime));
+        lastTime = time;
+        putVarint(columns[ArchiveAmounts], zigzag(payment.amount.cents));
+
+        uint8_t& method = methodCodes[size_t(payment.paymentMethod)];
+        if (method == 0xFF) {
+            method = methodNameCount++;
+            putName(methodNames, methodName(payment.paymentMethod));
+        }
+        columns[ArchiveMethods] += char(method);
+        columns[ArchiveStatuses] += statusCode(payment.status);
+        putName(columns[ArchiveAuthCodes], payment.authorizationCode);
+    }
+    lastId = 0;
+    lastTime = 0;
+    for (const PaymentAdjustment& adjustment : adjustments) {
+        string& column = columns[ArchiveAdjustments];
+        putVarint(column, zigzag(int64_t(adjustment.paymentId) - lastId));
+        lastId = adjustment.paymentId;
+        int64_t time = adjustment.timestamp / int64_t(timeUnit);
+        putVarint(column, zigzag(time - lastTime));
+        lastTime = time;
+        column += char(adjustment.kind);
+        putVarint(column, zigzag(adjustment.amount.cents));
+        column += statusCode(adjustment.status);
+        putVarint(column, zigzag(adjustment.balance.cents));
+    }
+    columns[ArchiveDictionary] += char(methodNameCount);
+    columns[ArchiveDictionary] += methodNames;
+    columns[ArchiveDictionary] += char(statusNameCount);
+    columns[ArchiveDictionary] += statusNames;
+
+    ArchiveHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ArchiveMagic, sizeof(ArchiveMagic));
+    header.version = ArchiveVersion;
+    header.headerSize = sizeof(ArchiveHeader);
+    header.sequence = summary.sequence;
+    header.recordCount = records.size();
+    header.minId = summary.minId;
+    header.maxId = summary.maxId;
+    header.fromTime = summary.fromTime;
+    header.toTime = summary.toTime;
+    header.methods = summary.methods;
+    header.statuses = summary.statuses;
+    header.timeUnit = timeUnit;
+    header.sourceChecksum = summary.checksum;
+    header.adjustmentCount = adjustments.size();
+    string body;
+    for (size_t c = 0; c < ArchiveColumnCount; c++) {
+        header.columnOffset[c] = sizeof(ArchiveHeader) + body.size();
+        header.columnSize[c] = columns[c].size();
+        body += columns[c];
+        body.append((8 - body.size() % 8) % 8, '\0');
+    }
+    header.bodyChecksum = fnv1a(body.data(), body.size());
+    ArchiveHeader stored = archiveByteOrder(header);
+    stored.headerChecksum = toLittle64(archiveHeaderChecksum(&stored, sizeof(stored)));
+
+    // Replaces the text segment only once it is on disk
+    string tempPath = path + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool written = writeFully(fd, &stored, sizeof(stored)) && writeFully(fd, body.data(), body.size()) &&
+                   fsync(fd) == 0;
+    ::close(fd);
+    if (!written || rename(tempPath.c_str(), path.c_str()) != 0) {
+        unlink(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Adjustments are only decoded when adjustments is given
+static bool decodeSegmentArchive(const string& data, vector<PaymentDetails>& records,
+                                 vector<PaymentAdjustment>* adjustments) {
+    ArchiveHeader header;
+    if (!decodeArchiveHeader(data.data(), data.size(), header)) return false;
+    if (fnv1a(data.data() + header.headerSize, data.size() - header.headerSize) != header.bodyChecksum) return false;
+    if (header.timeUnit == 0) return false;
+
+    const char* at[ArchiveColumnCount];
+    const char* end[ArchiveColumnCount];
+    for (size_t c = 0; c < ArchiveColumnCount; c++) {
+        if (c >= ArchiveColumnCountV1 && header.version == 1) {
+            at[c] = end[c] = data.data();
+            continue;
+        }
+        if (header.columnOffset[c] < header.headerSize || header.columnOffset[c] > data.size() ||
+            header.columnSize[c] > data.size() - header.columnOffset[c]) {
+            return false;
+        }
+        at[c] = data.data() + header.columnOffset[c];
+        end[c] = at[c] + header.columnSize[c];
+    }
+
+    auto getName = [&](size_t c, string_view& name) {
+        if (at[c] >= end[c]) return false;
+        size_t length = uint8_t(*at[c]++);
+        if (size_t(end[c] - at[c]) < length) return false;
+        name = string_view(at[c], length);
+        at[c] += length;
+        return true;
+    };
+    auto getCode = [&](size_t c, size_t limit, size_t& code) {
+        if (at[c] >= end[c]) return false;
+        code = uint8_t(*at[c]++);
+        return code < limit;
+    };
+
+    vector<PaymentMethod> methods;
+    vector<PaymentStatus> statuses;
+    size_t count;
+    string_view name;
+    if (!getCode(ArchiveDictionary, 256, count)) return false;
+    for (size_t i = 0; i < count; i++) {
+        PaymentMethod method;
+        if (!getName(ArchiveDictionary, name) || !methodFromName(name, method)) return false;
+        methods.push_back(method);
+    }
+    if (!getCode(ArchiveDictionary, 256, count)) return false;
+    for (size_t i = 0; i < count; i++) {
+        PaymentStatus status;
+        if (!getName(ArchiveDictionary, name) || !statusFromName(name, status)) return false;
+        statuses.push_back(status);
+    }
+
+    records.reserve(records.size() + size_t(header.recordCount));
+    int64_t id = 0, time = 0;
+    PaymentDetails payment;
+    for (uint64_t i = 0; i < header.recordCount; i++) {
+        uint64_t idDelta, timeDelta, amount;
+        size_t method, status;
+        if (!getVarint(at[ArchiveIds], end[ArchiveIds], idDelta) ||
+            !getVarint(at[ArchiveTimes], end[ArchiveTimes], timeDelta) ||
+            !getVarint(at[ArchiveAmounts], end[ArchiveAmounts], amount) ||
+            !getCode(ArchiveMethods, methods.size(), method) || !getCode(ArchiveStatuses, statuses.size(), status) ||
+            !getName(ArchiveAuthCodes, name)) {
+            return false;
+        }
+        id += unzigzag(idDelta);
+        time += unzigzag(timeDelta);
+        payment.paymentId = int(id);
+        payment.paymentMethod = methods[method];
+        payment.amount = Money::fromCents(unzigzag(amount));
+        payment.timestamp = time * int64_t(header.timeUnit);
+        payment.status = statuses[status];
+        payment.authorizationCode = name;
+        records.push_back(payment);
+    }
+    if (adjustments == nullptr) return true;
+
+    adjustments->reserve(adjustments->size() + size_t(header.adjustmentCount));
+    id = 0;
+    time = 0;
+    PaymentAdjustment adjustment;
+    for (uint64_t i = 0; i < header.adjustmentCount; i++) {
+        uint64_t idDelta, timeDelta, amount, balance;
+        size_t kind, status;
+        if (!getVarint(at[ArchiveAdjustments], end[ArchiveAdjustments], idDelta) ||
+            !getVarint(at[ArchiveAdjustments], end[ArchiveAdjustments], timeDelta) ||
+            !getCode(ArchiveAdjustments, AdjustmentKindCount, kind) ||
+            !getVarint(at[ArchiveAdjustments], end[ArchiveAdjustments], amount) ||
+            !getCode(ArchiveAdjustments, statuses.size(), status) ||
+            !getVarint(at[ArchiveAdjustments], end[ArchiveAdjustments], balance)) {
+            return false;
+        }
+        id += unzigzag(idDelta);
+        time += unzigzag(timeDelta);
+        adjustment.paymentId = int(id);
+        adjustment.kind = AdjustmentKind(kind);
+        adjustment.amount = Money::fromCents(unzigzag(amount));
+        adjustment.timestamp = time * int64_t(header.timeUnit);
+        adjustment.status = statuses[status];
+        adjustment.balance = Money::fromCents(unzigzag(balance));
+        adjustments->push_back(adjustment);
+    }
+    return true;
+}
+
+bool readSegmentSummary(const JournalSegment& segment, SegmentSummary& summary) {
+    int fd = ::open(segment.path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool found = false;
+    if (segment.archived) {
+        char stored[sizeof(ArchiveHeader)];
+        ArchiveHeader header;
+        ssize_t n = pread(fd, stored, sizeof(stored), 0);
+        found = n > 0 && decodeArchiveHeader(stored, size_t(n), header);
+        if (found) summary = archiveSummary(header);
+    } else {
+        // Only the trailing summary line is read
+        struct stat st;
+        char tail[256];
+        if (fstat(fd, &st) == 0) {
+            size_t n = size_t(min<off_t>(st.st_size, off_t(sizeof(tail))));
+            size_t bodySize;
+            found = pread(fd, tail, n, st.st_size - off_t(n)) == ssize_t(n) &&
+                    segmentTrailer(string_view(tail, n), summary, bodySize);
+        }
+    }
+    ::close(fd);
+    return found;
+}
+
+bool loadJournalSegment(const JournalSegment& segment, vector<PaymentDetails>& records, string& error,
+                        vector<PaymentAdjustment>* adjustments) {
+    string data;
+    if (!readWholeFile(segment.path, data)) {
+        error = "cannot read " + segment.path;
+        return false;
+    }
+    if (segment.archived) {
+        if (!decodeSegmentArchive(data, records, adjustments)) {
+            error = segment.path + " is not a readable journal archive";
+            return false;
+        }
+        return true;
+    }
+    // Like the open journal, lines that do not parse are skipped
+    SegmentSummary summary;
+    size_t bodySize;
+    segmentTrailer(data, summary, bodySize);
+    parseSegmentLines(string_view(data.data(), bodySize), records, adjustments);
+    return true;
+}
+
+void compactJournalSegments(const string& journalPath, bool archive, const atomic<bool>& stop) {
+    for (const JournalSegment& segment : listJournalSegments(journalPath)) {
+        if (stop) return;
+        if (segment.archived) {
+            // Left behind when a crash came between the archive's rename and the unlink
+            string textPath = journalSegmentPath(journalPath, segment.sequence, ".log");
+            SegmentSummary summary;
+            if (access(textPath.c_str(), F_OK) == 0 && readSegmentSummary(segment, summary)) {
+                unlink(textPath.c_str());
+            }
+            continue;
+        }
+
+        string data;
+        if (!readWholeFile(segment.path, data)) continue;
+        SegmentSummary summary;
+        size_t bodySize;
+        bool summarized = segmentTrailer(data, summary, bodySize);
+        uint64_t checksum = fnv1a(data.data(), bodySize);
+        if (summarized && checksum != summary.checksum) {
+            cout << "WARNING: journal segment " << segment.path << " fails its checksum; not archived" << endl;
+            continue;
+        }
+        vector<PaymentDetails> records;
+        vector<PaymentAdjustment> adjustments;
+        size_t unparsed = parseSegmentLines(string_view(data.data(), bodySize), records, &adjustments);
+
+        if (!summarized) {
+            summary = SegmentSummary();
+            summary.sequence = segment.sequence;
+            for (const PaymentDetails& payment : records) {
+                summary.add(payment);
+            }
+            summary.adjustments = adjustments.size();
+            summary.checksum = checksum;
+            string line = formatSegmentSummary(summary);
+            int fd = ::open(segment.path.c_str(), O_WRONLY | O_APPEND);
+            bool written = fd >= 0 && writeFully(fd, line.data(), line.size()) && fdatasync(fd) == 0;
+            if (fd >= 0) ::close(fd);
+            if (!written) {
+                cout << "WARNING: cannot summarize journal segment " << segment.path << endl;
+                continue;
+            }
+        }
+        // An archive would lose lines that do not parse, so those segments stay text
+        if (!archive || unparsed > 0) continue;
+        if (!writeSegmentArchive(journalSegmentPath(journalPath, segment.sequence, ".col"), summary, records,
+                                 adjustments)) {
+            cout << "WARNING: cannot archive journal segment " << segment.path << endl;
+            continue;
+        }
+        unlink(segment.path.c_str());
+    }
+}
+
+// TransactionManager Implementation
+TransactionManager::TransactionManager(const JournalConfig& journalConfig)
+    : journal(make_shared<TransactionJournal>(journalConfig)) {
+    supportedMethods[0] = "Cash";
+    supportedMethods[1] = "Credit Card";
+    supportedMethods[2] = "Debit Card";
+    supportedMethods[3] = "Mobile Payment";
+}
+
+TransactionManager::TransactionManager(shared_ptr<TransactionJournal> sharedJournal) : journal(sharedJournal) {
+    supportedMethods[0] = "Cash";
+    supportedMethods[1] = "Credit Card";
+    supportedMethods[2] = "Debit Card";
+    supportedMethods[3] = "Mobile Payment";
+}
+
+TransactionManager::~TransactionManager() {
+    // Transaction records are owned by the store
+}
+
+void TransactionManager::addTransaction(PaymentDetails* transaction) {
+    if (transaction == nullptr) return;
+    uint64_t started = metricTicks();   // includes waiting for the lock
+    {
+        lock_guard<mutex> lock(managerMutex);
+
+        // Copy the record into the arena and index it
+        TransactionStore::Handle handle = transactionHistory.append(*transaction);
+        transactionIndex.insert(transactionHistory[handle], handle);
+
+        // Update payment statistics
+        updatePaymentStats(*transaction);
+    }
+
+    // Save to file outside the manager lock, so lanes sharing the journal are
+    // not queued behind one another's disk writes. A snapshot taken in between
+    // holds the record already; recovery drops the journal copy by ID and code.
+    uint64_t journalStarted = metricTicks();
+    saveTransactionsToFile(*transaction);
+    uint64_t journaled = metricTicks();
+    recordStage(MetricStage::Journal, transaction->paymentMethod, journaled - journalStarted);
+    recordStage(MetricStage::Record, transaction->paymentMethod, journaled - started);
+
+    // Log errors if payment failed
+    if (transaction->status == PaymentStatus::Failed) {
+        EventLogger::shared().paymentFailed(*transaction);
+        countOutcome(transaction->paymentMethod, transaction->outcome == GatewayOutcome::TimedOut ?
+                     MetricOutcome::TimedOut : MetricOutcome::Declined);
+    } else {
+        countOutcome(transaction->paymentMethod, MetricOutcome::Approved);
+    }
+}
+
+bool TransactionManager::adjustTransaction(int paymentId, AdjustmentKind kind, Money amount,
+                                           PaymentAdjustment& adjustment, string& error) {
+    // Nothing else changes a stored record, so the plan still holds when it is applied
+    lock_guard<mutex> adjusting(adjustMutex);
+    TransactionStore::Handle handle;
+    PaymentDetails* record;
+    {
+        lock_guard<mutex> lock(managerMutex);
+        record = lookup(paymentId, handle);
+        if (record == nullptr) {
+            error = "PAY-" + to_string(paymentId) + " not found";
+            return false;
+        }
+        if (!planAdjustment(*record, kind, amount, currentEpochMicros(), adjustment, error)) {
+            return false;
+        }
+    }
+
+    // Durable first, without holding up the lane's payments during the fsync
+    if (!journal->append(adjustment)) {
+        error = "the adjustment could not be journaled; PAY-" + to_string(paymentId) + " is unchanged";
+        return false;
+    }
+    lock_guard<mutex> lock(managerMutex);
+    applyAdjustment(*record, handle, adjustment);
+    return true;
+}
+
+// The adjustment carries the payment's resulting status and net amount, so
+// applying one the record already reflects changes nothing
+void TransactionManager::applyAdjustment(PaymentDetails& record, TransactionStore::Handle handle,
+                                         const PaymentAdjustment& adjustment) {
+    PaymentDetails before = record;
+    adjustment.applyTo(record);
+    // A recovered record's copy is in no index
+    if (handle != RecoveredHandle) {
+        if (before.status != record.status) {
+            transactionIndex.statusChanged(record, before.status, handle);
+        }
+        transactionHistory.repack(handle);
+    }
+    rollups.replace(before, record);
+}
+
+bool TransactionManager::restoreAdjustment(const PaymentAdjustment& adjustment) {
+    TransactionStore::Handle handle;
+    PaymentDetails* record = lookup(adjustment.paymentId, handle);
+    if (record == nullptr) return false;
+    applyAdjustment(*record, handle, adjustment);
+    return true;
+}
+
+// The store holds everything taken since recovery, so it wins over the snapshot
+PaymentDetails* TransactionManager::lookup(int paymentId, TransactionStore::Handle& handle) {
+    if (transactionIndex.findId(paymentId, handle)) {
+        return &transactionHistory[handle];
+    }
+    handle = RecoveredHandle;
+    const SnapshotRecord* rec = recovered ? recovered->findById(paymentId) : nullptr;
+    return rec != nullptr ? copyRecovered(*rec) : nullptr;
+}
+
+PaymentDetails TransactionManager::recoveredRecord(size_t i) const {
+    if (!recoveredCopies.empty()) {
+        auto copy = recoveredCopies.find(uint32_t(i));
+        if (copy != recoveredCopies.end()) return copy->second;
+    }
+    return recovered->toPaymentDetails(recovered->record(i));
+}
+
+PaymentDetails* TransactionManager::copyRecovered(const SnapshotRecord& rec) {
+    uint32_t record = uint32_t(&rec - &recovered->record(0));
+    auto copy = recoveredCopies.find(record);
+    if (copy == recoveredCopies.end()) {
+        copy = recoveredCopies.emplace(record, recovered->toPaymentDetails(rec)).first;
+    }
+    return &copy->second;
+}
+
+void TransactionManager::restoreTransaction(const PaymentDetails& transaction) {
+    // Rebuild in-memory state only; the record is already durable
+    TransactionStore::Handle handle = transactionHistory.append(transaction);
+    transactionIndex.insert(transactionHistory[handle], handle);
+    updatePaymentStats(transaction);
+}
+
+size_t TransactionManager::importTransactions(const vector<vector<PaymentDetails>>& batches,
+                                              const vector<vector<PaymentAdjustment>>& adjustments) {
+    lock_guard<mutex> lock(managerMutex);
+    size_t total = transactionHistory.size();
+    for (const vector<PaymentDetails>& batch : batches) total += batch.size();
+    transactionIndex.reserve(total);
+    for (const vector<PaymentDetails>& batch : batches) {
+        for (const PaymentDetails& transaction : batch) {
+            TransactionStore::Handle handle = transactionHistory.append(transaction);
+            transactionIndex.insertUnordered(transaction, handle);
+            updatePaymentStats(transaction);
+        }
+    }
+    transactionIndex.sortByTime();
+
+    // After every payment, since a refund may be in a later file than its payment
+    size_t orphaned = 0;
+    for (const vector<PaymentAdjustment>& batch : adjustments) {
+        for (const PaymentAdjustment& adjustment : batch) {
+            if (!restoreAdjustment(adjustment)) orphaned++;
+        }
+    }
+    return orphaned;
+}
+
+RecoveryResult TransactionManager::recover(const string& snapshotPath) {
+    auto started = chrono::steady_clock::now();
+    RecoveryResult result = {0, 0, 0, 0.0, 0, 0, 0};
+    lock_guard<mutex> lock(managerMutex);
+
+    // 1. Latest snapshot, if there is a usable one
+    uint64_t checkpoint = 0;
+    int watermark = 0;
+    // The records stay in the mapping; only the rollups read them all here
+    recovered.reset();
+    recoveredCopies.clear();
+    if (access(snapshotPath.c_str(), F_OK) == 0) {
+        try {
+            unique_ptr<SnapshotView> snapshot(new SnapshotView());
+            snapshot->open(snapshotPath);
+            for (size_t i = 0; i < snapshot->size(); i++) {
+                updatePaymentStats(snapshot->toPaymentDetails(snapshot->record(i)));
+            }
+            result.snapshotRecords = snapshot->size();
+            checkpoint = snapshot->journalOffset();
+            watermark = snapshot->maxPaymentId();
+            result.maxPaymentId = watermark;
+            recovered = move(snapshot);
+        }
+        catch (exception& e) {
+            cout << "WARNING: ignoring snapshot: " << e.what() << endl;
+        }
+    }
+
+    // 2. Sealed journal segments from the one open at the checkpoint on
+    // Without a usable checkpoint (older snapshot or replaced journal), records
+    // up to the snapshot's highest payment ID are already restored
+    const SnapshotView* known = recovered.get();
+    uint64_t openSequence = journal->openSequence();
+    bool useWatermark = known != nullptr &&
+                        (checkpoint == NoJournalCheckpoint || positionSegment(checkpoint) > openSequence);
+    for (const JournalSegment& segment : listJournalSegments(journal->path())) {
+        if (segment.sequence >= openSequence) break;
+        SegmentSummary summary;
+        // Adjustments may change records the snapshot holds, so those segments are read
+        if (useWatermark ? readSegmentSummary(segment, summary) && summary.maxId <= watermark &&
+                               summary.adjustments == 0
+                         : segment.sequence < positionSegment(checkpoint)) {
+            result.segmentsSkipped++;
+            continue;
+        }
+        vector<PaymentDetails> records;
+        vector<PaymentAdjustment> adjustments;
+        string error;
+        if (!loadJournalSegment(segment, records, error, &adjustments)) {
+            cout << "WARNING: skipping journal segment: " << error << endl;
+            continue;
+        }
+        for (const PaymentDetails& record : records) {
+            if (useWatermark && record.paymentId <= watermark) continue;
+            // Journaled while the snapshot was being written and already in it
+            const SnapshotRecord* held = known != nullptr ? known->findById(record.paymentId) : nullptr;
+            if (held == nullptr || known->text(held->authRef) != record.authorizationCode) {
+                restoreTransaction(record);
+                result.journalRecords++;
+                result.maxPaymentId = max(result.maxPaymentId, record.paymentId);
+            }
+        }
+        for (const PaymentAdjustment& adjustment : adjustments) {
+            if (restoreAdjustment(adjustment)) result.adjustments++;
+        }
+        result.segmentsRead++;
+    }
+
+    // 3. The open segment after the checkpoint; all of it if the checkpoint is in a sealed one
+    uint64_t tailStart = 0;
+    if (useWatermark) {
+        tailStart = NoJournalCheckpoint;
+    } else if (positionSegment(checkpoint) == openSequence) {
+        tailStart = positionOffset(checkpoint);
+    }
+    replayJournalTail(tailStart, watermark, known, result);
+
+    result.elapsedMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    return result;
+}
+
+void TransactionManager::replayJournalTail(uint64_t checkpoint, int watermark, const SnapshotView* snapshot,
+                                           RecoveryResult& result) {
+    int fd = ::open(journal->path().c_str(), O_RDWR);
+    if (fd < 0) return;
+
+    const size_t BlockSize = 64 * 1024;
+    vector<char> block(BlockSize);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return;
+    }
+    uint64_t end = uint64_t(st.st_size);
+
+    // Drop a torn last record left by a crash in the middle of a write
+    uint64_t complete = end;
+    while (complete > 0) {
+        size_t n = size_t(min<uint64_t>(BlockSize, complete));
+        if (pread(fd, block.data(), n, off_t(complete - n)) != ssize_t(n)) break;
+        size_t i = n;
+        while (i > 0 && block[i - 1] != '\n') i--;
+        if (i > 0) {
+            complete -= n - i;
+            break;
+        }
+        complete -= n;
+    }
+    // Only the bytes after the last newline are torn. They may still be a whole
+    // record that lost just its newline; that one is kept and terminated.
+    if (complete < end) {
+        string last(size_t(min<uint64_t>(end - complete, BlockSize)), '\0');
+        bool whole = end - complete < BlockSize &&
+                     pread(fd, &last[0], last.size(), off_t(complete)) == ssize_t(last.size()) &&
+                     completeJournalLine(last);
+        if (whole && pwrite(fd, "\n", 1, off_t(end)) == 1) {
+            cout << "WARNING: journal ended without a newline; kept its last record" << endl;
+            end++;
+        } else {
+            cout << "WARNING: discarding " << (end - complete) << " bytes of incomplete journal record" << endl;
+            if (ftruncate(fd, off_t(complete)) != 0) {
+                cout << "WARNING: could not truncate journal" << endl;
+            }
+            end = complete;
+        }
+    }
+
+    // Without a usable checkpoint (older snapshot or replaced journal), stop at the
+    // first record the snapshot already holds
+    bool useWatermark = checkpoint > end;
+    uint64_t stop = useWatermark ? 0 : checkpoint;
+
+    // Reverse-scan from the end so the cost is proportional to the tail.
+    // Adjustments never stop the scan; their resulting state is safe to reapply.
+    vector<PaymentDetails> tail;
+    vector<PaymentAdjustment> adjustments;
+    string carry;
+    uint64_t pos = end;
+    bool done = false;
+    PaymentDetails parsed;
+    PaymentAdjustment adjustment;
+    while (pos > stop && !done) {
+        size_t n = size_t(min<uint64_t>(BlockSize, pos - stop));
+        pos -= n;
+        if (pread(fd, block.data(), n, off_t(pos)) != ssize_t(n)) break;
+        string data(block.data(), n);
+        data += carry;
+        carry.clear();
+
+        size_t lineEnd = data.size();  // one past the newline ending the current line
+        while (lineEnd > 0 && !done) {
+            size_t nl = lineEnd >= 2 ? data.rfind('\n', lineEnd - 2) : string::npos;
+            if (nl == string::npos && pos > stop) {
+                carry = data.substr(0, lineEnd);  // line continues in the previous block
+                break;
+            }
+            size_t lineStart = (nl == string::npos) ? 0 : nl + 1;
+            string_view line(data.data() + lineStart, lineEnd - 1 - lineStart);
+            if (parseAdjustmentLine(line, adjustment)) {
+                adjustments.push_back(adjustment);
+            } else if (parseJournalLine(line, parsed)) {
+                if (useWatermark && parsed.paymentId <= watermark) {
+                    done = true;
+                    break;
+                }
+                // Journaled while the snapshot was being written and already in it
+                const SnapshotRecord* known = snapshot != nullptr ? snapshot->findById(parsed.paymentId) : nullptr;
+                if (known == nullptr || snapshot->text(known->authRef) != parsed.authorizationCode) {
+                    tail.push_back(parsed);
+                }
+            }
+            lineEnd = lineStart;
+        }
+    }
+    ::close(fd);
+
+    // Apply in journal order, payments first since an adjustment may name any of them
+    for (auto it = tail.rbegin(); it != tail.rend(); ++it) {
+        restoreTransaction(*it);
+        if (it->paymentId > result.maxPaymentId) {
+            result.maxPaymentId = it->paymentId;
+        }
+    }
+    result.journalRecords += tail.size();
+    for (auto it = adjustments.rbegin(); it != adjustments.rend(); ++it) {
+        if (restoreAdjustment(*it)) result.adjustments++;
+    }
+}
+
+void TransactionManager::updatePaymentStats(const PaymentDetails& transaction) {
+    rollups.add(transaction);
+}
+
+PaymentDetails* TransactionManager::findTransactionById(int paymentId) {
+    lock_guard<mutex> lock(managerMutex);
+    TransactionStore::Handle handle;
+    return lookup(paymentId, handle);
+}
+
+// The recovered records have no indexes; matching ones are copied out
+vector<PaymentDetails*> TransactionManager::findTransactionsByMethod(PaymentMethod method) {
+    lock_guard<mutex> lock(managerMutex);
+    vector<PaymentDetails*> result;
+    for (size_t i = 0; i < recoveredCount(); i++) {
+        if (recoveredRecord(i).paymentMethod == method) result.push_back(copyRecovered(recovered->record(i)));
+    }
+    for (TransactionStore::Handle handle : transactionIndex.withMethod(method)) {
+        result.push_back(&transactionHistory[handle]);
+    }
+    return result;
+}
+
+vector<PaymentDetails*> TransactionManager::findTransactionsByStatus(PaymentStatus status) {
+    lock_guard<mutex> lock(managerMutex);
+    vector<PaymentDetails*> result;
+    for (size_t i = 0; i < recoveredCount(); i++) {
+        if (recoveredRecord(i).status == status) result.push_back(copyRecovered(recovered->record(i)));
+    }
+    for (TransactionStore::Handle handle : transactionIndex.withStatus(status)) {
+        if (transactionHistory[handle].status == status) result.push_back(&transactionHistory[handle]);
+    }
+    return result;
+}
+
+vector<PaymentDetails*> TransactionManager::findTransactionsInTimeRange(time_t from, time_t to) {
+    lock_guard<mutex> lock(managerMutex);
+    vector<PaymentDetails*> result;
+    // Whole seconds: "to" covers every microsecond of its last second
+    EpochMicros first = epochMicros(from);
+    EpochMicros last = epochMicros(to + 1) - 1;
+    for (size_t i = 0; i < recoveredCount(); i++) {
+        EpochMicros when = recoveredRecord(i).timestamp;
+        if (when >= first && when <= last) result.push_back(copyRecovered(recovered->record(i)));
+    }
+    for (TransactionStore::Handle handle : transactionIndex.inTimeRange(first, last)) {
+        result.push_back(&transactionHistory[handle]);
+    }
+    return result;
+}
+
+void TransactionManager::saveTransactionsToFile(const PaymentDetails& transaction) {
+    // Called from addTransaction after the record is stored, without the manager lock.
+    // Declines are journaled too: every issued payment ID must survive a crash,
+    // or recovery would hand it out again. The journal decides when to hit the disk.
+    journal->append(transaction);
+}
+
+void TransactionManager::logError(string errorMessage) {
+    // Queued for the background writer; lanes share the log
+    EventLogger::shared().message(errorMessage);
+}
+
+void TransactionManager::saveBinaryBackup() {
+    try {
+        // Checkpoint first: a record journaled meanwhile is replayed or deduplicated, never lost
+        const TerminalIdentity& terminal = TerminalIdentity::local();
+        SnapshotWriter writer("daily_summary.dat", terminal.storeId, terminal.terminalId);
+        writer.setJournalOffset(journal->checkpoint());
+        writeSnapshot(writer);
+        writer.finish();
+    }
+    catch (exception& e) {
+        cout << "Error creating binary backup: " << e.what() << endl;
+        logError(string("Binary backup failed: ") + e.what());
+        return;
+    }
+    cout << "Binary backup saved successfully!" << endl;
+}
+
+// End of day: seal the journal segment, then snapshot the day so recovery
+// starts after the sealed segment
+void TransactionManager::closeBatch() {
+    uint64_t sequence = journal->openSequence();
+    if (journal->seal()) {
+        cout << "Batch closed: journal segment " << sequence << " sealed" << endl;
+    } else {
+        cout << "Batch closed: nothing journaled since the last close" << endl;
+    }
+    saveBinaryBackup();
+}
+
+void TransactionManager::writeSnapshot(SnapshotWriter& writer) const {
+    lock_guard<mutex> lock(managerMutex);
+    forEachRecord([&writer](const PaymentDetails& payment) { writer.add(payment); });
+}
+
+void TransactionManager::collectHistory(vector<PaymentDetails>& records) const {
+    // Copies: recovered records exist only in the mapping
+    lock_guard<mutex> lock(managerMutex);
+    forEachRecord([&records](const PaymentDetails& payment) { records.push_back(payment); });
+}
+
+void TransactionManager::printHistoryLine(size_t line, const PaymentDetails& transaction) {
+    cout << line << ". PAY-" << transaction.paymentId << " | "
+         << methodName(transaction.paymentMethod) << " | $"
+         << transaction.amount;
+    // The sale amount stays; partial refunds and captures show what is left of it
+    if (transaction.status == PaymentStatus::Completed && transaction.adjusted.cents != 0) {
+        cout << " (net $" << transaction.net() << ")";
+    }
+    cout << " | " << statusName(transaction.status) << endl;
+}
+
+void TransactionManager::displayTransactionHistory() {
+    lock_guard<mutex> lock(managerMutex);
+    cout << "===   TRANSACTION HISTORY           ===" << endl;
+
+    size_t records = recoveredCount() + transactionHistory.size();
+    if (records == 0) {
+        cout << "No transactions yet." << endl;
+        cout << "========================================\n" << endl;
+        return;
+    }
+
+    size_t line = 0;
+    forEachRecord([&line](const PaymentDetails& payment) { printHistoryLine(++line, payment); });
+
+    // The listing already reads every record, so the totals are recounted
+    // rather than taken from the rollups
+    ReportTotals totals;
+    totals.add(aggregateLocked());
+    cout << "----------------------------------------" << endl;
+    cout << "Total Completed: $" << totals.revenue << endl;
+    cout << "Success Rate: " << fixed << setprecision(2) << (totals.successful * 100.0 / records) << "%" << endl;
+
+    // Display payment method statistics
+    printMethodStats(totals);
+
+    cout << "========================================\n" << endl;
+}
+
+void TransactionManager::printMethodStats(const ReportTotals& totals) {
+    cout << "\nPayment Method Statistics:" << endl;
+    for (size_t m = 0; m < MethodCount; m++) {
+        if (totals.methodCounts[m] > 0) {
+            cout << "  " << methodName(PaymentMethod(m)) << ": $" << totals.methodStats[m] << endl;
+        }
+    }
+}
+
+void ReportTotals::add(const RollupBucket& bucket) {
+    transactions += size_t(bucket.transactions());
+    for (size_t m = 0; m < MethodCount; m++) {
+        const RollupCell& completed = bucket.cell(PaymentMethod(m), PaymentStatus::Completed);
+        successful += size_t(completed.count);
+        revenue += completed.sum();
+        methodStats[m] += completed.sum();
+        methodCounts[m] += size_t(completed.count);
+        refunded += size_t(bucket.cell(PaymentMethod(m), PaymentStatus::Refunded).count);
+        voided += size_t(bucket.cell(PaymentMethod(m), PaymentStatus::Voided).count);
+        authorized += size_t(bucket.cell(PaymentMethod(m), PaymentStatus::Authorized).count);
+    }
+}
+
+void ReportTotals::add(const MethodStatusTotals& aggregate) {
+    for (size_t m = 0; m < MethodCount; m++) {
+        PaymentMethod method = PaymentMethod(m);
+        for (size_t st = 0; st < StatusCount; st++) {
+            transactions += size_t(aggregate.count(method, PaymentStatus(st)));
+        }
+        successful += size_t(aggregate.count(method, PaymentStatus::Completed));
+        revenue += aggregate.amount(method, PaymentStatus::Completed);
+        methodStats[m] += aggregate.amount(method, PaymentStatus::Completed);
+        methodCounts[m] += size_t(aggregate.count(method, PaymentStatus::Completed));
+        refunded += size_t(aggregate.count(method, PaymentStatus::Refunded));
+        voided += size_t(aggregate.count(method, PaymentStatus::Voided));
+        authorized += size_t(aggregate.count(method, PaymentStatus::Authorized));
+    }
+}
+
+void ReportTotals::merge(const ReportTotals& other) {
+    transactions += other.transactions;
+    successful += other.successful;
+    refunded += other.refunded;
+    voided += other.voided;
+    authorized += other.authorized;
+    revenue += other.revenue;
+    for (size_t m = 0; m < MethodCount; m++) {
+        methodStats[m] += other.methodStats[m];
+        methodCounts[m] += other.methodCounts[m];
+    }
+}
+
+ReportTotals TransactionManager::reportTotals() const {
+    lock_guard<mutex> lock(managerMutex);
+    ReportTotals totals;
+    totals.add(rollups.total());
+    return totals;
+}
+
+ReportTotals TransactionManager::recountTotals() const {
+    lock_guard<mutex> lock(managerMutex);
+    ReportTotals totals;
+    totals.add(aggregateLocked());
+    return totals;
+}
+
+MethodStatusTotals TransactionManager::aggregateLocked() const {
+    // The store from its packed columns, the recovered records from the mapping
+    MethodStatusTotals totals = transactionHistory.aggregate();
+    for (size_t i = 0; i < recoveredCount(); i++) {
+        PaymentDetails payment = recoveredRecord(i);
+        size_t key = MethodStatusTotals::key(payment.paymentMethod, payment.status);
+        totals.cents[key] += payment.net().cents;
+        totals.counts[key]++;
+    }
+    return totals;
+}
+
+ReportTotals TransactionManager::shiftTotals(time_t from, time_t to) const {
+    lock_guard<mutex> lock(managerMutex);
+    ReportTotals totals;
+    totals.add(rollups.range(from, to));
+    return totals;
+}
+
+QueryResult TransactionManager::runQuery(const TransactionQuery& query) const {
+    lock_guard<mutex> lock(managerMutex);
+    QueryResult result;
+
+    // Without amount or time filters the rollups already hold the answer
+    if (!query.filtersAmount() && !query.filtersTime() && query.groupBy != QueryGroup::Hour) {
+        result.plan = "rollups";
+        rollups.refreshBounds([this](auto visit) { forEachRecord(visit); });
+        const RollupBucket& all = rollups.total();
+        for (size_t m = 0; m < MethodCount; m++) {
+            for (size_t st = 0; st < StatusCount; st++) {
+                const RollupCell& cell = all.cells[m][st];
+                if (!(query.methods >> m & 1) || !(query.statuses >> st & 1) || cell.count == 0) continue;
+                int64_t key = query.groupBy == QueryGroup::Method ? int64_t(m) :
+                              query.groupBy == QueryGroup::Status ? int64_t(st) : 0;
+                result.groups[key].merge(cell);
+            }
+        }
+        return result;
+    }
+
+    // Otherwise read the fewest records: the time range, the chosen methods or
+    // statuses from their indexes, or the whole store
+    size_t total = transactionHistory.size();
+    size_t inTime = total;
+    pair<size_t, size_t> span(0, total);
+    if (query.filtersTime()) {
+        span = transactionIndex.timeSpan(query.from, query.to);
+        inTime = span.second - span.first;
+    }
+    size_t withMethods = 0;
+    for (size_t m = 0; m < MethodCount; m++) {
+        if (query.methods >> m & 1) withMethods += transactionIndex.withMethod(PaymentMethod(m)).size();
+    }
+    size_t withStatuses = 0;
+    for (size_t st = 0; st < StatusCount; st++) {
+        if (query.statuses >> st & 1) withStatuses += transactionIndex.withStatus(PaymentStatus(st)).size();
+    }
+
+    const TransactionStore& store = transactionHistory;
+    const TransactionIndex& index = transactionIndex;
+    bool snapshot = recoveredCount() > 0;
+    if (inTime < total && inTime <= withMethods && inTime <= withStatuses) {
+        result.plan = snapshot ? "time index + snapshot scan" : "time index";
+        size_t first = span.first;
+        scanQuery(inTime, [&store, &index, first](QueryAccumulator& groups, size_t i) {
+            groups.add(store[index.inTimeOrder(first + i)]);
+        }, query, result);
+    } else if (withMethods < total && withMethods <= withStatuses) {
+        result.plan = snapshot ? "method index + snapshot scan" : "method index";
+        for (size_t m = 0; m < MethodCount; m++) {
+            if (!(query.methods >> m & 1)) continue;
+            const vector<TransactionStore::Handle>& handles = index.withMethod(PaymentMethod(m));
+            scanQuery(handles.size(), [&store, &handles](QueryAccumulator& groups, size_t i) {
+                groups.add(store[handles[i]]);
+            }, query, result);
+        }
+    } else if (withStatuses < total) {
+        result.plan = snapshot ? "status index + snapshot scan" : "status index";
+        for (size_t st = 0; st < StatusCount; st++) {
+            if (!(query.statuses >> st & 1)) continue;
+            // A refunded or voided record is also still in the completed list; count it once
+            TransactionQuery listed = query;
+            listed.statuses = 1u << st;
+            const vector<TransactionStore::Handle>& handles = index.withStatus(PaymentStatus(st));
+            scanQuery(handles.size(), [&store, &handles](QueryAccumulator& groups, size_t i) {
+                groups.add(store[handles[i]]);
+            }, listed, result);
+        }
+    } else {
+        result.plan = snapshot ? "full scan + snapshot scan" : "full scan";
+        scanQuery(total, [&store](QueryAccumulator& groups, size_t i) {
+            groups.add(store[TransactionStore::Handle(i)]);
+        }, query, result);
+    }
+
+    // The recovered records have no indexes and are read from the mapping
+    if (snapshot) {
+        scanQuery(recoveredCount(), [this](QueryAccumulator& groups, size_t i) {
+            groups.add(recoveredRecord(i));
+        }, query, result);
+    }
+    return result;
+}
+
+void TransactionManager::collectHourly(map<time_t, RollupBucket>& hours) const {
+    lock_guard<mutex> lock(managerMutex);
+    rollups.refreshBounds([this](auto visit) { forEachRecord(visit); });
+    for (const auto& bucket : rollups.hourly()) {
+        hours[bucket.first].merge(bucket.second);
+    }
+}
+
+void TransactionManager::printDailyReport(const ReportTotals& totals) {
+    cout << "\n========================================" << endl;
+    cout << "===      DAILY REPORT               ===" << endl;
+    cout << "========================================" << endl;
+    cout << "Total Transactions: " << totals.transactions << endl;
+    cout << "Successful Transactions: " << totals.successful << endl;
+    if (totals.refunded > 0) cout << "Refunded Transactions: " << totals.refunded << endl;
+    if (totals.voided > 0) cout << "Voided Transactions: " << totals.voided << endl;
+    if (totals.authorized > 0) cout << "Awaiting Capture: " << totals.authorized << endl;
+    cout << "Total Revenue: $" << totals.revenue << endl;
+    cout << "Success Rate: " << fixed << setprecision(2) << (totals.transactions > 0 ? (totals.successful * 100.0 / totals.transactions) : 0) << "%" << endl;
+    cout << "========================================\n" << endl;
+}
+
+void TransactionManager::printShiftReport(time_t from, time_t to, const ReportTotals& totals) {
+    cout << "\n========================================" << endl;
+    cout << "===      SHIFT REPORT               ===" << endl;
+    cout << "========================================" << endl;
+    cout << "From: " << formatTransactionTime(from) << endl;
+    cout << "To:   " << formatTransactionTime(to) << endl;
+    cout << "Total Transactions: " << totals.transactions << endl;
+    cout << "Successful Transactions: " << totals.successful << endl;
+    if (totals.refunded > 0) cout << "Refunded Transactions: " << totals.refunded << endl;
+    if (totals.voided > 0) cout << "Voided Transactions: " << totals.voided << endl;
+    if (totals.authorized > 0) cout << "Awaiting Capture: " << totals.authorized << endl;
+    cout << "Total Revenue: $" << totals.revenue << endl;
+    cout << "Success Rate: " << fixed << setprecision(2) << (totals.transactions > 0 ? (totals.successful * 100.0 / totals.transactions) : 0) << "%" << endl;
+    printMethodStats(totals);
+    cout << "========================================\n" << endl;
+}
+
+void TransactionManager::printHourlyReport(const map<time_t, RollupBucket>& hours) {
+    cout << "\n========================================" << endl;
+    cout << "===      HOURLY REPORT              ===" << endl;
+    cout << "========================================" << endl;
+    if (hours.empty()) {
+        cout << "No transactions yet." << endl;
+        cout << "========================================\n" << endl;
+        return;
+    }
+    cout << left << setw(18) << "Hour" << right << setw(8) << "Count" << setw(8) << "Done"
+         << setw(13) << "Revenue" << setw(10) << "Min" << setw(10) << "Max" << endl;
+    for (const auto& bucket : hours) {
+        char label[32];
+        struct tm parts;
+        localtime_r(&bucket.first, &parts);
+        strftime(label, sizeof(label), "%Y-%m-%d %H:%M", &parts);
+        RollupCell completed = bucket.second.withStatus(PaymentStatus::Completed);
+        cout << left << setw(18) << label << right << setw(8) << bucket.second.transactions()
+             << setw(8) << completed.count << setw(13) << formatMoney(completed.sum())
+             << setw(10) << formatMoney(completed.min()) << setw(10) << formatMoney(completed.max()) << endl;
+    }
+    cout << "========================================\n" << endl;
+}
+
+void TransactionManager::printQueryReport(const TransactionQuery& query, const QueryResult& result, double elapsedMs) {
+    cout << "\n========================================" << endl;
+    cout << "===      QUERY RESULT               ===" << endl;
+    cout << "========================================" << endl;
+    if (query.from != INT64_MIN) cout << "From: " << transactionTimeText(query.from) << endl;
+    if (query.to != INT64_MAX) cout << "To:   " << transactionTimeText(query.to) << endl;
+    cout << "Plan: " << (result.plan != nullptr ? result.plan : "none");
+    if (result.threads > 0) {
+        cout << ", " << result.scanned << " records read by " << result.threads
+             << (result.threads == 1 ? " thread" : " threads");
+    }
+    cout << " in " << fixed << setprecision(2) << elapsedMs << " ms" << endl;
+    if (result.groups.empty()) {
+        cout << "No matching transactions." << endl;
+        cout << "========================================\n" << endl;
+        return;
+    }
+
+    cout << left << setw(20) << "Group" << right << setw(8) << "Count" << setw(13) << "Sum"
+         << setw(10) << "Avg" << setw(10) << "Min" << setw(10) << "Max" << endl;
+    auto printRow = [](const string& label, const RollupCell& cell) {
+        Money average = Money::fromCents(llround(double(cell.sumCents) / double(cell.count)));
+        cout << left << setw(20) << label << right << setw(8) << cell.count << setw(13) << formatMoney(cell.sum())
+             << setw(10) << formatMoney(average) << setw(10) << formatMoney(cell.min())
+             << setw(10) << formatMoney(cell.max()) << endl;
+    };
+    RollupCell total;
+    for (const auto& group : result.groups) {
+        string label;
+        switch (query.groupBy) {
+            case QueryGroup::Method: label = methodName(PaymentMethod(group.first)); break;
+            case QueryGroup::Status: label = statusName(PaymentStatus(group.first)); break;
+            case QueryGroup::Hour: {
+                char text[32];
+                struct tm parts;
+                time_t start = time_t(group.first);
+                localtime_r(&start, &parts);
+                strftime(text, sizeof(text), "%Y-%m-%d %H:%M", &parts);
+                label = text;
+                break;
+            }
+            default: label = "All"; break;
+        }
+        printRow(label, group.second);
+        total.merge(group.second);
+    }
+    if (result.groups.size() > 1) {
+        cout << "----------------------------------------" << endl;
+        printRow("Total", total);
+    }
+    cout << "========================================\n" << endl;
+}
+
+void TransactionManager::generateDailyReport() {
+    printDailyReport(reportTotals());
+}
+
+void TransactionManager::generateHourlyReport() {
+    map<time_t, RollupBucket> hours;
+    collectHourly(hours);
+    printHourlyReport(hours);
+}
+
+void TransactionManager::generateShiftReport(time_t from, time_t to) {
+    printShiftReport(from, to, shiftTotals(from, to));
+}
+
+void TransactionManager::generateQueryReport(const TransactionQuery& query) {
+    auto started = chrono::steady_clock::now();
+    QueryResult result = runQuery(query);
+    printQueryReport(query, result, chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+}
+
+// ShardedTransactionManager Implementation
+ShardedTransactionManager::ShardedTransactionManager(size_t lanes, const JournalConfig& journalConfig)
+    : journal(make_shared<TransactionJournal>(journalConfig)) {
+    if (lanes == 0) lanes = 1;
+    for (size_t i = 0; i < lanes; i++) {
+        shards.push_back(unique_ptr<TransactionManager>(new TransactionManager(journal)));
+    }
+}
+
+RecoveryResult ShardedTransactionManager::recover(const string& snapshotPath) {
+    // Earlier runs are restored into the first lane
+    return shards[0]->recover(snapshotPath);
+}
+
+PaymentDetails* ShardedTransactionManager::findTransactionById(int paymentId) {
+    for (auto& shard : shards) {
+        PaymentDetails* found = shard->findTransactionById(paymentId);
+        if (found != nullptr) return found;
+    }
+    return nullptr;
+}
+
+bool ShardedTransactionManager::adjustTransaction(int paymentId, AdjustmentKind kind, Money amount,
+                                                  PaymentAdjustment& adjustment, string& error) {
+    // The lane that took the payment owns it
+    for (auto& shard : shards) {
+        if (shard->findTransactionById(paymentId) != nullptr) {
+            return shard->adjustTransaction(paymentId, kind, amount, adjustment, error);
+        }
+    }
+    error = "PAY-" + to_string(paymentId) + " not found";
+    return false;
+}
+
+void ShardedTransactionManager::generateDailyReport() {
+    ReportTotals totals;
+    for (auto& shard : shards) {
+        totals.merge(shard->reportTotals());
+    }
+    TransactionManager::printDailyReport(totals);
+}
+
+void ShardedTransactionManager::generateHourlyReport() {
+    map<time_t, RollupBucket> hours;
+    for (auto& shard : shards) {
+        shard->collectHourly(hours);
+    }
+    TransactionManager::printHourlyReport(hours);
+}
+
+void ShardedTransactionManager::generateShiftReport(time_t from, time_t to) {
+    ReportTotals totals;
+    for (auto& shard : shards) {
+        totals.merge(shard->shiftTotals(from, to));
+    }
+    TransactionManager::printShiftReport(from, to, totals);
+}
+
+void ShardedTransactionManager::generateQueryReport(const TransactionQuery& query) {
+    auto started = chrono::steady_clock::now();
+    QueryResult result;
+    for (auto& shard : shards) {
+        result.merge(shard->runQuery(query));
+    }
+    TransactionManager::printQueryReport(query, result,
+                                         chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+}
+
+void ShardedTransactionManager::displayTransactionHistory() {
+    vector<PaymentDetails> records;
+    ReportTotals totals;
+    for (auto& shard : shards) {
+        shard->collectHistory(records);
+        totals.merge(shard->reportTotals());
+    }
+    // Interleave the lanes in payment order
+    stable_sort(records.begin(), records.end(), [](const PaymentDetails& a, const PaymentDetails& b) {
+        return a.paymentId < b.paymentId;
+    });
+
+    cout << "===   TRANSACTION HISTORY           ===" << endl;
+    if (records.empty()) {
+        cout << "No transactions yet." << endl;
+        cout << "========================================\n" << endl;
+        return;
+    }
+    for (size_t i = 0; i < records.size(); i++) {
+        TransactionManager::printHistoryLine(i + 1, records[i]);
+    }
+    cout << "----------------------------------------" << endl;
+    cout << "Total Completed: $" << totals.revenue << endl;
+    cout << "Success Rate: " << fixed << setprecision(2) << (records.size() > 0 ? (totals.successful * 100.0 / records.size()) : 0) << "%" << endl;
+    TransactionManager::printMethodStats(totals);
+    cout << "========================================\n" << endl;
+}
+
+void ShardedTransactionManager::saveBinaryBackup() {
+    try {
+        // Lanes keep taking payments; anything journaled after the checkpoint is replayed
+        const TerminalIdentity& terminal = TerminalIdentity::local();
+        SnapshotWriter writer("daily_summary.dat", terminal.storeId, terminal.terminalId);
+        writer.setJournalOffset(journal->checkpoint());
+        for (auto& shard : shards) {
+            shard->writeSnapshot(writer);
+        }
+        writer.finish();
+    }
+    catch (exception& e) {
+        cout << "Error creating binary backup: " << e.what() << endl;
+        shards[0]->logError(string("Binary backup failed: ") + e.what());
+        return;
+    }
+    cout << "Binary backup saved successfully!" << endl;
+}
+
+void ShardedTransactionManager::closeBatch() {
+    uint64_t sequence = journal->openSequence();
+    if (journal->seal()) {
+        cout << "Batch closed: journal segment " << sequence << " sealed" << endl;
+    } else {
+        cout << "Batch closed: nothing journaled since the last close" << endl;
+    }
+    saveBinaryBackup();
+}
+
+// JournalImporter Implementation
+JournalImporter::JournalImporter(size_t threads, const string& rejectFile)
+    : threadCount(threads > 0 ? threads : max(1u, thread::hardware_concurrency())), rejectPath(rejectFile) {
+}
+
+JournalImporter::~JournalImporter() {
+    unmapAll();
+}
+
+void JournalImporter::map(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Cannot open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw runtime_error("Cannot read " + path);
+    }
+    MappedJournal journal = {path, nullptr, size_t(st.st_size)};
+    if (journal.size > 0) {
+        void* mapped = mmap(nullptr, journal.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            throw runtime_error("Cannot map " + path);
+        }
+        madvise(mapped, journal.size, MADV_SEQUENTIAL);
+        journal.data = static_cast<const char*>(mapped);
+    }
+    ::close(fd);   // the mapping stays valid
+    journals.push_back(journal);
+}
+
+void JournalImporter::unmapAll() {
+    slices.clear();   // rejects point into the mappings
+    for (MappedJournal& journal : journals) {
+        if (journal.data != nullptr) {
+            munmap(const_cast<char*>(journal.data), journal.size);
+        }
+    }
+    journals.clear();
+}
+
+void JournalImporter::cutSlices(size_t sliceBytes) {
+    for (size_t f = 0; f < journals.size(); f++) {
+        const MappedJournal& journal = journals[f];
+        size_t begin = 0;
+        while (begin < journal.size) {
+            size_t end = journal.size;
+            if (journal.size - begin > sliceBytes) {
+                // Extend to the end of the line the cut lands in
+                const void* nl = memchr(journal.data + begin + sliceBytes, '\n',
+                                        journal.size - begin - sliceBytes);
+                end = nl != nullptr ? size_t(static_cast<const char*>(nl) - journal.data) + 1 : journal.size;
+            }
+            Slice slice;
+            slice.file = f;
+            slice.begin = begin;
+            slice.end = end;
+            slices.push_back(move(slice));
+            begin = end;
+        }
+    }
+}
+
+void JournalImporter::parseSlice(const MappedJournal& journal, Slice& slice) {
+    const char* p = journal.data + slice.begin;
+    const char* const end = journal.data + slice.end;
+    slice.records.reserve((slice.end - slice.begin) / 64);   // a typical record line is 70-90 bytes
+
+    PaymentDetails parsed;
+    PaymentAdjustment adjustment;
+    while (p < end) {
+        const char* nl = static_cast<const char*>(memchr(p, '\n', size_t(end - p)));
+        const char* lineEnd = nl != nullptr ? nl : end;
+        string_view line(p, size_t(lineEnd - p));
+        // Sealed segments end with a "#SEGMENT" summary line
+        if (!line.empty() && line != "\r" && line[0] != '#') {
+            if (parseJournalLine(line, parsed)) {
+                slice.records.push_back(parsed);
+            } else if (parseAdjustmentLine(line, adjustment)) {
+                slice.adjustments.push_back(adjustment);
+            } else {
+                slice.rejects.push_back(make_pair(slice.lines, line));
+            }
+        }
+        slice.lines++;
+        p = lineEnd + 1;
+    }
+}
+
+void JournalImporter::writeRejects() const {
+    ofstream out(rejectPath, ios::trunc | ios::binary);
+    if (!out.is_open()) {
+        cout << "WARNING: cannot write rejected lines to " << rejectPath << endl;
+        return;
+    }
+    string buffer;
+    size_t firstLine = 0;   // line number of the slice's first line within its file
+    for (size_t i = 0; i < slices.size(); i++) {
+        const Slice& slice = slices[i];
+        if (i > 0 && slices[i - 1].file != slice.file) firstLine = 0;
+        for (const auto& reject : slice.rejects) {
+            char number[24];
+            auto digits = to_chars(number, number + sizeof(number), firstLine + reject.first + 1);
+            buffer += journals[slice.file].path;
+            buffer += ':';
+            buffer.append(number, size_t(digits.ptr - number));
+            buffer += ": ";
+            buffer += reject.second;
+            buffer += '\n';
+        }
+        if (buffer.size() >= (1 << 20)) {
+            out.write(buffer.data(), streamsize(buffer.size()));
+            buffer.clear();
+        }
+        firstLine += slice.lines;
+    }
+    out.write(buffer.data(), streamsize(buffer.size()));
+}
+
+ImportResult JournalImporter::run(const vector<string>& paths, TransactionManager& manager) {
+    unmapAll();
+    ImportResult result;
+    for (const string& path : paths) {
+        map(path);
+        result.bytes += journals.back().size;
+    }
+    result.files = journals.size();
+
+    // Several slices per worker so one slow slice does not leave the others idle
+    auto started = chrono::steady_clock::now();
+    const size_t MinSliceBytes = 1 << 20;
+    size_t sliceBytes = max<uint64_t>(MinSliceBytes, result.bytes / (threadCount * 8) + 1);
+    cutSlices(sliceBytes);
+
+    size_t workers = min(threadCount, max<size_t>(slices.size(), 1));
+    result.threads = workers;
+    atomic<size_t> nextSlice(0);
+    auto work = [&]() {
+        for (size_t i = nextSlice.fetch_add(1); i < slices.size(); i = nextSlice.fetch_add(1)) {
+            parseSlice(journals[slices[i].file], slices[i]);
+        }
+    };
+    vector<thread> pool;
+    for (size_t w = 1; w < workers; w++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (thread& worker : pool) {
+        worker.join();
+    }
+    result.parseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    started = chrono::steady_clock::now();
+    vector<vector<PaymentDetails>> batches;
+    vector<vector<PaymentAdjustment>> adjustments;
+    batches.reserve(slices.size());
+    adjustments.reserve(slices.size());
+    for (Slice& slice : slices) {
+        result.records += slice.records.size();
+        result.adjustments += slice.adjustments.size();
+        result.rejected += slice.rejects.size();
+        batches.push_back(move(slice.records));
+        adjustments.push_back(move(slice.adjustments));
+    }
+    result.orphaned = manager.importTransactions(batches, adjustments);
+    result.loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    if (result.rejected > 0) {
+        writeRejects();
+    }
+    unmapAll();
+    return result;
+}
+
+// SnapshotConsolidator Implementation
+static inline int64_t snapshotTime(const SnapshotRecord& rec) {
+    return int64_t(toLittle64(uint64_t(rec.timestamp)));
+}
+
+static inline uint32_t snapshotPaymentId(const SnapshotRecord& rec) {
+    return toLittle32(rec.paymentId);
+}
+
+// Boundaries cutting sorted samples into about equal parts, first and last fixed
+template <typename Key>
+static vector<Key> rangeBoundaries(vector<Key>& samples, size_t parts, Key first, Key last) {
+    sort(samples.begin(), samples.end());
+    vector<Key> bounds(1, first);
+    for (size_t i = 1; i < parts && !samples.empty(); i++) {
+        Key bound = samples[samples.size() * i / parts];
+        if (bound > bounds.back()) bounds.push_back(bound);
+    }
+    bounds.push_back(last);
+    return bounds;
+}
+
+// Records sampled from each backup to choose range boundaries
+static const size_t ConsolidationSamples = 64;
+
+SnapshotConsolidator::SnapshotConsolidator(size_t threads)
+    : threadCount(threads > 0 ? threads : max(1u, thread::hardware_concurrency())) {
+}
+
+// Runs task(0) .. task(tasks - 1) on up to threadCount threads
+template <typename Task>
+void SnapshotConsolidator::parallel(size_t tasks, Task task) const {
+    atomic<size_t> next(0);
+    auto work = [&]() {
+        for (size_t i = next.fetch_add(1); i < tasks; i = next.fetch_add(1)) {
+            task(i);
+        }
+    };
+    vector<thread> pool;
+    for (size_t w = 1; w < min(threadCount, tasks); w++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (thread& worker : pool) {
+        worker.join();
+    }
+}
+
+void SnapshotConsolidator::load(const vector<string>& paths, ConsolidationResult& result) {
+    vector<unique_ptr<Source>> opened;
+    for (const string& path : paths) {
+        opened.emplace_back(new Source());
+        opened.back()->path = path;
+    }
+
+    // Verify and sort each backup on the workers; most arrive in time order already
+    vector<string> errors(opened.size());
+    parallel(opened.size(), [&](size_t i) {
+        Source& source = *opened[i];
+        try {
+            source.view.open(source.path, true);
+        }
+        catch (exception& e) {
+            errors[i] = e.what();
+            return;
+        }
+        const SnapshotView& view = source.view;
+        source.order.resize(view.size());
+        source.used.assign(view.sourceCount(), false);
+        for (size_t r = 0; r < source.order.size(); r++) {
+            source.order[r] = uint32_t(r);
+            source.used[toLittle16(view.record(r).source)] = true;
+        }
+        auto earlier = [&view](uint32_t a, uint32_t b) {
+            const SnapshotRecord& ra = view.record(a);
+            const SnapshotRecord& rb = view.record(b);
+            return make_pair(snapshotTime(ra), snapshotPaymentId(ra)) < make_pair(snapshotTime(rb), snapshotPaymentId(rb));
+        };
+        if (!is_sorted(source.order.begin(), source.order.end(), earlier)) {
+            sort(source.order.begin(), source.order.end(), earlier);
+        }
+    });
+
+    sources.clear();
+    for (size_t i = 0; i < opened.size(); i++) {
+        if (!errors[i].empty()) {
+            cout << "WARNING: skipping backup: " << errors[i] << endl;
+            result.unreadable++;
+            continue;
+        }
+        const SnapshotView& view = opened[i]->view;
+        for (size_t k = 0; k < view.sourceCount(); k++) {
+            TerminalIdentity terminal = view.source(k);
+            opened[i]->terminals.push_back(uint64_t(terminal.storeId) << 32 | terminal.terminalId);
+            if (opened[i]->used[k]) result.stores[terminal.storeId].terminals.insert(terminal.terminalId);
+        }
+        result.bytes += toLittle64(view.info().indexOffset) + view.size() * sizeof(SnapshotIndexEntry);
+        sources.push_back(move(opened[i]));
+    }
+    result.files = sources.size();
+}
+
+uint64_t SnapshotConsolidator::terminalOf(Ref ref) const {
+    const Source& source = *sources[ref.source];
+    return source.terminals[toLittle16(source.view.record(ref.record).source)];
+}
+
+bool SnapshotConsolidator::sameRecord(Ref a, Ref b) const {
+    if (terminalOf(a) != terminalOf(b)) return false;
+    const SnapshotView& va = sources[a.source]->view;
+    const SnapshotView& vb = sources[b.source]->view;
+    const SnapshotRecord& ra = va.record(a.record);
+    const SnapshotRecord& rb = vb.record(b.record);
+    return ra.paymentId == rb.paymentId && ra.amountCents == rb.amountCents && ra.timestamp == rb.timestamp &&
+           ra.status == rb.status && va.text(ra.methodRef) == vb.text(rb.methodRef) &&
+           va.text(ra.authRef) == vb.text(rb.authRef) && va.adjusted(ra) == vb.adjusted(rb);
+}
+
+void SnapshotConsolidator::mergeTimes(int64_t from, int64_t to, Range& range) const {
+    // Heads of every backup's run in the range, smallest (timestamp, payment ID, backup) on top
+    typedef tuple<int64_t, uint32_t, uint32_t> Head;
+    priority_queue<Head, vector<Head>, greater<Head>> heads;
+    vector<pair<size_t, size_t>> runs(sources.size());
+    auto headOf = [&](uint32_t s) {
+        const SnapshotRecord& rec = sources[s]->view.record(sources[s]->order[runs[s].first]);
+        return Head(snapshotTime(rec), snapshotPaymentId(rec), s);
+    };
+    for (uint32_t s = 0; s < sources.size(); s++) {
+        const Source& source = *sources[s];
+        auto before = [&source](uint32_t r, int64_t when) { return snapshotTime(source.view.record(r)) < when; };
+        runs[s].first = size_t(lower_bound(source.order.begin(), source.order.end(), from, before) - source.order.begin());
+        runs[s].second = size_t(lower_bound(source.order.begin(), source.order.end(), to, before) - source.order.begin());
+        if (runs[s].first < runs[s].second) heads.push(headOf(s));
+    }
+
+    vector<vector<RollupBucket>> payments(sources.size());   // by backup and its source
+    for (uint32_t s = 0; s < sources.size(); s++) {
+        payments[s].resize(sources[s]->terminals.size());
+    }
+    vector<vector<pair<uint32_t, PaymentMethod>>> methods(sources.size());   // method string refs seen
+    size_t groupStart = 0;      // first written record with the current (timestamp, payment ID)
+    int64_t groupTime = 0;
+    uint32_t groupId = 0;
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        uint32_t s = get<2>(head);
+        Ref ref = {s, sources[s]->order[runs[s].first]};
+        if (++runs[s].first < runs[s].second) heads.push(headOf(s));
+
+        // Identical records share a timestamp and ID, so they come off the heap together
+        if (range.records.size() == groupStart || get<0>(head) != groupTime || get<1>(head) != groupId) {
+            groupStart = range.records.size();
+            groupTime = get<0>(head);
+            groupId = get<1>(head);
+        }
+        bool duplicate = false;
+        for (size_t i = groupStart; i < range.records.size() && !duplicate; i++) {
+            duplicate = sameRecord(range.records[i], ref);
+        }
+        if (duplicate) {
+            range.duplicates++;
+            continue;
+        }
+        range.records.push_back(ref);
+
+        // A backup names a handful of methods, so resolve each string once
+        const SnapshotRecord& rec = sources[s]->view.record(ref.record);
+        uint32_t methodRef = toLittle32(rec.methodRef);
+        size_t m = 0;
+        while (m < methods[s].size() && methods[s][m].first != methodRef) m++;
+        if (m == methods[s].size()) {
+            PaymentMethod method = PaymentMethod::MobileUnknown;
+            methodFromName(sources[s]->view.text(rec.methodRef), method);
+            methods[s].push_back(make_pair(methodRef, method));
+        }
+        Money amount = Money::fromCents(int64_t(toLittle64(uint64_t(rec.amountCents))));
+        if (rec.status == SnapshotCompleted) amount -= sources[s]->view.adjusted(rec);
+        payments[s][toLittle16(rec.source)].cells[size_t(methods[s][m].second)][size_t(snapshotStatus(rec.status))]
+            .add(amount);
+    }
+    for (uint32_t s = 0; s < sources.size(); s++) {
+        for (size_t k = 0; k < payments[s].size(); k++) {
+            if (!sources[s]->used[k]) continue;
+            range.stores[uint32_t(sources[s]->terminals[k] >> 32)].payments.merge(payments[s][k]);
+        }
+    }
+}
+
+void SnapshotConsolidator::findCollisions(uint64_t from, uint64_t to, Range& range) const {
+    // The same merge over the footers, which each backup keeps in payment ID order
+    typedef pair<uint32_t, uint32_t> Head;      // payment ID, backup
+    priority_queue<Head, vector<Head>, greater<Head>> heads;
+    vector<pair<size_t, size_t>> runs(sources.size());
+    auto idAt = [&](uint32_t s, size_t i) { return toLittle32(sources[s]->view.indexEntry(i).paymentId); };
+    auto firstAtLeast = [&](uint32_t s, uint64_t id) {
+        size_t low = 0, high = sources[s]->view.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (idAt(s, mid) < id) low = mid + 1; else high = mid;
+        }
+        return low;
+    };
+    for (uint32_t s = 0; s < sources.size(); s++) {
+        runs[s] = make_pair(firstAtLeast(s, from), firstAtLeast(s, to));
+        if (runs[s].first < runs[s].second) heads.push(Head(idAt(s, runs[s].first), s));
+    }
+
+    // An ID collides once any of its records differs from its first one
+    vector<Ref> group;          // records with the current payment ID
+    bool colliding = false;
+    uint32_t groupId = 0;
+    auto closeGroup = [&]() {
+        if (colliding) {
+            range.collisions++;
+            if (range.collidingIds.size() < 10) {
+                set<uint64_t> terminals;
+                for (Ref ref : group) terminals.insert(terminalOf(ref));
+                CollidingId collision;
+                collision.paymentId = int(groupId);
+                for (uint64_t terminal : terminals) {
+                    TerminalIdentity identity;
+                    identity.storeId = uint32_t(terminal >> 32);
+                    identity.terminalId = uint32_t(terminal);
+                    collision.terminals.push_back(identity);
+                }
+                range.collidingIds.push_back(collision);
+            }
+        }
+        group.clear();
+        colliding = false;
+    };
+    while (!heads.empty()) {
+        Head head = heads.top();
+        heads.pop();
+        uint32_t s = head.second;
+        Ref ref = {s, toLittle32(sources[s]->view.indexEntry(runs[s].first).record)};
+        if (++runs[s].first < runs[s].second) heads.push(Head(idAt(s, runs[s].first), s));
+
+        if (group.empty() || head.first != groupId) {
+            closeGroup();
+            groupId = head.first;
+        } else if (!colliding) {
+            colliding = !sameRecord(group.front(), ref);
+        }
+        group.push_back(ref);
+    }
+    closeGroup();
+}
+
+ConsolidationResult SnapshotConsolidator::run(const vector<string>& paths, const string& outputPath) {
+    ConsolidationResult result;
+    auto started = chrono::steady_clock::now();
+    load(paths, result);
+    result.readMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // Several ranges per worker so one busy range does not leave the others idle
+    started = chrono::steady_clock::now();
+    size_t parts = threadCount * 4;
+    vector<int64_t> timeSamples;
+    vector<uint64_t> idSamples;
+    for (const auto& source : sources) {
+        size_t n = source->order.size();
+        for (size_t k = 0; k < ConsolidationSamples && n > 0; k++) {
+            timeSamples.push_back(snapshotTime(source->view.record(source->order[n * k / ConsolidationSamples])));
+            idSamples.push_back(toLittle32(source->view.indexEntry(n * k / ConsolidationSamples).paymentId));
+        }
+    }
+    vector<int64_t> times = rangeBoundaries<int64_t>(timeSamples, parts, INT64_MIN, INT64_MAX);
+    vector<uint64_t> ids = rangeBoundaries<uint64_t>(idSamples, parts, 0, uint64_t(1) << 32);
+    vector<Range> timeRanges(times.size() - 1);
+    vector<Range> idRanges(ids.size() - 1);
+    parallel(timeRanges.size() + idRanges.size(), [&](size_t i) {
+        if (i < timeRanges.size()) {
+            mergeTimes(times[i], times[i + 1], timeRanges[i]);
+        } else {
+            size_t r = i - timeRanges.size();
+            findCollisions(ids[r], ids[r + 1], idRanges[r]);
+        }
+    });
+    result.threads = min(threadCount, timeRanges.size() + idRanges.size());
+    for (Range& range : timeRanges) {
+        result.duplicates += range.duplicates;
+        for (auto& store : range.stores) {
+            result.stores[store.first].payments.merge(store.second.payments);
+        }
+    }
+    for (Range& range : idRanges) {
+        result.collisions += range.collisions;
+        for (CollidingId& id : range.collidingIds) {
+            if (result.collidingIds.size() < 10) result.collidingIds.push_back(move(id));
+        }
+    }
+    result.mergeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+
+    // One writer: the output is a single stream and the disk is the limit
+    started = chrono::steady_clock::now();
+    SnapshotWriter writer(outputPath);
+    for (const auto& source : sources) {
+        for (size_t k = 0; k < source->terminals.size(); k++) {
+            uint64_t terminal = source->terminals[k];
+            source->written.push_back(source->used[k] ? writer.addSource(uint32_t(terminal >> 32), uint32_t(terminal)) : 0);
+        }
+    }
+    for (const Range& range : timeRanges) {
+        for (Ref ref : range.records) {
+            const Source& source = *sources[ref.source];
+            const SnapshotRecord& rec = source.view.record(ref.record);
+            writer.add(int(snapshotPaymentId(rec)), source.view.text(rec.methodRef),
+                       int64_t(toLittle64(uint64_t(rec.amountCents))), snapshotTime(rec), rec.status,
+                       source.view.text(rec.authRef), source.view.adjusted(rec).cents,
+                       source.written[toLittle16(rec.source)]);
+        }
+        result.records += range.records.size();
+    }
+    writer.finish();
+    result.writeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    sources.clear();
+    return result;
+}
+
+// Main POS System
+// Issuer ranges from path, or the built-in network prefixes when an optional file is absent
+static shared_ptr<const BinTable> loadBinTable(const string& path, bool required) {
+    struct stat info;
+    if (!required && stat(path.c_str(), &info) != 0) {
+        return BinTable::standard();
+    }
+    string error;
+    shared_ptr<const BinTable> table = BinTable::fromFile(path, error);
+    if (!table) {
+        cout << "ERROR: " << error << endl;
+        return nullptr;
+    }
+    cout << "Loaded " << table->size() << " BIN ranges from " << path << endl;
+    return table;
+}
+
+// Read one amount as typed, in exact cents: "12", "12.5", "$12.50"
+static bool readMoney(Money& amount) {
+    string text;
+    if (!(cin >> text) || !parseMoney(text, amount)) {
+        cout << "Invalid amount." << endl;
+        return false;
+    }
+    return true;
+}
+
+void runPOSSystem() {
+    PaymentProcessor processor;
+    TransactionManager manager;
+
+    shared_ptr<const BinTable> binTable = loadBinTable("bin_ranges.txt", false);
+    if (binTable) {
+        processor.setBinTable(binTable);
+    }
+
+    // Rebuild state left by earlier runs before taking payments
+    RecoveryResult recovered = manager.recover();
+    PaymentProcessor::resumePaymentIds(recovered.maxPaymentId);
+    if (recovered.snapshotRecords + recovered.journalRecords > 0) {
+        cout << "Recovered " << (recovered.snapshotRecords + recovered.journalRecords) << " transactions ("
+             << recovered.snapshotRecords << " from snapshot, " << recovered.journalRecords
+             << " from journal) in " << fixed << setprecision(2) << recovered.elapsedMs << " ms" << endl;
+    }
+    if (recovered.adjustments > 0) {
+        cout << "Reapplied " << recovered.adjustments << " refund/void/capture adjustment"
+             << (recovered.adjustments == 1 ? "" : "s") << " from the journal" << endl;
+    }
+    if (recovered.segmentsSkipped > 0) {
+        cout << recovered.segmentsSkipped << " sealed journal segment" << (recovered.segmentsSkipped == 1 ? "" : "s")
+             << " already in the snapshot; " << recovered.segmentsRead << " replayed" << endl;
+    }
+
+    int choice;
+    Money amount, tendered;
+    string cardNumber, expiry, cvv, provider;
+
+    do {
+        cout << "\n=======================================" << endl;
+        cout << "=== PAYMENT PROCESSING SYSTEM      ===" << endl;
+        cout << "=======================================" << endl;
+        cout << "1. Cash Payment" << endl;
+        cout << "2. Credit Card Payment" << endl;
+        cout << "3. Debit Card Payment" << endl;
+        cout << "4. Mobile Payment" << endl;
+        cout << "5. View Transaction History" << endl;
+        cout << "6. Generate Daily Report" << endl;
+        cout << "7. Save Binary Backup" << endl;
+        cout << "8. Exit" << endl;
+        cout << "9. Hourly Report" << endl;
+        cout << "10. Shift Report" << endl;
+        cout << "11. Metrics" << endl;
+        cout << "12. Query Transactions" << endl;
+        cout << "13. Close Batch (End of Day)" << endl;
+        cout << "14. Refund / Void / Capture" << endl;
+        cout << "=======================================" << endl;
+        cout << "Enter your choice: ";
+        if (!(cin >> choice)) {
+            // End of input: leave the way option 8 does instead of spinning
+            cin.clear();
+            choice = 8;
+        }
+
+        switch(choice) {
+            case 1: {
+                cout << "\n=== CASH PAYMENT ===" << endl;
+                cout << "Enter amount due: $";
+                if (!readMoney(amount)) break;
+                cout << "Enter cash tendered: $";
+                if (!readMoney(tendered)) break;
+
+                if (processor.processCashPayment(amount, tendered)) {
+                    Money change = processor.calculateChange(amount, tendered);
+                    cout << "\nChange Due: $" << change << endl;
+                    manager.addTransaction(processor.getCurrentPayment());
+                    processor.displayPaymentReceipt();
+                }
+                break;
+            }
+
+            case 2: {
+                cout << "\n=== CREDIT CARD PAYMENT ===" << endl;
+                cout << "Enter amount: $";
+                if (!readMoney(amount)) break;
+                cin.ignore();
+                cout << "Enter card number: ";
+                getline(cin, cardNumber);
+                cout << "Enter expiry (MM/YY): ";
+                getline(cin, expiry);
+                cout << "Enter CVV: ";
+                getline(cin, cvv);
+
+                // Approved or declined, a started payment is recorded
+                processor.processCardPayment(amount, cardNumber, expiry, cvv, PaymentMethod::CreditCard);
+                if (processor.getCurrentPayment() != nullptr) {
+                    manager.addTransaction(processor.getCurrentPayment());
+                    processor.displayPaymentReceipt();
+                }
+                break;
+            }
+
+            case 3: {
+                cout << "\n=== DEBIT CARD PAYMENT ===" << endl;
+                cout << "Enter amount: $";
+                if (!readMoney(amount)) break;
+                cin.ignore();
+                cout << "Enter card number: ";
+                getline(cin, cardNumber);
+                cout << "Enter expiry (MM/YY): ";
+                getline(cin, expiry);
+                cout << "Enter CVV: ";
+                getline(cin, cvv);
+
+                // Approved or declined, a started payment is recorded
+                processor.processCardPayment(amount, cardNumber, expiry, cvv, PaymentMethod::DebitCard);
+                if (processor.getCurrentPayment() != nullptr) {
+                    manager.addTransaction(processor.getCurrentPayment());
+                    processor.displayPaymentReceipt();
+                }
+                break;
+            }
+
+            case 4: {
+                cout << "\n=== MOBILE PAYMENT ===" << endl;
+                cout << "Enter amount: $";
+                if (!readMoney(amount)) break;
+                cin.ignore();
+                cout << "Select Provider:" << endl;
+                cout << "1. PayPal" << endl;
+                cout << "2. Apple Pay" << endl;
+                cout << "3. Google Pay" << endl;
+                cout << "Choice: ";
+                int providerChoice;
+                cin >> providerChoice;
+
+                switch(providerChoice) {
+                    case 1: provider = "PayPal"; break;
+                    case 2: provider = "Apple Pay"; break;
+                    case 3: provider = "Google Pay"; break;
+                    default: provider = "Unknown"; break;
+                }
+
+                // Approved or declined, a started payment is recorded
+                processor.processMobilePayment(amount, provider);
+                if (processor.getCurrentPayment() != nullptr) {
+                    manager.addTransaction(processor.getCurrentPayment());
+                    processor.displayPaymentReceipt();
+                }
+                break;
+            }
+
+            case 5:
+                manager.displayTransactionHistory();
+                break;
+
+            case 6:
+                manager.generateDailyReport();
+                break;
+
+            case 7:
+                manager.saveBinaryBackup();
+                break;
+
+            case 8:
+                cout << "\nThank you for using the POS System!" << endl;
+                cout << "Saving final backup..." << endl;
+                manager.saveBinaryBackup();
+                break;
+
+            case 9:
+                manager.generateHourlyReport();
+                break;
+
+            case 10: {
+                string shiftStart, shiftEnd;
+                int startMinute, endMinute;
+                cout << "Enter shift start (HH:MM): ";
+                cin >> shiftStart;
+                cout << "Enter shift end (HH:MM): ";
+                cin >> shiftEnd;
+                if (!parseClockTime(shiftStart, startMinute) || !parseClockTime(shiftEnd, endMinute)) {
+                    cout << "Invalid time. Please use HH:MM." << endl;
+                    break;
+                }
+                time_t from, to;
+                shiftWindow(startMinute, endMinute, epochSeconds(currentEpochMicros()), from, to);
+                manager.generateShiftReport(from, to);
+                break;
+            }
+
+            case 11:
+                MetricsRegistry::shared().printSummary();
+                break;
+
+            case 12: {
+                string filters, error;
+                cout << "Filters: method= status= min= max= from=HH:MM|YYYY-MM-DD to=.. by=method|status|hour" << endl;
+                cout << "Enter query (blank for everything): ";
+                cin.ignore();
+                getline(cin, filters);
+                TransactionQuery query;
+                if (!parseQuery(splitWords(filters), 0, query, error)) {
+                    cout << "Invalid query: " << error << endl;
+                    break;
+                }
+                manager.generateQueryReport(query.resolved(epochSeconds(currentEpochMicros())));
+                break;
+            }
+
+            case 13:
+                manager.closeBatch();
+                break;
+
+            case 14: {
+                string reference, error;
+                int paymentId, kindChoice;
+                cout << "\n=== ADJUST PAYMENT ===" << endl;
+                cout << "Enter payment ID: ";
+                cin >> reference;
+                if (!parsePaymentReference(reference, paymentId)) {
+                    cout << "Invalid payment ID." << endl;
+                    break;
+                }
+                cout << "1. Refund" << endl;
+                cout << "2. Void" << endl;
+                cout << "3. Capture" << endl;
+                cout << "Choice: ";
+                cin >> kindChoice;
+                if (kindChoice < 1 || kindChoice > int(AdjustmentKindCount)) {
+                    cout << "Invalid choice." << endl;
+                    break;
+                }
+                AdjustmentKind kind = AdjustmentKind(kindChoice - 1);
+                amount = Money();
+                if (kind == AdjustmentKind::Refund) {
+                    cout << "Enter refund amount (0 for all of it): $";
+                    if (!readMoney(amount)) break;
+                } else if (kind == AdjustmentKind::Capture) {
+                    cout << "Enter amount to capture: $";
+                    if (!readMoney(amount)) break;
+                }
+                PaymentAdjustment adjustment;
+                if (!manager.adjustTransaction(paymentId, kind, amount, adjustment, error)) {
+                    cout << adjustmentName(kind) << " failed: " << error << endl;
+                    break;
+                }
+                cout << adjustmentName(kind) << " of $" << adjustment.amount << " on PAY-" << paymentId
+                     << " recorded; payment is " << statusName(adjustment.status) << " at $" << adjustment.balance
+                     << endl;
+                break;
+            }
+
+            default:
+                cout << "Invalid choice. Please try again." << endl;
+        }
+
+    } while(choice != 8);
+}
+
+// Latency samples for one kind of batch command
+struct LatencyRecorder {
+    vector<uint64_t> samples;   // nanoseconds
+    uint64_t totalNanos = 0;
+
+    void record(uint64_t nanos) {
+        samples.push_back(nanos);
+        totalNanos += nanos;
+    }
+
+    uint64_t percentile(double p) {
+        if (samples.empty()) return 0;
+        size_t rank = size_t(p * (samples.size() - 1) + 0.5);
+        nth_element(samples.begin(), samples.begin() + rank, samples.end());
+        return samples[rank];
+    }
+};
+
+// Map the provider words of a mobile command to the menu's provider names
+static string batchProvider(const vector<string_view>& words, size_t first) {
+    string name;
+    for (size_t i = first; i < words.size(); i++) {
+        if (!name.empty()) name += ' ';
+        name += string(words[i]);
+    }
+    string key;
+    for (char c : name) {
+        if (!isspace(static_cast<unsigned char>(c))) key += char(tolower(static_cast<unsigned char>(c)));
+    }
+    if (key == "1" || key == "paypal") return "PayPal";
+    if (key == "2" || key == "applepay") return "Apple Pay";
+    if (key == "3" || key == "googlepay") return "Google Pay";
+    return "Unknown";
+}
+
+// Batch command kinds, in the order they are reported
+enum BatchKind {
+    BatchCash, BatchCredit, BatchDebit, BatchMobile, BatchHistory, BatchReport, BatchHourly, BatchShift, BatchBackup,
+    BatchMetrics, BatchQuery, BatchClose, BatchRefund, BatchVoid, BatchCapture, BatchKindCount
+};
+static const char* const batchKindNames[BatchKindCount] = {
+    "cash", "credit", "debit", "mobile", "history", "report", "hourly", "shift", "backup", "metrics", "query",
+    "close", "refund", "void", "capture"
+};
+
+// One parsed batch line
+struct BatchCommand {
+    BatchKind kind;
+    Money amount;
+    Money tendered;
+    string cardNumber;
+    string expiry;
+    string cvv;
+    string provider;
+    string idempotencyKey;  // empty when the line has no key=
+    bool hold;          // authorize only; a later capture settles it
+    int paymentId;      // the payment a refund, void or capture adjusts
+    int shiftStart;     // minutes after midnight
+    int shiftEnd;
+    TransactionQuery query;
+};
+
+// Per-lane results, merged after the run
+struct BatchLaneStats {
+    LatencyRecorder latency[BatchKindCount];
+    size_t approved = 0;
+    size_t declined = 0;
+    size_t duplicates = 0;  // answered from the idempotency cache
+};
+
+// Outcomes of asynchronous authorizations, filled in by engine threads
+struct BatchAsyncTally {
+    mutex tallyMutex;
+    LatencyRecorder latency;    // submit to completion
+    size_t approved = 0;
+    size_t declined = 0;
+};
+
+static bool parseBatchLine(const string& line, BatchCommand& command, string& error) {
+    vector<string_view> words = splitWords(line);
+    int kind = 0;
+    while (kind < BatchKindCount && words[0] != batchKindNames[kind]) kind++;
+    if (kind == BatchKindCount) {
+        error = "unknown command '" + string(words[0]) + "'";
+        return false;
+    }
+    command.kind = BatchKind(kind);
+
+    // Card and mobile payments may end with an idempotency key
+    command.idempotencyKey.clear();
+    if ((command.kind == BatchCredit || command.kind == BatchDebit || command.kind == BatchMobile) &&
+        words.size() > 3 && words.back().substr(0, 4) == "key=") {
+        string_view key = words.back().substr(4);
+        if (key.empty() || key.size() > IdempotencyCache::MaxKeyLength) {
+            error = "idempotency key must be 1 to " + to_string(IdempotencyCache::MaxKeyLength) + " characters";
+            return false;
+        }
+        command.idempotencyKey = string(key);
+        words.pop_back();
+    }
+    // and, before that, "hold" to authorize without settling
+    command.hold = (command.kind == BatchCredit || command.kind == BatchDebit || command.kind == BatchMobile) &&
+                   words.size() > 3 && words.back() == "hold";
+    if (command.hold) words.pop_back();
+
+    bool wellFormed = true;
+    switch (command.kind) {
+        case BatchCash:
+            wellFormed = words.size() == 3 && parseMoney(words[1], command.amount) &&
+                         parseMoney(words[2], command.tendered);
+            break;
+        case BatchCredit:
+        case BatchDebit:
+            wellFormed = words.size() == 5 && parseMoney(words[1], command.amount);
+            if (wellFormed) {
+                command.cardNumber = string(words[2]);
+                command.expiry = string(words[3]);
+                command.cvv = string(words[4]);
+            }
+            break;
+        case BatchMobile:
+            wellFormed = words.size() >= 3 && parseMoney(words[1], command.amount);
+            if (wellFormed) {
+                command.provider = batchProvider(words, 2);
+            }
+            break;
+        case BatchShift:
+            wellFormed = words.size() == 3 && parseClockTime(words[1], command.shiftStart) &&
+                         parseClockTime(words[2], command.shiftEnd);
+            break;
+        case BatchQuery:
+            // parseQuery explains what is wrong
+            return parseQuery(words, 1, command.query, error);
+        case BatchRefund:
+            // Without an amount, everything left is refunded
+            command.amount = Money();
+            wellFormed = (words.size() == 2 || (words.size() == 3 && parseMoney(words[2], command.amount))) &&
+                         parsePaymentReference(words[1], command.paymentId);
+            break;
+        case BatchVoid:
+            wellFormed = words.size() == 2 && parsePaymentReference(words[1], command.paymentId);
+            break;
+        case BatchCapture:
+            wellFormed = words.size() == 3 && parsePaymentReference(words[1], command.paymentId) &&
+                         parseMoney(words[2], command.amount);
+            break;
+        default:
+            wellFormed = words.size() == 1;
+            break;
+    }
+    if (!wellFormed) {
+        error = "malformed '" + string(words[0]) + "' command";
+    }
+    return wellFormed;
+}
+
+// Run one payment command on a lane
+static void runBatchPayment(PaymentProcessor& processor, TransactionManager& manager,
+                            const BatchCommand& command, BatchLaneStats& stats,
+                            AuthorizationEngine* engine, BatchAsyncTally* tally) {
+    auto started = chrono::steady_clock::now();
+    processor.setAuthorizeOnly(command.hold);
+
+    // Card and mobile payments only wait for the hand-off when authorizing asynchronously
+    if (engine != nullptr && command.kind != BatchCash) {
+        auto onComplete = [&manager, tally, started](PaymentDetails& payment) {
+            manager.addTransaction(&payment);
+            uint64_t nanos = uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - started).count());
+            lock_guard<mutex> lock(tally->tallyMutex);
+            tally->latency.record(nanos);
+            if (isApproved(payment.status)) tally->approved++; else tally->declined++;
+        };
+        if (command.kind == BatchMobile) {
+            processor.beginMobilePayment(*engine, command.amount, command.provider, onComplete, command.idempotencyKey);
+        } else {
+            processor.beginCardPayment(*engine, command.amount, command.cardNumber, command.expiry, command.cvv,
+                                       command.kind == BatchCredit ? PaymentMethod::CreditCard : PaymentMethod::DebitCard, onComplete,
+                                       command.idempotencyKey);
+        }
+        if (processor.isDuplicate()) {
+            stats.duplicates++;
+        } else if (processor.getCurrentPayment() == nullptr) {
+            // Refused before it started (a bad amount or card, or a key in use): no onComplete
+            lock_guard<mutex> lock(tally->tallyMutex);
+            tally->declined++;
+        }
+        stats.latency[command.kind].record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now() - started).count()));
+        return;
+    }
+
+    bool paid = false;
+    switch (command.kind) {
+        case BatchCash:
+            paid = processor.processCashPayment(command.amount, command.tendered);
+            if (paid) manager.addTransaction(processor.getCurrentPayment());
+            break;
+        case BatchCredit:
+        case BatchDebit:
+            paid = processor.processCardPayment(command.amount, command.cardNumber, command.expiry, command.cvv,
+                                                command.kind == BatchCredit ? PaymentMethod::CreditCard : PaymentMethod::DebitCard,
+                                                command.idempotencyKey);
+            break;
+        default:
+            paid = processor.processMobilePayment(command.amount, command.provider, command.idempotencyKey);
+            break;
+    }
+    // A repeated key was recorded and printed the first time round; a payment
+    // refused before it started has nothing to record or print
+    bool duplicate = processor.isDuplicate();
+    bool recorded = processor.getCurrentPayment() != nullptr;
+    if (command.kind != BatchCash && !duplicate) manager.addTransaction(processor.getCurrentPayment());
+    // The lane's printer decides whether the receipt is shown, spooled or skipped
+    if (!duplicate && recorded) processor.displayPaymentReceipt();
+    stats.latency[command.kind].record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - started).count()));
+    if (duplicate) stats.duplicates++; else if (paid) stats.approved++; else stats.declined++;
+}
+
+// Headless driver: one command per line, executed without prompts.
+//   cash <amount> <tendered>
+//   credit|debit <amount> <card number> <MM/YY> <cvv> [hold] [key=<idempotency key>]
+//   mobile <amount> <provider> [hold] [key=<idempotency key>]
+//   history | report | hourly | backup | metrics | close
+//   refund <payment id> [amount] | void <payment id> | capture <payment id> <amount>
+//   shift <HH:MM> <HH:MM>
+//   query [method=..] [status=..] [min=..] [max=..] [from=..] [to=..] [by=..]
+// Blank lines and lines starting with '#' are ignored. With several lanes,
+// the payments between two report/backup commands are dealt round-robin to
+// one processor and transaction shard per lane, running on their own threads.
+// With an authorization engine, card and mobile payments are authorized in
+// the background and every lane moves straight on to its next payment.
+// Without an engine, a gateway client authorizes card and mobile payments
+// synchronously on each lane (with one, it is in the engine's config).
+// Receipts go to the given printer; without one they are shown only when verbose.
+// A payment repeating an earlier key is answered from an idempotency cache
+// shared by all lanes and is not recorded again.
+int runBatchMode(istream& input, bool verbose, size_t lanes, AuthorizationEngine* engine,
+                 shared_ptr<ReceiptPrinter> receipts, shared_ptr<const BinTable> binTable,
+                 shared_ptr<GatewayClient> gateway) {
+    if (!receipts) {
+        receipts = verbose ? ReceiptPrinter::console() : make_shared<ReceiptPrinter>(ReceiptOutput::Discard);
+    }
+    if (lanes == 0) lanes = 1;
+
+    // Parse the whole workload first so the timed run is pure execution
+    vector<BatchCommand> commands;
+    size_t lineNumber = 0, rejected = 0;
+    string line, error;
+    BatchCommand command;
+    while (getline(input, line)) {
+        lineNumber++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') continue;
+        if (parseBatchLine(line, command, error)) {
+            commands.push_back(command);
+        } else {
+            cout << "line " << lineNumber << ": " << error << endl;
+            rejected++;
+        }
+    }
+
+    ShardedTransactionManager manager(lanes);
+    RecoveryResult recovered = manager.recover();
+    PaymentProcessor::resumePaymentIds(recovered.maxPaymentId);
+
+    // Only workloads that use keys pay for the cache
+    shared_ptr<IdempotencyCache> idempotency;
+    for (const BatchCommand& parsed : commands) {
+        if (!parsed.idempotencyKey.empty()) {
+            idempotency = make_shared<IdempotencyCache>();
+            break;
+        }
+    }
+
+    vector<unique_ptr<PaymentProcessor>> processors;
+    vector<BatchLaneStats> laneStats(lanes);
+    for (size_t i = 0; i < lanes; i++) {
+        processors.push_back(unique_ptr<PaymentProcessor>(new PaymentProcessor()));
+        processors[i]->setVerbose(verbose);
+        processors[i]->setReceiptPrinter(receipts);
+        processors[i]->setBinTable(binTable);
+        processors[i]->setIdempotencyCache(idempotency);
+        processors[i]->setGateway(gateway);
+    }
+
+    BatchAsyncTally tally;
+    auto started = chrono::steady_clock::now();
+    size_t next = 0;
+    while (next < commands.size()) {
+        // Payments up to the next report/backup command
+        size_t end = next;
+        while (end < commands.size() && commands[end].kind <= BatchMobile) end++;
+
+        if (lanes == 1) {
+            for (size_t i = next; i < end; i++) {
+                runBatchPayment(*processors[0], manager.lane(0), commands[i], laneStats[0], engine, &tally);
+            }
+        } else if (end > next) {
+            vector<thread> workers;
+            for (size_t lane = 0; lane < lanes; lane++) {
+                workers.push_back(thread([&, lane]() {
+                    for (size_t i = next + lane; i < end; i += lanes) {
+                        runBatchPayment(*processors[lane], manager.lane(lane), commands[i], laneStats[lane],
+                                        engine, &tally);
+                    }
+                }));
+            }
+            for (thread& worker : workers) {
+                worker.join();
+            }
+        }
+
+        // Reports and backups see every payment before them
+        if (engine != nullptr) {
+            engine->drain();
+        }
+
+        if (end < commands.size()) {
+            auto commandStart = chrono::steady_clock::now();
+            switch (commands[end].kind) {
+                case BatchHistory: manager.displayTransactionHistory(); break;
+                case BatchReport: manager.generateDailyReport(); break;
+                case BatchHourly: manager.generateHourlyReport(); break;
+                case BatchShift: {
+                    time_t from, to;
+                    time_t now = epochSeconds(currentEpochMicros());
+                    shiftWindow(commands[end].shiftStart, commands[end].shiftEnd, now, from, to);
+                    manager.generateShiftReport(from, to);
+                    break;
+                }
+                case BatchMetrics: MetricsRegistry::shared().printSummary(); break;
+                case BatchQuery:
+                    manager.generateQueryReport(commands[end].query.resolved(epochSeconds(currentEpochMicros())));
+                    break;
+                case BatchClose: manager.closeBatch(); break;
+                case BatchRefund:
+                case BatchVoid:
+                case BatchCapture: {
+                    const BatchCommand& adjust = commands[end];
+                    AdjustmentKind kind = adjust.kind == BatchRefund ? AdjustmentKind::Refund :
+                                          adjust.kind == BatchVoid ? AdjustmentKind::Void : AdjustmentKind::Capture;
+                    PaymentAdjustment adjustment;
+                    string failure;
+                    if (!manager.adjustTransaction(adjust.paymentId, kind, adjust.amount, adjustment, failure)) {
+                        cout << adjustmentName(kind) << " failed: " << failure << endl;
+                    } else if (verbose) {
+                        cout << adjustmentName(kind) << " of $" << adjustment.amount << " on PAY-" << adjust.paymentId
+                             << "; payment is " << statusName(adjustment.status) << " at $" << adjustment.balance
+                             << endl;
+                    }
+                    break;
+                }
+                default: manager.saveBinaryBackup(); break;
+            }
+            laneStats[0].latency[commands[end].kind].record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now() - commandStart).count()));
+            end++;
+        }
+        next = end;
+    }
+    receipts->flush();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+
+    // Merge the lanes
+    BatchLaneStats total;
+    total.approved = tally.approved;
+    total.declined = tally.declined;
+    for (BatchLaneStats& stats : laneStats) {
+        total.approved += stats.approved;
+        total.declined += stats.declined;
+        total.duplicates += stats.duplicates;
+        for (int k = 0; k < BatchKindCount; k++) {
+            LatencyRecorder& into = total.latency[k];
+            into.samples.insert(into.samples.end(), stats.latency[k].samples.begin(), stats.latency[k].samples.end());
+            into.totalNanos += stats.latency[k].totalNanos;
+        }
+    }
+
+    size_t payments = total.approved + total.declined;
+    cout << "\n========================================" << endl;
+    cout << "===      BATCH SUMMARY              ===" << endl;
+    cout << "========================================" << endl;
+    cout << "Lines Read: " << lineNumber << " (" << rejected << " rejected)" << endl;
+    cout << "Lanes: " << lanes << endl;
+    // Drawn seeds are shown too, so any run can be replayed with --seed, sync or
+    // --async: both issue payment IDs only to payments that pass validation
+    cout << "Seed: " << simulationSeed() << (simulationSeeded() ? "" : " (drawn)");
+    if (simulationSeeded() && lanes > 1) cout << " (payment IDs follow lane timing; one lane replays line by line)";
+    cout << endl;
+    cout << "Payments: " << payments << " (" << total.approved << " approved, " << total.declined << " declined)" << endl;
+    if (idempotency) {
+        IdempotencyCache::Stats cache = idempotency->stats();
+        uint64_t lookups = cache.hits + cache.misses + cache.conflicts;
+        cout << "Duplicates: " << total.duplicates << " replayed; " << cache.conflicts
+             << " declined for a key used with another amount or method" << endl;
+        cout << "Idempotency Cache: " << cache.hits << " hits, " << cache.misses << " misses ("
+             << fixed << setprecision(1) << (lookups > 0 ? 100.0 * cache.hits / lookups : 0.0) << "% hit rate, "
+             << cache.bloomMisses << " answered by the bloom filter), " << cache.evictions << " evicted" << endl;
+    }
+    cout << "Elapsed: " << fixed << setprecision(3) << elapsed * 1000.0 << " ms" << endl;
+    cout << "Throughput: " << fixed << setprecision(0) << (elapsed > 0 ? payments / elapsed : 0) << " payments/s" << endl;
+    if (EventLogger::shared().droppedEvents() > 0) {
+        cout << "Dropped Log Events: " << EventLogger::shared().droppedEvents() << endl;
+    }
+    cout << "----------------------------------------" << endl;
+    cout << left << setw(9) << "Command" << right << setw(10) << "Count" << setw(11) << "Mean(us)"
+         << setw(10) << "p50(us)" << setw(10) << "p99(us)" << setw(11) << "p999(us)" << setw(10) << "Max(us)" << endl;
+    for (int k = 0; k < BatchKindCount; k++) {
+        LatencyRecorder& rec = total.latency[k];
+        if (rec.samples.empty()) continue;
+        cout << left << setw(9) << batchKindNames[k] << right << setw(10) << rec.samples.size() << setprecision(2)
+             << setw(11) << rec.totalNanos / 1000.0 / rec.samples.size()
+             << setw(10) << rec.percentile(0.50) / 1000.0
+             << setw(10) << rec.percentile(0.99) / 1000.0
+             << setw(11) << rec.percentile(0.999) / 1000.0
+             << setw(10) << rec.percentile(1.0) / 1000.0 << endl;
+    }
+    if (engine != nullptr && !tally.latency.samples.empty()) {
+        LatencyRecorder& rec = tally.latency;
+        cout << left << setw(9) << "auth" << right << setw(10) << rec.samples.size() << setprecision(2)
+             << setw(11) << rec.totalNanos / 1000.0 / rec.samples.size()
+             << setw(10) << rec.percentile(0.50) / 1000.0
+             << setw(10) << rec.percentile(0.99) / 1000.0
+             << setw(11) << rec.percentile(0.999) / 1000.0
+             << setw(10) << rec.percentile(1.0) / 1000.0 << endl;
+        cout << "----------------------------------------" << endl;
+        engine->printStats();
+    }
+    if (gateway) {
+        gateway->printStats();
+    }
+    cout << "========================================\n" << endl;
+    return rejected == 0 ? 0 : 1;
+}
+
+// Print the report held in a snapshot file without loading it
+int reportFromSnapshot(const string& path) {
+    try {
+        SnapshotView snapshot;
+        snapshot.open(path, true);
+        snapshot.generateReport();
+        return 0;
+    }
+    catch (exception& e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+}
+
+// Load historical journals for analysis and print what they hold.
+// The records are not journaled again.
+int runImport(const vector<string>& paths, size_t threads, const string& rejectPath) {
+    JournalConfig scratch;
+    scratch.path = "/dev/null";
+    TransactionManager manager(scratch);
+    ImportResult result;
+    try {
+        JournalImporter importer(threads, rejectPath);
+        result = importer.run(paths, manager);
+    }
+    catch (exception& e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+
+    double seconds = (result.parseMs + result.loadMs) / 1000.0;
+    cout << "\n========================================" << endl;
+    cout << "===      IMPORT SUMMARY             ===" << endl;
+    cout << "========================================" << endl;
+    cout << "Files: " << result.files << " (" << result.bytes << " bytes)" << endl;
+    cout << "Records: " << result.records << " (" << result.rejected << " rejected";
+    if (result.rejected > 0) cout << ", see " << rejectPath;
+    cout << ")" << endl;
+    if (result.adjustments > 0) {
+        cout << "Adjustments: " << result.adjustments;
+        if (result.orphaned > 0) cout << " (" << result.orphaned << " for payments not imported)";
+        cout << endl;
+    }
+    cout << "Threads: " << result.threads << endl;
+    cout << fixed << setprecision(3);
+    cout << "Parse: " << result.parseMs << " ms (" << setprecision(2)
+         << (result.parseMs > 0 ? result.bytes / (result.parseMs * 1e6) : 0.0) << " GB/s)" << endl;
+    cout << "Load: " << setprecision(3) << result.loadMs << " ms" << endl;
+    cout << "Throughput: " << setprecision(0) << (seconds > 0 ? result.records / seconds : 0.0)
+         << " records/s" << endl;
+    cout << "========================================" << endl;
+
+    manager.generateDailyReport();
+    return 0;
+}
+
+// Merge terminal backups into one snapshot and print the per-store totals
+int runConsolidate(const vector<string>& paths, const string& outputPath, size_t threads) {
+    ConsolidationResult result;
+    try {
+        SnapshotConsolidator consolidator(threads);
+        result = consolidator.run(paths, outputPath);
+    }
+    catch (exception& e) {
+        cout << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+
+    cout << "\n========================================" << endl;
+    cout << "===      CONSOLIDATION SUMMARY      ===" << endl;
+    cout << "========================================" << endl;
+    cout << "Backups: " << result.files << " (" << result.bytes << " bytes";
+    if (result.unreadable > 0) cout << ", " << result.unreadable << " unreadable";
+    cout << ")" << endl;
+    cout << "Records: " << result.records << " written to " << outputPath << " (" << result.duplicates
+         << " duplicates dropped)" << endl;
+    cout << "Colliding Payment IDs: " << result.collisions << endl;
+    for (const CollidingId& id : result.collidingIds) {
+        cout << "  PAY-" << id.paymentId << ":";
+        for (size_t i = 0; i < id.terminals.size(); i++) {
+            cout << (i == 0 ? " store " : ", store ") << id.terminals[i].storeId << " terminal "
+                 << id.terminals[i].terminalId;
+        }
+        cout << endl;
+    }
+    if (result.collisions > result.collidingIds.size()) cout << "  ..." << endl;
+    cout << "Threads: " << result.threads << endl;
+    cout << fixed << setprecision(3);
+    cout << "Read: " << result.readMs << " ms (" << setprecision(2)
+         << (result.readMs > 0 ? result.bytes / (result.readMs * 1e6) : 0.0) << " GB/s)" << endl;
+    cout << "Merge: " << setprecision(3) << result.mergeMs << " ms" << endl;
+    cout << "Write: " << result.writeMs << " ms" << endl;
+    for (const auto& store : result.stores) {
+        ReportTotals totals;
+        totals.add(store.second.payments);
+        cout << "----------------------------------------" << endl;
+        cout << "Store " << store.first << " (" << store.second.terminals.size()
+             << (store.second.terminals.size() == 1 ? " terminal): " : " terminals): ") << totals.transactions
+             << " transactions, " << totals.successful << " completed, $" << totals.revenue << endl;
+        for (size_t m = 0; m < MethodCount; m++) {
+            if (totals.methodCounts[m] > 0) {
+                cout << "  " << methodName(PaymentMethod(m)) << ": $" << totals.methodStats[m] << endl;
+            }
+        }
+    }
+    cout << "========================================" << endl;
+    return 0;
+}
+
+// Answer a query from the journal files alone. Sealed segments whose summary
+// rules out every match are skipped; the rest, and the open segment, are read
+// on parallel threads. Adjustments name payments of their own or an earlier
+// segment and are applied to them before they are counted, so a segment
+// holding adjustments is always read, and one is skipped on its statuses only
+// when nothing after it adjusts anything.
+int runJournalQuery(const TransactionQuery& filter, const string& journalPath) {
+    auto started = chrono::steady_clock::now();
+    TransactionQuery query = filter.resolved(epochSeconds(currentEpochMicros()));
+    TransactionQuery anyStatus = query;
+    anyStatus.statuses = (1u << StatusCount) - 1;
+    vector<JournalSegment> segments = listJournalSegments(journalPath);
+    size_t sealed = segments.size();
+    vector<SegmentSummary> summaries(sealed);
+    vector<bool> summarized(sealed);
+    for (size_t i = 0; i < sealed; i++) {
+        summarized[i] = readSegmentSummary(segments[i], summaries[i]);
+    }
+    bool open = access(journalPath.c_str(), F_OK) == 0;
+    if (open) {
+        segments.push_back(JournalSegment{journalPath, ~uint64_t(0), false});
+    }
+
+    vector<vector<PaymentDetails>> records(segments.size());
+    vector<vector<PaymentAdjustment>> adjustments(segments.size());
+    atomic<size_t> unreadable(0);
+    auto load = [&](size_t i) {
+        string error;
+        if (!loadJournalSegment(segments[i], records[i], error, &adjustments[i])) unreadable++;
+    };
+    // The open segment has no summary; read it first to learn whether it adjusts anything
+    bool adjustedLater = false;
+    if (open) {
+        load(sealed);
+        adjustedLater = !adjustments[sealed].empty();
+    }
+    vector<size_t> reading;
+    size_t skipped = 0;
+    for (size_t i = sealed; i-- > 0;) {
+        if (summarized[i] && summaries[i].adjustments == 0 &&
+            !(adjustedLater ? anyStatus : query).mayMatch(summaries[i])) {
+            skipped++;
+        } else {
+            reading.push_back(i);
+        }
+        if (!summarized[i] || summaries[i].adjustments > 0) adjustedLater = true;
+    }
+
+    size_t threads = min<size_t>(segments.size(), max(1u, thread::hardware_concurrency()));
+    auto parallel = [threads](const function<void(size_t)>& work) {
+        vector<thread> workers;
+        for (size_t part = 1; part < threads; part++) {
+            workers.push_back(thread(work, part));
+        }
+        if (threads > 0) work(0);
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    };
+    atomic<size_t> next(0);
+    parallel([&](size_t) {
+        for (size_t i = next++; i < reading.size(); i = next++) {
+            load(reading[i]);
+        }
+    });
+
+    // Each adjustment carries the payment's state afterwards, so the last one wins
+    unordered_map<int, const PaymentAdjustment*> latest;
+    for (const vector<PaymentAdjustment>& segment : adjustments) {
+        for (const PaymentAdjustment& adjustment : segment) {
+            latest[adjustment.paymentId] = &adjustment;
+        }
+    }
+    vector<QueryResult> parts(threads);
+    next = 0;
+    parallel([&](size_t part) {
+        QueryAccumulator groups(query);
+        for (size_t i = next++; i < segments.size(); i = next++) {
+            for (PaymentDetails& payment : records[i]) {
+                if (!latest.empty()) {
+                    auto adjusted = latest.find(payment.paymentId);
+                    if (adjusted != latest.end()) adjusted->second->applyTo(payment);
+                }
+                groups.add(payment);
+            }
+            parts[part].scanned += records[i].size();
+        }
+        groups.finish(parts[part]);
+    });
+
+    QueryResult result;
+    for (const QueryResult& part : parts) {
+        result.merge(part);
+    }
+    result.plan = "journal segments";
+    result.threads = threads;
+    TransactionManager::printQueryReport(query, result,
+                                         chrono::duration<double, milli>(chrono::steady_clock::now() - started).count());
+    cout << "Segments: " << segments.size() - skipped << " read, " << skipped << " skipped by their summaries";
+    if (unreadable > 0) cout << ", " << unreadable << " unreadable";
+    cout << endl;
+    return unreadable == 0 ? 0 : 1;
+}
+
+#ifdef POS_BENCHMARK
+// Benchmark build: g++ -std=c++17 -O2 -pthread -DPOS_BENCHMARK pos.cpp -o pos_bench
+// Writes one JSON object per benchmark so runs can be diffed between commits.
+
+static atomic<uint64_t> allocationCount(0);
+
+// Every counted allocation comes from malloc and goes back through free.
+// Kept out of line: inlined into a delete-expression, GCC sees free() on a
+// pointer from operator new and reports a mismatch (-Wmismatched-new-delete).
+#if defined(__GNUC__)
+#define POS_NOINLINE __attribute__((noinline))
+#else
+#define POS_NOINLINE
+#endif
+
+static POS_NOINLINE void* countedAllocate(size_t size) {
+    allocationCount.fetch_add(1, memory_order_relaxed);
+    void* block = malloc(size ? size : 1);
+    if (block == nullptr) throw bad_alloc();
+    return block;
+}
+
+static POS_NOINLINE void countedRelease(void* block) noexcept {
+    free(block);
+}
+
+void* operator new(size_t size) { return countedAllocate(size); }
+void* operator new[](size_t size) { return countedAllocate(size); }
+void operator delete(void* block) noexcept { countedRelease(block); }
+void operator delete[](void* block) noexcept { countedRelease(block); }
+void operator delete(void* block, size_t) noexcept { countedRelease(block); }
+void operator delete[](void* block, size_t) noexcept { countedRelease(block); }
+
+// Sends cout to /dev/null while reports run
+struct SilencedOutput {
+    ofstream sink;
+    streambuf* saved;
+    SilencedOutput() : sink("/dev/null"), saved(cout.rdbuf(sink.rdbuf())) {}
+    ~SilencedOutput() { cout.rdbuf(saved); }
+};
+
+struct BenchResult {
+    string name;
+    size_t ops;
+    double nsPerOp;
+    double allocsPerOp;
+    uint64_t p50, p99, p999;
+};
+
+static void writeResult(ostream& out, const BenchResult& r) {
+    out << "{\"benchmark\":\"" << r.name << "\",\"ops\":" << r.ops
+        << fixed << setprecision(2) << ",\"ns_per_op\":" << r.nsPerOp
+        << ",\"allocs_per_op\":" << r.allocsPerOp
+        << ",\"p50_ns\":" << r.p50 << ",\"p99_ns\":" << r.p99 << ",\"p999_ns\":" << r.p999 << "}" << endl;
+}
+
+// Micro benchmark: an untimed-per-op pass for ns/op and allocations, then a
+// second pass timing every op for the latency distribution
+template <typename Op>
+static BenchResult runMicro(const string& name, size_t ops, Op op) {
+    BenchResult r;
+    r.name = name;
+    r.ops = ops;
+
+    uint64_t allocsBefore = allocationCount.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) op(i);
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    r.allocsPerOp = double(allocationCount.load(memory_order_relaxed) - allocsBefore) / ops;
+    r.nsPerOp = double(elapsed) / ops;
+
+    LatencyRecorder latency;
+    latency.samples.reserve(ops);
+    for (size_t i = 0; i < ops; i++) {
+        auto opStart = chrono::steady_clock::now();
+        op(ops + i);
+        latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - opStart).count()));
+    }
+    r.p50 = latency.percentile(0.50);
+    r.p99 = latency.percentile(0.99);
+    r.p999 = latency.percentile(0.999);
+    return r;
+}
+
+// Macro benchmark: one pass, every op timed
+template <typename Op>
+static BenchResult runScenario(const string& name, size_t ops, Op op) {
+    BenchResult r;
+    r.name = name;
+    r.ops = ops;
+
+    LatencyRecorder latency;
+    latency.samples.reserve(ops);
+    uint64_t allocsBefore = allocationCount.load(memory_order_relaxed);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; i++) {
+        auto opStart = chrono::steady_clock::now();
+        op(i);
+        latency.record(uint64_t(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - opStart).count()));
+    }
+    auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    r.allocsPerOp = double(allocationCount.load(memory_order_relaxed) - allocsBefore) / ops;
+    r.nsPerOp = double(elapsed) / ops;
+    r.p50 = latency.percentile(0.50);
+    r.p99 = latency.percentile(0.99);
+    r.p999 = latency.percentile(0.999);
+    return r;
+}
+
+// Sealed segments, text or archived, of a benchmark journal
+static void removeJournalSegments(const string& journalPath) {
+    for (const JournalSegment& segment : listJournalSegments(journalPath)) {
+        unlink(journalSegmentPath(journalPath, segment.sequence, ".log").c_str());
+        unlink(journalSegmentPath(journalPath, segment.sequence, ".col").c_str());
+    }
+}
+
+// Journal settings for CPU-bound runs: nothing waits for the disk
+static JournalConfig lazyJournal(const string& path) {
+    JournalConfig config;
+    config.path = path;
+    for (auto& entry : config.methodDurability) {
+        entry.second = DurabilityMode::Lazy;
+    }
+    return config;
+}
+
+// One payment of a mixed workload: 40% cash, 20% credit, 20% debit, 20% mobile
+static void mixedPayment(PaymentProcessor& processor, TransactionManager& manager, size_t i) {
+    static const char* providers[] = {"PayPal", "Apple Pay", "Google Pay"};
+    Money amount = Money::fromCents(100 + int64_t(i % 30000));
+    switch (i % 5) {
+        case 0:
+        case 1:
+            if (processor.processCashPayment(amount, amount + Money::fromCents(500))) {
+                manager.addTransaction(processor.getCurrentPayment());
+            }
+            break;
+        case 2:
+            processor.processCardPayment(amount, "4111111111111111", "12/27", "123", PaymentMethod::CreditCard);
+            manager.addTransaction(processor.getCurrentPayment());
+            break;
+        case 3:
+            processor.processCardPayment(amount, "5500000000000004", "01/28", "456", PaymentMethod::DebitCard);
+            manager.addTransaction(processor.getCurrentPayment());
+            break;
+        default:
+            processor.processMobilePayment(amount, providers[(i / 5) % 3]);
+            manager.addTransaction(processor.getCurrentPayment());
+            break;
+    }
+}
+
+// Usage: pos_bench [--quick] [--out FILE]
+int runBenchmarks(int argc, char* argv[]) {
+    bool quick = false;
+    string outPath;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--out" && i + 1 < argc) {
+            outPath = argv[++i];
+        } else {
+            cerr << "usage: pos_bench [--quick] [--out FILE]" << endl;
+            return 1;
+        }
+    }
+    ofstream outFile;
+    if (!outPath.empty()) {
+        outFile.open(outPath);
+        if (!outFile.is_open()) {
+            cerr << "ERROR: Cannot open " << outPath << endl;
+            return 1;
+        }
+    }
+    ostream& out = outPath.empty() ? cout : outFile;
+
+    // Work in a scratch directory so journals and snapshots stay out of the way
+    char scratch[] = "/tmp/pos_bench.XXXXXX";
+    if (mkdtemp(scratch) == nullptr || chdir(scratch) != 0) {
+        cerr << "ERROR: Cannot create scratch directory" << endl;
+        return 1;
+    }
+
+    PaymentProcessor processor;
+    processor.setVerbose(false);
+
+    // Payment hot paths in isolation
+    writeResult(out, runMicro("validateCard", 1000000, [&](size_t) {
+        processor.validateCard("4111 1111 1111 1111", "12/27", "123");
+    }));
+    // Codes are a pure function of the payment ID; summed so none is optimized away
+    uint64_t codeSum = 0;
+    writeResult(out, runMicro("generateAuthorizationCode", 1000000, [&](size_t i) {
+        codeSum += uint8_t(processor.generateAuthorizationCode(int(1001 + i)).data()[10]);
+    }));
+    if (codeSum == 0) cerr << "ERROR: No authorization codes generated" << endl;
+    writeResult(out, runMicro("processCardPayment", 200000, [&](size_t i) {
+        processor.processCardPayment(Money::fromCents(1000 + int64_t(i % 100) * 100), "4111111111111111", "12/27", "123",
+                                     PaymentMethod::CreditCard);
+    }));
+    writeResult(out, runMicro("processMobilePayment", 200000, [&](size_t i) {
+        processor.processMobilePayment(Money::fromCents(1000 + int64_t(i % 100) * 100), "Apple Pay");
+    }));
+    {
+        // Every key is submitted twice, as a retried payment would be
+        PaymentProcessor keyed;
+        keyed.setVerbose(false);
+        keyed.setIdempotencyCache(make_shared<IdempotencyCache>());
+        char key[24] = "RETRY-";
+        writeResult(out, runMicro("processMobilePayment_keyed", 200000, [&](size_t i) {
+            char* end = to_chars(key + 6, key + sizeof(key), i / 2).ptr;
+            keyed.processMobilePayment(Money::fromCents(1000 + int64_t(i / 2 % 100) * 100), "Apple Pay",
+                                       string_view(key, size_t(end - key)));
+        }));
+    }
+    {
+        PaymentDetails receipt = *processor.getCurrentPayment();
+        char text[ReceiptPrinter::ReceiptCapacity];
+        writeResult(out, runMicro("renderReceipt", 1000000, [&](size_t i) {
+            receipt.paymentId = int(i);
+            ReceiptPrinter::render(receipt, text);
+        }));
+    }
+
+    {
+        TransactionManager manager(lazyJournal("add_transaction.txt"));
+        PaymentDetails templates[4];
+        processor.processCashPayment(Money::fromCents(1250), Money::fromCents(2000));
+        templates[0] = *processor.getCurrentPayment();
+        processor.processCardPayment(Money::fromCents(4000), "4111111111111111", "12/27", "123", PaymentMethod::CreditCard);
+        templates[1] = *processor.getCurrentPayment();
+        processor.processCardPayment(Money::fromCents(6000), "5500000000000004", "01/28", "456", PaymentMethod::DebitCard);
+        templates[2] = *processor.getCurrentPayment();
+        processor.processMobilePayment(Money::fromCents(800), "Google Pay");
+        templates[3] = *processor.getCurrentPayment();
+        PaymentDetails payment;
+        writeResult(out, runMicro("addTransaction", 200000, [&](size_t i) {
+            payment = templates[i % 4];
+            payment.paymentId = int(100000 + i);
+            payment.timestamp = currentEpochMicros();   // stamped as the processor would
+            manager.addTransaction(&payment);
+        }));
+
+        // Adjustments are always fsynced, so this is mostly the disk
+        PaymentAdjustment adjustment;
+        string error;
+        writeResult(out, runMicro("adjustTransaction", 2000, [&](size_t i) {
+            manager.adjustTransaction(int(100000 + i), AdjustmentKind::Refund, Money::fromCents(1), adjustment, error);
+        }));
+    }
+
+    {
+        TransactionManager manager(lazyJournal("reports.txt"));
+        for (size_t i = 0; i < 100000; i++) {
+            mixedPayment(processor, manager, i);
+        }
+        BenchResult report, recount, history;
+        {
+            SilencedOutput silence;
+            report = runMicro("generateDailyReport_100k", 50, [&](size_t) {
+                manager.generateDailyReport();
+            });
+            // The column kernel the rollups stand in for on the report path
+            recount = runMicro("aggregate_100k", 50, [&](size_t) {
+                manager.recountTotals();
+            });
+            history = runMicro("displayTransactionHistory_100k", 5, [&](size_t) {
+                manager.displayTransactionHistory();
+            });
+        }
+        writeResult(out, report);
+        writeResult(out, recount);
+        writeResult(out, history);
+
+        // One query per plan: index, full scan, rollups
+        TransactionQuery failedDebit, midRange, byMethod;
+        failedDebit.methods = 1u << size_t(PaymentMethod::DebitCard);
+        failedDebit.statuses = 1u << size_t(PaymentStatus::Failed);
+        failedDebit.minAmount = Money::fromCents(20000);
+        midRange.minAmount = Money::fromCents(5000);
+        midRange.maxAmount = Money::fromCents(15000);
+        midRange.groupBy = QueryGroup::Hour;
+        byMethod.groupBy = QueryGroup::Method;
+        writeResult(out, runMicro("runQuery_indexed_100k", 200, [&](size_t) { manager.runQuery(failedDebit); }));
+        writeResult(out, runMicro("runQuery_scan_100k", 50, [&](size_t) { manager.runQuery(midRange); }));
+        writeResult(out, runMicro("runQuery_rollups_100k", 10000, [&](size_t) { manager.runQuery(byMethod); }));
+    }
+    {
+        // Reload the journal the block above wrote, as the --import tool does
+        JournalImporter importer(0, "import_rejects.txt");
+        writeResult(out, runMicro("importJournal_100k", 5, [&](size_t) {
+            TransactionManager imported(lazyJournal("/dev/null"));
+            importer.run(vector<string>(1, "reports.txt"), imported);
+        }));
+    }
+    {
+        // The same journal sealed, then read back as a text segment and as an archive
+        {
+            JournalConfig config = lazyJournal("reports.txt");
+            config.archiveSealed = false;
+            TransactionJournal journal(config);
+            journal.seal();
+        }
+        atomic<bool> stop(false);
+        compactJournalSegments("reports.txt", false, stop);
+        JournalSegment text{journalSegmentPath("reports.txt", 0, ".log"), 0, false};
+        vector<PaymentDetails> records;
+        string error;
+        writeResult(out, runMicro("loadSegment_text_100k", 5, [&](size_t) {
+            records.clear();
+            loadJournalSegment(text, records, error);
+        }));
+        compactJournalSegments("reports.txt", true, stop);
+        JournalSegment archive{journalSegmentPath("reports.txt", 0, ".col"), 0, true};
+        writeResult(out, runMicro("loadSegment_archive_100k", 5, [&](size_t) {
+            records.clear();
+            loadJournalSegment(archive, records, error);
+        }));
+    }
+    {
+        // Eight terminals' backups, the same payment IDs on each
+        vector<string> backups;
+        mt19937 rng(7);
+        for (uint32_t terminal = 0; terminal < 8; terminal++) {
+            backups.push_back("terminal_" + to_string(terminal) + ".dat");
+            SnapshotWriter writer(backups.back(), terminal / 4, terminal);
+            int64_t when = 1760000000;
+            for (int i = 0; i < 12500; i++) {
+                when += rng() % 4;
+                writer.add(1001 + i, methodName(PaymentMethod(rng() % MethodCount)), 100 + rng() % 30000, when,
+                           SnapshotCompleted, "AUTH-" + to_string(rng() % 1000000));
+            }
+            writer.finish();
+        }
+        SnapshotConsolidator consolidator;
+        writeResult(out, runMicro("consolidateSnapshots_100k", 5, [&](size_t) {
+            consolidator.run(backups, "consolidated.dat");
+        }));
+        for (const string& backup : backups) {
+            unlink(backup.c_str());
+        }
+    }
+
+    {
+        // A zero-latency local gateway: one blocking round trip at a time, then
+        // many requests in flight on the pipelined connections
+        GatewayServerConfig serverConfig;
+        serverConfig.address = "unix:gateway.sock";
+        serverConfig.latency.shape = LatencyDistribution::Fixed;
+        serverConfig.latency.low = chrono::microseconds(0);
+        GatewayServer server(serverConfig);
+        GatewayClientConfig clientConfig;
+        clientConfig.address = serverConfig.address;
+        clientConfig.timeout = chrono::microseconds(1000000);
+        SocketGatewayClient client(clientConfig);
+        string error;
+        if (server.start(error) && client.start(error)) {
+            PaymentDetails payment;
+            payment.paymentMethod = PaymentMethod::CreditCard;
+            payment.amount = Money::fromCents(4000);
+            writeResult(out, runMicro("gatewayRoundTrip", 20000, [&](size_t i) {
+                payment.paymentId = int(100000 + i);
+                client.authorizeAndWait(payment);
+            }));
+
+            const size_t requests = 100000;
+            mutex doneMutex;
+            condition_variable doneSignal;
+            size_t answered = 0;
+            writeResult(out, runScenario("gatewayPipelined_100k", requests, [&](size_t i) {
+                payment.paymentId = int(100000 + i);
+                client.authorize(payment, [&](const GatewayReply&) {
+                    lock_guard<mutex> lock(doneMutex);
+                    if (++answered == requests) doneSignal.notify_one();
+                });
+                if (i + 1 == requests) {
+                    unique_lock<mutex> lock(doneMutex);
+                    doneSignal.wait(lock, [&] { return answered == requests; });
+                }
+            }));
+        } else {
+            cerr << "ERROR: Gateway benchmark skipped: " << error << endl;
+        }
+    }
+
+    // End-to-end scenarios: process + record, mixed payment methods
+    vector<pair<string, size_t>> scales = {{"1k", 1000}, {"100k", 100000}};
+    if (!quick) {
+        scales.push_back(make_pair(string("10m"), size_t(10000000)));
+    }
+    for (const auto& scale : scales) {
+        string journalPath = "scenario_" + scale.first + ".txt";
+        TransactionManager manager(lazyJournal(journalPath));
+        writeResult(out, runScenario("scenario_mixed_" + scale.first, scale.second, [&](size_t i) {
+            mixedPayment(processor, manager, i);
+        }));
+        if (scale.second >= 10000000) {
+            // Report aggregation over a full day's worth of records
+            BenchResult report;
+            {
+                SilencedOutput silence;
+                report = runMicro("generateDailyReport_" + scale.first, 5, [&](size_t) {
+                    manager.generateDailyReport();
+                });
+            }
+            writeResult(out, report);
+            writeResult(out, runMicro("aggregate_" + scale.first, 5, [&](size_t) {
+                manager.recountTotals();
+            }));
+        }
+        unlink(journalPath.c_str());
+        removeJournalSegments(journalPath);
+    }
+    {
+        // Production durability: card and mobile payments wait for fsync
+        JournalConfig durable;
+        durable.path = "scenario_durable.txt";
+        TransactionManager manager(durable);
+        writeResult(out, runScenario("scenario_mixed_1k_durable", 1000, [&](size_t i) {
+            mixedPayment(processor, manager, i);
+        }));
+    }
+
+    // Clean up the scratch directory
+    const char* leftovers[] = {"add_transaction.txt", "reports.txt", "scenario_durable.txt", "payment_errors.log",
+                               "import_rejects.txt", "consolidated.dat", "gateway.sock"};
+    for (const char* name : leftovers) {
+        unlink(name);
+        removeJournalSegments(name);
+    }
+    if (chdir("/") == 0) {
+        rmdir(scratch);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    return runBenchmarks(argc, argv);
+}
+
+#else
+
+// Main function
+int main(int argc, char* argv[]) {
+    if (argc == 3 && string(argv[1]) == "--snapshot-report") {
+        return reportFromSnapshot(argv[2]);
+    }
+    if (argc >= 3 && string(argv[1]) == "--import") {
+        vector<string> paths;
+        size_t threads = 0;
+        string rejectPath = "rejected_lines.txt";
+        for (int i = 2; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--threads" && i + 1 < argc) {
+                threads = size_t(atoi(argv[++i]));
+            } else if (option == "--rejects" && i + 1 < argc) {
+                rejectPath = argv[++i];
+            } else {
+                paths.push_back(option);
+            }
+        }
+        return runImport(paths, threads, rejectPath);
+    }
+    if (argc >= 4 && string(argv[1]) == "--consolidate") {
+        vector<string> paths;
+        size_t threads = 0;
+        for (int i = 3; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--threads" && i + 1 < argc) {
+                threads = size_t(atoi(argv[++i]));
+            } else {
+                paths.push_back(option);
+            }
+        }
+        return runConsolidate(paths, argv[2], threads);
+    }
+    if (argc >= 2 && string(argv[1]) == "--journal-query") {
+        string journalPath = JournalConfig().path;
+        vector<string_view> words;
+        for (int i = 2; i < argc; i++) {
+            if (string(argv[i]) == "--journal" && i + 1 < argc) {
+                journalPath = argv[++i];
+            } else {
+                words.push_back(argv[i]);
+            }
+        }
+        TransactionQuery query;
+        string error;
+        if (!parseQuery(words, 0, query, error)) {
+            cerr << "Invalid query: " << error << endl;
+            return 1;
+        }
+        return runJournalQuery(query, journalPath);
+    }
+    if (argc >= 3 && string(argv[1]) == "--gateway-server") {
+        GatewayServerConfig config;
+        config.address = argv[2];
+        for (int i = 3; i < argc; i++) {
+            string option = argv[i];
+            long every = 0, down = 0;
+            if (option == "--latency" && i + 1 < argc && parseLatencyDistribution(argv[i + 1], config.latency)) {
+                i++;
+            } else if (option == "--decline" && i + 1 < argc) {
+                string rates = argv[++i];
+                if (sscanf(rates.c_str(), "%u:%u", &config.cardDeclinePercent, &config.mobileDeclinePercent) != 2) {
+                    config.cardDeclinePercent = config.mobileDeclinePercent = unsigned(atoi(rates.c_str()));
+                }
+            } else if (option == "--seed" && i + 1 < argc) {
+                uint64_t seed;
+                if (!parseSimulationSeed(argv[++i], seed)) {
+                    cout << "ERROR: Invalid seed " << argv[i] << endl;
+                    return 1;
+                }
+                setSimulationSeed(seed);
+            } else if (option == "--outage" && i + 1 < argc && sscanf(argv[i + 1], "%ld:%ld", &every, &down) == 2 &&
+                       every > 0 && down >= 0 && down <= every) {
+                config.outageEvery = chrono::milliseconds(every);
+                config.outageFor = chrono::milliseconds(down);
+                i++;
+            } else {
+                cout << "ERROR: Unknown gateway option " << option << endl;
+                return 1;
+            }
+        }
+        return runGatewayServer(config);
+    }
+    if (argc >= 3 && string(argv[1]) == "--batch") {
+        bool verbose = false;
+        size_t lanes = 1;
+        bool async = false;
+        AuthorizationConfig authConfig;
+        long minLatency = 2000, maxLatency = 20000;
+        shared_ptr<ReceiptPrinter> receipts;
+        string binTablePath = "bin_ranges.txt";
+        bool binTableRequired = false;
+        string metricsPath = DefaultMetricsPath;
+        long metricsSeconds = DefaultMetricsSeconds;
+        GatewayClientConfig gatewayConfig;
+        long breakerFailures = long(gatewayConfig.breakerFailures);
+        long breakerCooldown = long(gatewayConfig.breakerCooldown.count());
+        for (int i = 3; i < argc; i++) {
+            string option = argv[i];
+            if (option == "--verbose") {
+                verbose = true;
+            } else if (option == "--lanes" && i + 1 < argc) {
+                lanes = size_t(atoi(argv[++i]));
+            } else if (option == "--async") {
+                async = true;
+            } else if (option == "--auth-latency" && i + 1 < argc &&
+                       sscanf(argv[i + 1], "%ld:%ld", &minLatency, &maxLatency) == 2) {
+                i++;
+            } else if (option == "--seed" && i + 1 < argc) {
+                uint64_t seed;
+                if (!parseSimulationSeed(argv[++i], seed)) {
+                    cout << "ERROR: Invalid seed " << argv[i] << endl;
+                    return 1;
+                }
+                setSimulationSeed(seed);
+            } else if (option == "--auth-timeout" && i + 1 < argc) {
+                authConfig.timeout = chrono::microseconds(atol(argv[++i]));
+            } else if (option == "--bin-table" && i + 1 < argc) {
+                binTablePath = argv[++i];
+                binTableRequired = true;
+            } else if (option == "--receipts" && i + 1 < argc) {
+                string target = argv[++i];
+                if (target == "none") {
+                    receipts = make_shared<ReceiptPrinter>(ReceiptOutput::Discard);
+                } else {
+                    receipts = make_shared<ReceiptPrinter>(ReceiptOutput::Spool, target);
+                    if (!receipts->isOpen()) return 1;
+                }
+            } else if (option == "--metrics-file" && i + 1 < argc) {
+                metricsPath = argv[++i];
+                if (metricsPath == "none") metricsPath.clear();
+            } else if (option == "--metrics-interval" && i + 1 < argc) {
+                metricsSeconds = atol(argv[++i]);
+            } else if (option == "--gateway" && i + 1 < argc) {
+                gatewayConfig.address = argv[++i];
+            } else if (option == "--gateway-connections" && i + 1 < argc) {
+                gatewayConfig.connections = size_t(atoi(argv[++i]));
+            } else if (option == "--gateway-batch" && i + 1 < argc) {
+                gatewayConfig.maxBatch = size_t(atoi(argv[++i]));
+            } else if (option == "--gateway-breaker" && i + 1 < argc &&
+                       sscanf(argv[i + 1], "%ld:%ld", &breakerFailures, &breakerCooldown) == 2 &&
+                       breakerFailures > 0 && breakerCooldown >= 0) {
+                i++;
+            } else {
+                cout << "ERROR: Unknown batch option " << option << endl;
+                return 1;
+            }
+        }
+        shared_ptr<const BinTable> binTable = loadBinTable(binTablePath, binTableRequired);
+        if (!binTable) return 1;
+        MetricsDumper metrics(metricsPath, chrono::seconds(metricsSeconds));
+        shared_ptr<GatewayClient> gateway;
+        if (!gatewayConfig.address.empty()) {
+            gatewayConfig.timeout = authConfig.timeout;
+            gatewayConfig.breakerFailures = size_t(breakerFailures);
+            gatewayConfig.breakerCooldown = chrono::milliseconds(breakerCooldown);
+            auto client = make_shared<SocketGatewayClient>(gatewayConfig);
+            string error;
+            if (!client->start(error)) {
+                cout << "ERROR: " << error << endl;
+                return 1;
+            }
+            gateway = client;
+            authConfig.gateway = gateway;
+        }
+        unique_ptr<AuthorizationEngine> engine;
+        if (async) {
+            engine.reset(new AuthorizationEngine(authConfig, unique_ptr<AuthorizationSimulator>(
+                new DefaultAuthorizationSimulator(chrono::microseconds(minLatency), chrono::microseconds(maxLatency)))));
+        }
+        if (string(argv[2]) == "-") {
+            return runBatchMode(cin, verbose, lanes, engine.get(), receipts, binTable, gateway);
+        }
+        ifstream script(argv[2]);
+        if (!script.is_open()) {
+            cout << "ERROR: Cannot open batch file " << argv[2] << endl;
+            return 1;
+        }
+        return runBatchMode(script, verbose, lanes, engine.get(), receipts, binTable, gateway);
+    }
+
+    cout << "========================================" << endl;
+    cout << "   POINT OF SALE PAYMENT SYSTEM        " << endl;
+    cout << "   Object-Oriented Programming in C++  " << endl;
+    cout << "========================================\n" << endl;
+
+    MetricsDumper metrics(DefaultMetricsPath, chrono::seconds(DefaultMetricsSeconds));
+    runPOSSystem();
+
+    return 0;
+}
+
+#endif